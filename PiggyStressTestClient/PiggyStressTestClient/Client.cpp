@@ -46,6 +46,24 @@ DWORD WINAPI CClient::_ConnectionThread(LPVOID lpParam)
 	return 0;
 }
 
+/////////////////////////////////////////////////////////////////////////////////
+// ķ֡Э鷢һϢLEB128䳤Ϣ + Ϣ
+static int SendFrame(SOCKET sock, const char* pMessage, int nLength)
+{
+	char szFrame[5 + MAX_BUFFER_LEN];
+	int nHeader = 0;
+	unsigned int nValue = (unsigned int)nLength;
+	while (nValue >= 0x80)
+	{
+		szFrame[nHeader++] = (char)((nValue & 0x7F) | 0x80);
+		nValue >>= 7;
+	}
+	szFrame[nHeader++] = (char)nValue;
+	memcpy(szFrame + nHeader, pMessage, nLength);
+
+	return send(sock, szFrame, nHeader + nLength, 0);
+}
+
 /////////////////////////////////////////////////////////////////////////////////
 // ڷϢ߳
 DWORD WINAPI CClient::_WorkerThread(LPVOID lpParam)
@@ -65,7 +83,7 @@ DWORD WINAPI CClient::_WorkerThread(LPVOID lpParam)
 
 	// Ϣ
 	sprintf( szTemp,("First message %s"),pParams->szBuffer );
-	nBytesSent = send(pParams->sock, szTemp, strlen(szTemp), 0);
+	nBytesSent = SendFrame(pParams->sock, szTemp, (int)strlen(szTemp));
 	if (SOCKET_ERROR == nBytesSent) 
 	{
 		TRACE("󣺷1Ϣʧܣ룺%ld\n", WSAGetLastError());
@@ -78,7 +96,7 @@ DWORD WINAPI CClient::_WorkerThread(LPVOID lpParam)
 	// ٷһϢ
 	memset( szTemp,0,sizeof(szTemp) );
 	sprintf( szTemp,("Second message:%s"),pParams->szBuffer );
-	nBytesSent = send(pParams->sock, szTemp, strlen(szTemp), 0);
+	nBytesSent = SendFrame(pParams->sock, szTemp, (int)strlen(szTemp));
 	if (SOCKET_ERROR == nBytesSent) 
 	{
 		TRACE("󣺷͵2Ϣʧܣ룺%ld\n", WSAGetLastError());
@@ -92,7 +110,7 @@ DWORD WINAPI CClient::_WorkerThread(LPVOID lpParam)
 	// 3Ϣ
 	memset( szTemp,0,sizeof(szTemp) );
 	sprintf( szTemp,("Third message:%s"),pParams->szBuffer );
-	nBytesSent = send(pParams->sock, szTemp, strlen(szTemp), 0);
+	nBytesSent = SendFrame(pParams->sock, szTemp, (int)strlen(szTemp));
 	if (SOCKET_ERROR == nBytesSent) 
 	{
 		TRACE("󣺷͵3Ϣʧܣ룺%ld\n", WSAGetLastError());
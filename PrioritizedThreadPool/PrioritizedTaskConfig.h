@@ -8,9 +8,12 @@ namespace BitFunnel
     // PrioritizedTaskConfig specifies a task scheduling schema which is used
     // to determine the scheduling priority of a task.
     //
-    // A task can belong to one of the following types, which are High, Medium, 
-    // and Low. Please note that the type of a task doesn't specify the priority
-    // of the task. The priority of a task is always dynamically determined during
+    // A task belongs to one of the types a pool is configured with, numbered
+    // from zero; the first three are named High, Medium and Low, and any other
+    // is a static_cast of its number to Type. A pool takes one config per type,
+    // so it can isolate as many classes of work as it needs, up to
+    // PrioritizedTaskQueues::c_maxTypeCount. Please note that the type of a task
+    // doesn't specify the priority of the task. The priority of a task is always dynamically determined during
     // runtime. The scheduling schema of a task is specified by two variables, 
     // which are priorityGrantingThreshold and maxThreadCount.
     //
@@ -32,20 +35,23 @@ namespace BitFunnel
     // The maxThreadCount specifies the maximum number of threads could be allocated
     // for a task of certain type to avoid starvation of other types of tasks.
     //
-    // If multiple types of tasks have higher scheduling priority, a random one
-    // is selected. If no type of task have higher scheduling priority, then a 
-    // random one which is legal to run is selected.
+    // If multiple types of tasks have higher scheduling priority, the one with
+    // the lowest number is selected. If no type of task have higher scheduling
+    // priority, then the lowest numbered one which is legal to run is selected.
     //
     //*************************************************************************
     class PrioritizedTaskConfig
     {
     public:
-        enum Type
+        // Any value of the underlying type is a valid Type, not only the named ones.
+        enum Type : unsigned __int32
         {
             High = 0,
             Medium = 1,
             Low = 2,
 
+            // The number of the named types above, the types of a pool with the
+            // default High, Medium and Low configs.
             TypeCount = 3
         };
 
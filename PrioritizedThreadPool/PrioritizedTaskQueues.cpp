@@ -1,5 +1,7 @@
 #include "stdafx.h"
 
+#include <atomic>
+#include <intrin.h>
 #include <thread>
 
 #include "BitFunnel/AsyncTask.h"
@@ -10,76 +12,80 @@
 
 namespace BitFunnel
 {
-    PrioritizedTaskQueues::PrioritizedTaskSchedulingData::PrioritizedTaskSchedulingData()
-        : m_taskConfig(PrioritizedTaskConfig::TypeCount, 0, 0),
-          m_currentConsumedThreadCount(0),
-          m_queuedTaskCount(0)
+    // Number of tasks each type can queue without a lock, a power of two.
+    static const size_t c_taskQueueCapacity = 1 << 14;
+
+
+    // Position of the lowest set bit; value is not 0.
+    static unsigned LowestSetBit(unsigned __int64 value)
     {
+        unsigned long bit;
+        _BitScanForward64(&bit, value);
+        return static_cast<unsigned>(bit);
     }
 
 
     PrioritizedTaskQueues::PrioritizedTaskSchedulingData::PrioritizedTaskSchedulingData(PrioritizedTaskConfig const & config)
         : m_taskConfig(config),
-          m_currentConsumedThreadCount(0),
-          m_queuedTaskCount(0)
+          m_currentConsumedThreadCount(0)
     {
-        EvaluateTaskRunValidity();
     }
 
 
-    void PrioritizedTaskQueues::PrioritizedTaskSchedulingData::EvaluateTaskRunValidity()
-    {
-        m_isAtPriorityToRun = (m_queuedTaskCount > 0 && m_currentConsumedThreadCount <= m_taskConfig.GetPriorityGrantingThreshold());
-        m_isLegalToRun = (m_queuedTaskCount > 0 && m_currentConsumedThreadCount < m_taskConfig.GetMaxThreadCount());
-    }
-
-    unsigned __int32 PrioritizedTaskQueues::PrioritizedTaskSchedulingData::GetCurrentConsumedThreadCount() const
+    bool PrioritizedTaskQueues::PrioritizedTaskSchedulingData::TryConsumeThreadAtPriority()
     {
-        return m_currentConsumedThreadCount;
-    }
+        unsigned __int32 consumedThreadCount = m_currentConsumedThreadCount.load();
 
+        while (consumedThreadCount <= m_taskConfig.GetPriorityGrantingThreshold())
+        {
+            if (m_currentConsumedThreadCount.compare_exchange_weak(consumedThreadCount, consumedThreadCount + 1))
+            {
+                return true;
+            }
+        }
 
-    void PrioritizedTaskQueues::PrioritizedTaskSchedulingData::ConsumeThread()
-    {
-        LogAssertB(m_queuedTaskCount > 0);
-
-        m_currentConsumedThreadCount++;
-        m_queuedTaskCount--;
-        EvaluateTaskRunValidity();
+        return false;
     }
 
 
-    void PrioritizedTaskQueues::PrioritizedTaskSchedulingData::ReturnThread()
+    bool PrioritizedTaskQueues::PrioritizedTaskSchedulingData::TryConsumeThreadIfLegal()
     {
-        LogAssertB(m_currentConsumedThreadCount > 0);
+        unsigned __int32 consumedThreadCount = m_currentConsumedThreadCount.load();
+
+        while (consumedThreadCount < m_taskConfig.GetMaxThreadCount())
+        {
+            if (m_currentConsumedThreadCount.compare_exchange_weak(consumedThreadCount, consumedThreadCount + 1))
+            {
+                return true;
+            }
+        }
 
-        m_currentConsumedThreadCount--;
-        EvaluateTaskRunValidity();
+        return false;
     }
 
 
-    void PrioritizedTaskQueues::PrioritizedTaskSchedulingData::PostTask()
+    void PrioritizedTaskQueues::PrioritizedTaskSchedulingData::ConsumeThread()
     {
-        m_queuedTaskCount++;
-        EvaluateTaskRunValidity();
+        m_currentConsumedThreadCount++;
     }
 
 
-    bool PrioritizedTaskQueues::PrioritizedTaskSchedulingData::HasTasks() const
+    void PrioritizedTaskQueues::PrioritizedTaskSchedulingData::ReturnThread()
     {
-        return m_queuedTaskCount > 0;
+        const unsigned __int32 consumedThreadCount = m_currentConsumedThreadCount--;
+        LogAssertB(consumedThreadCount > 0);
     }
 
 
     bool PrioritizedTaskQueues::PrioritizedTaskSchedulingData::IsLegalToRun() const
     {
-        return m_isLegalToRun;
+        return (m_currentConsumedThreadCount.load() < m_taskConfig.GetMaxThreadCount());
     }
 
 
     bool PrioritizedTaskQueues::PrioritizedTaskSchedulingData::IsAtPriorityToRun() const
     {
-        return m_isAtPriorityToRun;
+        return (m_currentConsumedThreadCount.load() <= m_taskConfig.GetPriorityGrantingThreshold());
     }
 
 
@@ -138,10 +144,203 @@ namespace BitFunnel
     }
 
 
+    PrioritizedTaskQueues::TaskQueue::TaskQueue()
+        : m_cells(new Cell[c_taskQueueCapacity]),
+          m_pushPosition(0),
+          m_popPosition(0),
+          m_spilledCount(0)
+    {
+        // Cell i is first written by the push at position i.
+        for (size_t i = 0; i < c_taskQueueCapacity; ++i)
+        {
+            m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+            m_cells[i].m_task = nullptr;
+        }
+    }
+
+
+    PrioritizedTaskQueues::TaskQueue::~TaskQueue()
+    {
+    }
+
+
+    bool PrioritizedTaskQueues::TaskQueue::TryPushToRing(AsyncTask* task)
+    {
+        size_t position = m_pushPosition.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            Cell& cell = m_cells[position & (c_taskQueueCapacity - 1)];
+            const size_t sequence = cell.m_sequence.load(std::memory_order_acquire);
+            const ptrdiff_t difference = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(position);
+
+            if (difference == 0)
+            {
+                // The cell is free for this position; claim it.
+                if (m_pushPosition.compare_exchange_weak(position, position + 1))
+                {
+                    cell.m_task = task;
+                    cell.m_sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                // The cell still holds the task pushed one lap ago: the ring is full.
+                return false;
+            }
+            else
+            {
+                // Another producer took this position.
+                position = m_pushPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+
+    AsyncTask* PrioritizedTaskQueues::TaskQueue::TryPopFromRing()
+    {
+        size_t position = m_popPosition.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            Cell& cell = m_cells[position & (c_taskQueueCapacity - 1)];
+            const size_t sequence = cell.m_sequence.load(std::memory_order_acquire);
+            const ptrdiff_t difference = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(position + 1);
+
+            if (difference == 0)
+            {
+                // The cell holds the task for this position; claim it.
+                if (m_popPosition.compare_exchange_weak(position, position + 1))
+                {
+                    AsyncTask* task = cell.m_task;
+
+                    // Hand the cell to the push one lap ahead.
+                    cell.m_sequence.store(position + c_taskQueueCapacity, std::memory_order_release);
+                    return task;
+                }
+            }
+            else if (difference < 0)
+            {
+                // Nothing has been pushed at this position yet: the ring is empty.
+                return nullptr;
+            }
+            else
+            {
+                // Another consumer took this position.
+                position = m_popPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+
+    void PrioritizedTaskQueues::TaskQueue::Push(AsyncTask* task)
+    {
+        if (m_spilledCount.load() == 0 && TryPushToRing(task))
+        {
+            return;
+        }
+
+        LockGuard lock(m_spillLock);
+        m_spilledTasks.push_back(task);
+        m_spilledCount++;
+    }
+
+
+    AsyncTask* PrioritizedTaskQueues::TaskQueue::TryPop()
+    {
+        AsyncTask* task = TryPopFromRing();
+
+        if (task == nullptr && m_spilledCount.load() > 0)
+        {
+            LockGuard lock(m_spillLock);
+            if (!m_spilledTasks.empty())
+            {
+                task = m_spilledTasks.front();
+                m_spilledTasks.pop_front();
+                m_spilledCount--;
+            }
+        }
+
+        return task;
+    }
+
+
+    size_t PrioritizedTaskQueues::TaskQueue::GetCount() const
+    {
+        // Read the pop position first, so that the difference is never negative.
+        const size_t popPosition = m_popPosition.load();
+        const size_t pushPosition = m_pushPosition.load();
+
+        return (pushPosition - popPosition) + m_spilledCount.load();
+    }
+
+
+    PrioritizedTaskQueues::LocalTaskQueue::LocalTaskQueue()
+        : m_count(0)
+    {
+    }
+
+
+    void PrioritizedTaskQueues::LocalTaskQueue::PushBack(AsyncTask* task)
+    {
+        LockGuard lock(m_lock);
+        m_tasks.push_back(task);
+        m_count++;
+    }
+
+
+    AsyncTask* PrioritizedTaskQueues::LocalTaskQueue::PopBack()
+    {
+        if (m_count.load() == 0)
+        {
+            return nullptr;
+        }
+
+        LockGuard lock(m_lock);
+        if (m_tasks.empty())
+        {
+            return nullptr;
+        }
+
+        AsyncTask* task = m_tasks.back();
+        m_tasks.pop_back();
+        m_count--;
+
+        return task;
+    }
+
+
+    AsyncTask* PrioritizedTaskQueues::LocalTaskQueue::TrySteal()
+    {
+        if (m_count.load() == 0 || !m_lock.TryLock())
+        {
+            return nullptr;
+        }
+
+        AsyncTask* task = nullptr;
+        if (!m_tasks.empty())
+        {
+            task = m_tasks.front();
+            m_tasks.pop_front();
+            m_count--;
+        }
+        m_lock.Unlock();
+
+        return task;
+    }
+
+
+    size_t PrioritizedTaskQueues::LocalTaskQueue::GetCount() const
+    {
+        return m_count.load();
+    }
+
+
     bool IsPrioritizedTaskConfigValid(std::vector<PrioritizedTaskConfig> const & configList,
                                       unsigned __int32 totalThreadCount)
     {
-        if (configList.size() != PrioritizedTaskConfig::TypeCount)
+        if (configList.empty() || configList.size() > PrioritizedTaskQueues::c_maxTypeCount)
         {
             return false;
         }
@@ -150,7 +349,7 @@ namespace BitFunnel
         {
             PrioritizedTaskConfig const & config = configList[i];
 
-            // The config must be in the order of the enum value defined in PrioritizedTaskConfig::Type.
+            // The config must be in the order of the types, which are numbered from zero.
             if (static_cast<unsigned>(config.GetType()) != i)
             {
                 return false;
@@ -168,9 +367,12 @@ namespace BitFunnel
 
     PrioritizedTaskQueues::PrioritizedTaskQueues(std::vector<PrioritizedTaskConfig> const & configList,
                                                  unsigned __int32 totalThreadCount,
-                                                 unsigned __int32 concurrentThreadCount)
-        : m_availableThreadCount(totalThreadCount),
-          m_totalThreadCount(totalThreadCount)
+                                                 unsigned __int32 concurrentThreadCount,
+                                                 unsigned __int32 workerCount /* = 0 */)
+        : m_typeCount(static_cast<unsigned>(configList.size())),
+          m_totalThreadCount(totalThreadCount),
+          m_availableThreadCount(totalThreadCount),
+          m_readyTypeMask(0)
     {
         // Validate the list of configurations.
         if (concurrentThreadCount > totalThreadCount)
@@ -183,88 +385,115 @@ namespace BitFunnel
             throw BitFunnelError("Invalid PrioritizedTaskConfig list.");
         }
 
-        for (unsigned i = 0; i < configList.size(); ++i)
+        m_prioritizedTaskSchedulingDataList.reserve(m_typeCount);
+        for (unsigned i = 0; i < m_typeCount; ++i)
         {
-            m_prioritizedTaskSchedulingDataList[i] = configList[i];
+            m_prioritizedTaskSchedulingDataList.push_back(
+                std::unique_ptr<PrioritizedTaskSchedulingData>(new PrioritizedTaskSchedulingData(configList[i])));
         }
 
-        // Create IOCompletionPorts.
-        for (unsigned i = 0; i < PrioritizedTaskConfig::TypeCount; ++i)
-        {
-            m_prioritizedQueueHandles[i] = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE,
-                                                                    NULL,
-                                                                    NULL,
-                                                                    concurrentThreadCount);
+        m_taskQueues.reset(new TaskQueue[m_typeCount]);
 
-            LogAssertB(m_prioritizedQueueHandles[i] != NULL);
+        m_workerTaskQueues.reserve(workerCount);
+        for (unsigned __int32 i = 0; i < workerCount; ++i)
+        {
+            m_workerTaskQueues.push_back(std::unique_ptr<LocalTaskQueue[]>(new LocalTaskQueue[m_typeCount]));
         }
     }
 
 
     PrioritizedTaskQueues::~PrioritizedTaskQueues()
     {
-        for (unsigned i = 0; i < PrioritizedTaskConfig::TypeCount; ++i)
+    }
+
+
+    unsigned PrioritizedTaskQueues::GetTypeCount() const
+    {
+        return m_typeCount;
+    }
+
+
+    size_t PrioritizedTaskQueues::GetQueuedTaskCount(unsigned taskType) const
+    {
+        size_t queuedTaskCount = m_taskQueues[taskType].GetCount();
+
+        for (auto const & workerTaskQueues : m_workerTaskQueues)
         {
-            CloseHandle(m_prioritizedQueueHandles[i]);
+            queuedTaskCount += workerTaskQueues[taskType].GetCount();
         }
+
+        return queuedTaskCount;
     }
 
 
-    bool PrioritizedTaskQueues::TryGetTask(bool isExitMode, unsigned& taskType)
+    void PrioritizedTaskQueues::MarkTypeReady(unsigned taskType)
     {
-        LockGuard lock(m_lock);
+        const unsigned __int64 typeBit = 1ull << taskType;
 
-        if (m_availableThreadCount == 0)
+        // Most tasks are queued behind others of their type; only the first
+        // needs the read-modify-write.
+        if ((m_readyTypeMask.load() & typeBit) == 0)
         {
-            return false;
+            m_readyTypeMask.fetch_or(typeBit);
         }
+    }
 
-        for (uint32_t iterationCnt = 0; iterationCnt < PrioritizedTaskConfig::TypeCount; ++iterationCnt)
-        {
-            if (m_prioritizedTaskSchedulingDataList[iterationCnt].IsAtPriorityToRun())
-            {
-                taskType = iterationCnt;
 
-                // Allocate thread for the next job.
-                m_prioritizedTaskSchedulingDataList[taskType].ConsumeThread();
-                m_availableThreadCount--;
+    void PrioritizedTaskQueues::UnmarkTypeReady(unsigned taskType)
+    {
+        const unsigned __int64 typeBit = 1ull << taskType;
 
-                return true;
-            }
-        }
+        m_readyTypeMask.fetch_and(~typeBit);
 
-        // Second look for Task types that are legal to run.
-        for (uint32_t iterationCnt = 0; iterationCnt < PrioritizedTaskConfig::TypeCount; ++iterationCnt)
+        // A task queued before the bit was cleared may have found it still set
+        // and left it alone; look again so that it is not missed.
+        if (GetQueuedTaskCount(taskType) > 0)
         {
-            if (m_prioritizedTaskSchedulingDataList[iterationCnt].IsLegalToRun())
-            {
-                taskType = iterationCnt;
+            m_readyTypeMask.fetch_or(typeBit);
+        }
+    }
 
-                // Allocate thread for the next job.
-                m_prioritizedTaskSchedulingDataList[taskType].ConsumeThread();
-                m_availableThreadCount--;
 
-                return true;
-            }
+    AsyncTask* PrioritizedTaskQueues::PullTask(unsigned taskType, unsigned __int32 workerIndex)
+    {
+        AsyncTask* task = nullptr;
+        const size_t workerCount = m_workerTaskQueues.size();
+
+        // The newest local task first, its data is most likely still in the cache.
+        if (workerIndex < workerCount)
+        {
+            task = m_workerTaskQueues[workerIndex][taskType].PopBack();
         }
 
-        // In the special case of shutdown, look for any Task type that still has work available.
-        // Scan starts at first queue since priority doesn't matter in shutdown mode.
-        if (isExitMode)
+        if (task == nullptr)
         {
-            const unsigned size = PrioritizedTaskConfig::TypeCount;
-            for (unsigned i = 0; i < size; ++i)
+            task = m_taskQueues[taskType].TryPop();
+        }
+
+        // Then steal, starting after the worker itself so that thieves spread out.
+        const size_t firstVictim = (workerIndex < workerCount) ? workerIndex + 1 : 0;
+        for (size_t i = 0; task == nullptr && i < workerCount; ++i)
+        {
+            const size_t victim = (firstVictim + i) % workerCount;
+            if (victim != workerIndex)
             {
-                if (m_prioritizedTaskSchedulingDataList[i].HasTasks())
-                {
-                    taskType = i;
+                task = m_workerTaskQueues[victim][taskType].TrySteal();
+            }
+        }
 
-                    // Allocate thread for the next job.
-                    m_prioritizedTaskSchedulingDataList[taskType].ConsumeThread();
-                    m_availableThreadCount--;
+        return task;
+    }
 
-                    return true;
-                }
+
+    bool PrioritizedTaskQueues::TryTakeAvailableThread()
+    {
+        unsigned __int32 availableThreadCount = m_availableThreadCount.load();
+
+        while (availableThreadCount > 0)
+        {
+            if (m_availableThreadCount.compare_exchange_weak(availableThreadCount, availableThreadCount - 1))
+            {
+                return true;
             }
         }
 
@@ -272,44 +501,78 @@ namespace BitFunnel
     }
 
 
-    AsyncTask* PrioritizedTaskQueues::GetNextTask(bool isExitMode)
+    bool PrioritizedTaskQueues::TryConsumeThread(bool isExitMode, unsigned& taskType)
     {
-        unsigned nextJobType = 0;
+        const unsigned __int64 readyTypeMask = m_readyTypeMask.load();
 
-        if (TryGetTask(isExitMode, nextJobType))
+        // First look for Task types that are at priority to run, lowest type first.
+        for (unsigned __int64 candidates = readyTypeMask; candidates != 0; candidates &= candidates - 1)
         {
-            try
+            const unsigned candidate = LowestSetBit(candidates);
+            if (m_prioritizedTaskSchedulingDataList[candidate]->TryConsumeThreadAtPriority())
             {
-                return PullTask(nextJobType);
+                taskType = candidate;
+                return true;
             }
-            catch (...)
+        }
+
+        // Second look for Task types that are legal to run.
+        for (unsigned __int64 candidates = readyTypeMask; candidates != 0; candidates &= candidates - 1)
+        {
+            const unsigned candidate = LowestSetBit(candidates);
+            if (m_prioritizedTaskSchedulingDataList[candidate]->TryConsumeThreadIfLegal())
             {
-                NotifyTaskFinishInternal(static_cast<PrioritizedTaskConfig::Type>(nextJobType));
-            }           
+                taskType = candidate;
+                return true;
+            }
+        }
+
+        // In the special case of shutdown, look for any Task type that still has work available.
+        if (isExitMode && readyTypeMask != 0)
+        {
+            taskType = LowestSetBit(readyTypeMask);
+            m_prioritizedTaskSchedulingDataList[taskType]->ConsumeThread();
+            return true;
         }
-        
-        return reinterpret_cast<AsyncTask*>(nullptr);        
+
+        return false;
     }
 
 
-    AsyncTask* PrioritizedTaskQueues::PullTask(unsigned taskType)
+    AsyncTask* PrioritizedTaskQueues::TryGetTask(bool isExitMode, unsigned __int32 workerIndex)
     {
-        // Pull the job from the corresponding queue. This should be done outside of lock.
-        DWORD bytes = 0;
-        ULONG_PTR key = 0;
-        LPOVERLAPPED overlapped = NULL;
-        BOOL status = FALSE;
+        for (;;)
+        {
+            // Allocate thread for the next job.
+            if (!TryTakeAvailableThread())
+            {
+                return nullptr;
+            }
+
+            unsigned taskType = 0;
+            if (!TryConsumeThread(isExitMode, taskType))
+            {
+                m_availableThreadCount++;
+                return nullptr;
+            }
 
-        status = GetQueuedCompletionStatus(m_prioritizedQueueHandles[taskType],
-                                           &bytes,
-                                           &key,
-                                           &overlapped,
-                                           0);
+            AsyncTask* task = PullTask(taskType, workerIndex);
+            if (task != nullptr)
+            {
+                return task;
+            }
+
+            // Another thread took the last task of the type, or the queue holding
+            // it was being stolen from; give the thread back and look again.
+            UnmarkTypeReady(taskType);
+            NotifyTaskFinishInternal(static_cast<PrioritizedTaskConfig::Type>(taskType));
+        }
+    }
 
-        LogAssertB(status == TRUE);
-        LogAssertB(overlapped != nullptr);
 
-        return static_cast<AsyncTask*>(overlapped);
+    AsyncTask* PrioritizedTaskQueues::GetNextTask(bool isExitMode, unsigned __int32 workerIndex /* = c_noWorkerIndex */)
+    {
+        return TryGetTask(isExitMode, workerIndex);
     }
 
 
@@ -321,37 +584,69 @@ namespace BitFunnel
 
     void PrioritizedTaskQueues::NotifyTaskFinishInternal(PrioritizedTaskConfig::Type taskType)
     {
-        LockGuard lock(m_lock);
-
-        LogAssertB(m_availableThreadCount <= m_totalThreadCount);
+        m_prioritizedTaskSchedulingDataList[taskType]->ReturnThread();
 
-        m_prioritizedTaskSchedulingDataList[taskType].ReturnThread();
-        m_availableThreadCount++;
+        const unsigned __int32 availableThreadCount = m_availableThreadCount++;
+        LogAssertB(availableThreadCount < m_totalThreadCount);
     }
 
 
     void PrioritizedTaskQueues::PostTask(AsyncTask* taskToPost)
     {
-        const PrioritizedTaskConfig::Type type = taskToPost->GetType();
-        const BOOL success =
-            ::PostQueuedCompletionStatus(m_prioritizedQueueHandles[type],
-                                         0,
-                                         static_cast<DWORD>(0),
-                                         static_cast<LPOVERLAPPED>(taskToPost));
-         
-        LogAssertB(success || GetLastError() == ERROR_IO_PENDING);
+        const unsigned taskType = static_cast<unsigned>(taskToPost->GetType());
+        LogAssertB(taskType < m_typeCount);
 
-        LockGuard lock(m_lock);
-        m_prioritizedTaskSchedulingDataList[type].PostTask();
+        m_taskQueues[taskType].Push(taskToPost);
+        MarkTypeReady(taskType);
+    }
+
+
+    void PrioritizedTaskQueues::PostLocalTask(AsyncTask* taskToPost, unsigned __int32 workerIndex)
+    {
+        const unsigned taskType = static_cast<unsigned>(taskToPost->GetType());
+        LogAssertB(taskType < m_typeCount);
+        LogAssertB(workerIndex < m_workerTaskQueues.size());
+
+        m_workerTaskQueues[workerIndex][taskType].PushBack(taskToPost);
+        MarkTypeReady(taskType);
+    }
+
+
+    bool PrioritizedTaskQueues::HasRunnableTask(bool isExitMode)
+    {
+        // Pairs with the fence in PrioritizedThreadPool::WakeUpIdleThreads: the
+        // caller's idle count is published before the queues are looked at.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (m_availableThreadCount.load() == 0)
+        {
+            return false;
+        }
+
+        const unsigned __int64 readyTypeMask = m_readyTypeMask.load();
+        if (isExitMode && readyTypeMask != 0)
+        {
+            return true;
+        }
+
+        for (unsigned __int64 candidates = readyTypeMask; candidates != 0; candidates &= candidates - 1)
+        {
+            PrioritizedTaskSchedulingData const & data = *m_prioritizedTaskSchedulingDataList[LowestSetBit(candidates)];
+            if (data.IsAtPriorityToRun() || data.IsLegalToRun())
+            {
+                return true;
+            }
+        }
+
+        return false;
     }
 
 
     bool PrioritizedTaskQueues::HasAnyTask()
     {
-        LockGuard lock(m_lock);
-        for (unsigned i = 0; i < PrioritizedTaskConfig::TypeCount; ++i)
+        for (unsigned i = 0; i < m_typeCount; ++i)
         {
-            if (m_prioritizedTaskSchedulingDataList[i].HasTasks())
+            if (GetQueuedTaskCount(i) > 0)
             {
                 return true;
             }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <vector>
 
@@ -21,22 +23,49 @@ namespace BitFunnel
     // to be scheduled and executed and gives that task to a thread pool for
     // execution.
     //
-    // This class is thread safe.
+    // The types of task are numbered from zero by the config list, up to
+    // c_maxTypeCount of them, so a pool can isolate as many classes of work
+    // as it is configured with.
+    //
+    // This class is thread safe and takes no lock on its common paths. Each
+    // type of task has a lock-free multi-producer, multi-consumer queue and an
+    // atomic count of the threads it consumes, which only grows by a
+    // compare-and-swap that checks the type's config. A bitmask of the types
+    // which have queued tasks lets a thread find the candidates with bit scans
+    // rather than by looking at every type.
+    //
+    // For work stealing, each worker can also have a local queue per type of
+    // task. A worker takes the newest task of its own queue first, for cache
+    // locality, then the oldest of the shared queue, then steals the oldest
+    // of another worker's queue. The type is still chosen by priority first,
+    // so High tasks are stolen before any other, and the thread budgets of
+    // the types hold for local tasks as for shared ones.
     //
     //*************************************************************************
     class PrioritizedTaskQueues : private NonCopyable
     {
     public:
+        // Worker index of a caller which has no local queues.
+        static const unsigned __int32 c_noWorkerIndex = 0xFFFFFFFF;
+
+        // The most types of task a config list may have, one per bit of the
+        // ready type mask.
+        static const unsigned c_maxTypeCount = 64;
+
+        // workerCount is the number of workers which get local queues for work
+        // stealing, indexed from zero; zero if all tasks go to the shared queues.
         PrioritizedTaskQueues(std::vector<PrioritizedTaskConfig> const & configList,
                               unsigned __int32 totalThreadCount,
-                              unsigned __int32 concurrentThreadCount);
+                              unsigned __int32 concurrentThreadCount,
+                              unsigned __int32 workerCount = 0);
      
         ~PrioritizedTaskQueues();
 
         // Determine the next task to be executed and returns it to the caller.
         // If there is no task can be executed, a nullptr is returned.
-        // The isExitMode indicates if the system is in exit mode.
-        AsyncTask* GetNextTask(bool isExitMode);
+        // The isExitMode indicates if the system is in exit mode. The workerIndex
+        // is the caller's, whose local queues are looked at first.
+        AsyncTask* GetNextTask(bool isExitMode, unsigned __int32 workerIndex = c_noWorkerIndex);
 
         // Notify the PrioritizedTaskQueues that a particular task is finished so that
         // this class can adjust the resource allocation situation to reflect this
@@ -46,39 +75,46 @@ namespace BitFunnel
         // Post a task to the PrioritizedTaskQueues.
         void PostTask(AsyncTask* taskToPost);
 
+        // Post a task to the local queue of a worker. Only that worker may post
+        // to its local queues; other workers steal from them.
+        void PostLocalTask(AsyncTask* taskToPost, unsigned __int32 workerIndex);
+
         // Check if there is any task left on any of the queues.
         bool HasAnyTask();
 
+        // Check if GetNextTask would return a task right now, that is if a
+        // thread is available and some type of task may run on it.
+        bool HasRunnableTask(bool isExitMode);
+
+        // The number of types of task, the size of the config list.
+        unsigned GetTypeCount() const;
+
     private:
 
         // A helper class which records the thread resource allocation for a particular
         // type of task.
         //
-        // DESIGN NOTE: this class is not thread safe. The caller of this class needs to
-        // maintain thread safety.
-        class PrioritizedTaskSchedulingData
+        // DESIGN NOTE: the count of consumed threads is atomic and only grows by a
+        // compare-and-swap which checks the config, so the limits of the config
+        // hold without a lock. Each instance is on cache lines of its own.
+        class alignas(64) PrioritizedTaskSchedulingData : NonCopyable
         {
         public:
-            PrioritizedTaskSchedulingData();
-
             PrioritizedTaskSchedulingData(PrioritizedTaskConfig const & config);
 
-            // Get the number of threads which are currently working on
-            // a task represented by the underlying PrioritizedTaskConfig.
-            unsigned __int32 GetCurrentConsumedThreadCount() const;
+            // Consume one thread if the type of task is at a higher priority to be
+            // scheduled to run based on the config.
+            bool TryConsumeThreadAtPriority();
 
-            // Consume one thread for a task represented by the underlying PrioritizedTaskConfig.
+            // Consume one thread if the type of task is legal to run based on the config.
+            bool TryConsumeThreadIfLegal();
+
+            // Consume one thread regardless of the config, during shutdown.
             void ConsumeThread();
 
             // Return one thread for a task represented by the underlying PrioritizedTaskConfig.
             void ReturnThread();
 
-            // Post a task represented by the underlying PrioritizedTaskConfig.
-            void PostTask();
-
-            // Check if there are any task represented by the underlying PrioritizedTaskConfig.
-            bool HasTasks() const;
-
             // Check if the type of task is legal to run based on the config.
             bool IsLegalToRun() const;
 
@@ -86,23 +122,11 @@ namespace BitFunnel
             bool IsAtPriorityToRun() const;
 
         private:
-            // Helper function to evaluate the IsLegalToRun and IsAtPriorityToRun condition.
-            void EvaluateTaskRunValidity();
-
             // The underlying priority config
-            PrioritizedTaskConfig m_taskConfig;
+            const PrioritizedTaskConfig m_taskConfig;
 
             // The number of threads have been allocated to the task.
-            unsigned __int32 m_currentConsumedThreadCount;
-
-            // The number of tasks in queue.
-            unsigned __int32 m_queuedTaskCount;
-
-            // Flag indicates if the task is legal to run.
-            bool m_isLegalToRun;
-
-            // Flag indicates if the task is at a higher priority to be scheduled to run.
-            bool m_isAtPriorityToRun;
+            std::atomic<unsigned __int32> m_currentConsumedThreadCount;
         };
 
 
@@ -168,29 +192,143 @@ namespace BitFunnel
         };
 
 
-        // Helper function to try to get the next to run task.
-        bool TryGetTask(bool isExitMode, unsigned& taskType);
+        //*************************************************************************
+        //
+        // TaskQueue is an unbounded first-in, first-out queue of tasks for any
+        // number of producers and consumers. Up to c_taskQueueCapacity tasks are
+        // kept in a lock-free ring buffer, where each cell carries a sequence
+        // number telling whose turn it is to write or read it, so a push or a
+        // pop is a single compare-and-swap on the ring position. Tasks beyond
+        // that spill to a list under a lock; while the list holds tasks, new ones
+        // join it too, so the ring only ever holds the older ones.
+        //
+        //*************************************************************************
+        class TaskQueue : NonCopyable
+        {
+        public:
+            TaskQueue();
+
+            ~TaskQueue();
+
+            // Adds a task at the back.
+            void Push(AsyncTask* task);
+
+            // Removes the task at the front, or returns nullptr if the queue is empty.
+            AsyncTask* TryPop();
+
+            // The number of tasks queued. Pushes and pops in progress may or may
+            // not be counted.
+            size_t GetCount() const;
+
+        private:
+            struct Cell
+            {
+                std::atomic<size_t> m_sequence;
+                AsyncTask* m_task;
+            };
+
+            bool TryPushToRing(AsyncTask* task);
+            AsyncTask* TryPopFromRing();
+
+            std::unique_ptr<Cell[]> m_cells;
+
+            // Next positions to write and read, on cache lines of their own.
+            alignas(64) std::atomic<size_t> m_pushPosition;
+            alignas(64) std::atomic<size_t> m_popPosition;
+
+            // Tasks which did not fit in the ring.
+            alignas(64) std::atomic<size_t> m_spilledCount;
+            Mutex m_spillLock;
+            std::deque<AsyncTask*> m_spilledTasks;
+        };
+
+
+        //*************************************************************************
+        //
+        // LocalTaskQueue is the queue of one type of task of one worker. The
+        // worker pushes and pops at the back, other workers steal from the
+        // front. The lock is only contended by a steal; a thief which finds it
+        // taken moves on to the next worker rather than wait.
+        //
+        //*************************************************************************
+        class LocalTaskQueue : NonCopyable
+        {
+        public:
+            LocalTaskQueue();
+
+            // Adds a task at the back. Only called by the owning worker.
+            void PushBack(AsyncTask* task);
 
-        // Helper function to pull a task from a specific task queue.
-        AsyncTask* PullTask(unsigned taskType);
+            // Removes the newest task, or returns nullptr if the queue is empty.
+            // Only called by the owning worker.
+            AsyncTask* PopBack();
+
+            // Removes the oldest task, or returns nullptr if the queue is empty
+            // or in use.
+            AsyncTask* TrySteal();
+
+            // The number of tasks queued.
+            size_t GetCount() const;
+
+        private:
+            Mutex m_lock;
+            std::deque<AsyncTask*> m_tasks;
+            std::atomic<size_t> m_count;
+        };
+
+
+        // Helper function to take one of the available threads. Returns false if
+        // none is available.
+        bool TryTakeAvailableThread();
+
+        // Helper function to consume a thread for the type of task which should run
+        // next: the first ready type at priority, else the first ready type which
+        // is legal to run, else in exit mode the first ready type. Returns false
+        // if no type can run.
+        bool TryConsumeThread(bool isExitMode, unsigned& taskType);
+
+        // Helper function to take a thread for the next task to run and pull
+        // that task from its queue. Returns nullptr if no task can be run.
+        AsyncTask* TryGetTask(bool isExitMode, unsigned __int32 workerIndex);
+
+        // Helper function to mark a type ready once a task of it is queued.
+        void MarkTypeReady(unsigned taskType);
+
+        // Helper function to unmark a type which had no task to pull, unless a
+        // task of it was queued meanwhile.
+        void UnmarkTypeReady(unsigned taskType);
+
+        // Helper function to count the tasks of a type on all of its queues.
+        size_t GetQueuedTaskCount(unsigned taskType) const;
+
+        // Helper function to pull a task of a type from the worker's own local
+        // queue, the shared queue or another worker's local queue, in turn.
+        AsyncTask* PullTask(unsigned taskType, unsigned __int32 workerIndex);
 
         // Helper function to notify the PrioritizedTaskQueues that a task of a 
         // particular type is finished.
         void NotifyTaskFinishInternal(PrioritizedTaskConfig::Type taskType);
 
+        // The number of types of task.
+        const unsigned m_typeCount;
+
         // The list of scheduling data for different type of tasks.
-        PrioritizedTaskSchedulingData m_prioritizedTaskSchedulingDataList[PrioritizedTaskConfig::TypeCount];
+        std::vector<std::unique_ptr<PrioritizedTaskSchedulingData>> m_prioritizedTaskSchedulingDataList;
 
-        // The list of priority queues.
-        HANDLE m_prioritizedQueueHandles[PrioritizedTaskConfig::TypeCount];
+        // The list of priority queues, one per type.
+        std::unique_ptr<TaskQueue[]> m_taskQueues;
+
+        // The local queues of each worker, one per type, empty without work stealing.
+        std::vector<std::unique_ptr<LocalTaskQueue[]>> m_workerTaskQueues;
 
         // Total number of threads (total resources).
         const unsigned __int32 m_totalThreadCount;
 
-        // Lock protecting m_availableThreadCount.
-        Mutex m_lock;
-
         // Available resources.
-        unsigned __int32 m_availableThreadCount;
+        alignas(64) std::atomic<unsigned __int32> m_availableThreadCount;
+
+        // Bit i is set while the type i may have queued tasks: it is set after a
+        // task is queued and only cleared by a thread which found no task to pull.
+        alignas(64) std::atomic<unsigned __int64> m_readyTypeMask;
     };
 }
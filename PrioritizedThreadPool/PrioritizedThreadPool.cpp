@@ -28,6 +28,10 @@ namespace
 
         return cpuGroupInfo;
     }
+
+    // The pool and worker index of a worker thread, for the tasks it invokes.
+    thread_local BitFunnel::PrioritizedThreadPool* t_currentThreadPool = nullptr;
+    thread_local unsigned __int32 t_currentWorkerIndex = 0;
 }
 
 namespace BitFunnel
@@ -35,18 +39,30 @@ namespace BitFunnel
     // During system exit, a thread waits this amount of time before fails.
     static const DWORD c_threadPoolExitsWaitTimeInMs = 20000;
 
-    // A thread waits this amount of time in the main IOCompletionPort to pick
-    // up a new task.
-    static const DWORD c_mainIOCompletionPortTimeoutInMS = 100;
+    // The maximum number of packets a thread takes from the main IOCompletionPort
+    // per wakeup.
+    static const ULONG c_maxTasksPerDequeue = 64;
+
+    // Completion key of the packets which only wake up an idle thread. Tasks and
+    // the exit notification are posted with a zero key.
+    static const ULONG_PTR c_wakeUpCompletionKey = 1;
 
     PrioritizedThreadPool::PrioritizedThreadPool(std::vector<PrioritizedTaskConfig> const & taskConfigList, 
                                                  const PrioritizedThreadPoolConfig threadpoolConfig,
                                                  unsigned __int32 threadCount,
-                                                 unsigned __int32 concurrentThreadCount /* = 0 */)
+                                                 unsigned __int32 concurrentThreadCount /* = 0 */,
+                                                 PrioritizedThreadPoolScheduler scheduler /* = SharedTaskQueues */)
         : m_completionPort(NULL),
-          m_taskQueues(taskConfigList, threadCount, concurrentThreadCount),
+          m_scheduler(scheduler),
+          m_taskQueues(taskConfigList,
+                       threadCount,
+                       concurrentThreadCount,
+                       (scheduler == WorkStealing) ? threadCount : 0),
+          m_nextWorkerIndex(0),
           m_isExiting(false),
-          m_attachedHandleCount(0)
+          m_attachedHandleCount(0),
+          m_idleThreadCount(0),
+          m_pendingWakeUpCount(0)
     {
         LogThrowAssert(threadCount >= concurrentThreadCount,
                        "The count of threads in the thread pool (%u) cannot exceed the number "
@@ -194,7 +210,18 @@ namespace BitFunnel
             return;
         }
         
-        PostTaskInternal(&task);
+        // A single hop: the task is ready to be scheduled once it is queued.
+        if (m_scheduler == WorkStealing && t_currentThreadPool == this)
+        {
+            m_taskQueues.PostLocalTask(&task, t_currentWorkerIndex);
+        }
+        else
+        {
+            m_taskQueues.PostTask(&task);
+        }
+
+        // An idle thread may steal the task while this one is still busy.
+        WakeUpIdleThreads(1);
     }
 
 
@@ -237,35 +264,83 @@ namespace BitFunnel
     }
 
 
-    void PrioritizedThreadPool::ProcessNextTask(PrioritizedThreadPool* threadPool,
-                                                bool isLocalThreadInExitMode)
+    bool PrioritizedThreadPool::ProcessNextTask(PrioritizedThreadPool* threadPool,
+                                                bool isLocalThreadInExitMode,
+                                                unsigned __int32 workerIndex)
     {
-        AsyncTask* nextTaskToRun = threadPool->m_taskQueues.GetNextTask(isLocalThreadInExitMode);        
+        AsyncTask* nextTaskToRun = threadPool->m_taskQueues.GetNextTask(isLocalThreadInExitMode, workerIndex);        
 
-        if (nextTaskToRun != nullptr)
+        if (nextTaskToRun == nullptr)
         {
-            try
-            {
-                nextTaskToRun->Execute();
-            }
-            catch (BitFunnelError& e)
-            {
-                FinishTask(threadPool, nextTaskToRun);
-                throw e;
-            }
-            catch (std::exception& e)
+            return false;
+        }
+
+        try
+        {
+            nextTaskToRun->Execute();
+        }
+        catch (BitFunnelError& e)
+        {
+            FinishTask(threadPool, nextTaskToRun);
+            throw e;
+        }
+        catch (std::exception& e)
+        {
+            FinishTask(threadPool, nextTaskToRun);
+            throw e;
+        }
+        catch (...)
+        {
+            FinishTask(threadPool, nextTaskToRun);
+            throw BitFunnelError("Unknown error during task execution.");
+        }
+            
+        FinishTask(threadPool, nextTaskToRun);
+        return true;
+    }
+
+
+    void PrioritizedThreadPool::WakeUpIdleThreads(unsigned __int32 taskCount)
+    {
+        // Only threads blocked on the main IO completion port need a wakeup; the
+        // busy ones look at the PrioritizedTaskQueues before they block again.
+        // The fence orders the tasks just queued before the read of the idle
+        // count, pairing with the increment in Run.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // Idle threads with a wakeup on its way will look at the queues anyway,
+        // so a burst of tasks wakes each idle thread once rather than once per task.
+        unsigned __int32 pendingWakeUpCount = m_pendingWakeUpCount.load();
+        unsigned __int32 wakeUpCount = 0;
+
+        for (;;)
+        {
+            const unsigned __int32 idleThreadCount = m_idleThreadCount.load();
+
+            if (pendingWakeUpCount >= idleThreadCount)
             {
-                FinishTask(threadPool, nextTaskToRun);
-                throw e;
+                return;
             }
-            catch (...)
+
+            wakeUpCount = (std::min)(taskCount, idleThreadCount - pendingWakeUpCount);
+
+            if (m_pendingWakeUpCount.compare_exchange_weak(pendingWakeUpCount,
+                                                           pendingWakeUpCount + wakeUpCount))
             {
-                FinishTask(threadPool, nextTaskToRun);
-                throw BitFunnelError("Unknown error during task execution.");
+                break;
             }
-            
-            FinishTask(threadPool, nextTaskToRun);
-        }        
+        }
+
+        for (unsigned __int32 i = 0; i < wakeUpCount; ++i)
+        {
+            const BOOL success =
+                ::PostQueuedCompletionStatus(m_completionPort,
+                                             0,
+                                             c_wakeUpCompletionKey,
+                                             nullptr);
+
+            LogAssertB(success || GetLastError() == ERROR_IO_PENDING);
+        }
     }
 
 
@@ -276,26 +351,88 @@ namespace BitFunnel
 
         PrioritizedThreadPool* threadPool = static_cast<PrioritizedThreadPool*>(data);
 
+        const unsigned __int32 workerIndex = threadPool->m_nextWorkerIndex++;
+        t_currentThreadPool = threadPool;
+        t_currentWorkerIndex = workerIndex;
+
+        OVERLAPPED_ENTRY entries[c_maxTasksPerDequeue];
+
         for (;;)
         {
-            DWORD bytes = 0;
-            ULONG_PTR key = 0;
-            LPOVERLAPPED overlapped = NULL;
+            ULONG entryCount = 0;
             BOOL status = FALSE;
 
-            ProcessNextTask(threadPool, isLocalThreadInExitMode);
+            // Run the queued tasks first.
+            while (ProcessNextTask(threadPool, isLocalThreadInExitMode, workerIndex))
+            {
+            }
                       
-            // Then pickup task from the main IO completion port.
-            status = GetQueuedCompletionStatus(threadPool->m_completionPort,
-                                                &bytes,
-                                                &key,
-                                                &overlapped,
-                                                c_mainIOCompletionPortTimeoutInMS);
+            // Then park on the main IO completion port and pickup a batch of packets.
+            // The thread counts itself idle before it looks at the queues one last
+            // time: a thread which queued tasks before this point is seen here, and
+            // one which queues them after it sees this thread idle and posts it a
+            // wakeup. Either way the thread can block without a timeout.
+            threadPool->m_idleThreadCount++;
+            if (threadPool->m_taskQueues.HasRunnableTask(isLocalThreadInExitMode))
+            {
+                threadPool->m_idleThreadCount--;
+                continue;
+            }
+
+            status = GetQueuedCompletionStatusEx(threadPool->m_completionPort,
+                                                 entries,
+                                                 c_maxTasksPerDequeue,
+                                                 &entryCount,
+                                                 INFINITE,
+                                                 FALSE);
+            threadPool->m_idleThreadCount--;
 
             if (status == TRUE)
             {
-                // Process the task from the main IO completion port.
-                if (overlapped == nullptr)
+                bool isExitTaskReceived = false;
+                unsigned __int32 taskCount = 0;
+                unsigned __int32 wakeUpCount = 0;
+
+                // Move the whole batch to the PrioritizedTaskQueues before acting on
+                // an exit notification so that no task is dropped.
+                for (ULONG i = 0; i < entryCount; ++i)
+                {
+                    LPOVERLAPPED overlapped = entries[i].lpOverlapped;
+
+                    if (overlapped != nullptr)
+                    {
+                        AsyncTask* asyncTask = static_cast<AsyncTask*>(overlapped);
+                        threadPool->m_taskQueues.PostTask(asyncTask);
+                        taskCount++;
+                    }
+                    else if (entries[i].lpCompletionKey == c_wakeUpCompletionKey)
+                    {
+                        // Let WakeUpIdleThreads wake another thread for the next task.
+                        threadPool->m_pendingWakeUpCount--;
+                        wakeUpCount++;
+                    }
+                    else
+                    {
+                        if (isExitTaskReceived)
+                        {
+                            // Each NULL task belongs to one thread, hand the extra
+                            // ones back to the others.
+                            threadPool->PostTaskInternal(reinterpret_cast<AsyncTask*>(nullptr));
+                        }
+                        isExitTaskReceived = true;
+                    }
+                }
+
+                // This thread runs one of the tasks itself, the rest may go to
+                // threads which are waiting on the main IO completion port. The
+                // batch may also hold wakeups meant for other threads, which are
+                // passed on rather than lost.
+                if (taskCount + wakeUpCount > 1)
+                {
+                    threadPool->WakeUpIdleThreads(taskCount + wakeUpCount - 1);
+                }
+
+                if (isExitTaskReceived)
                 {
                     // A NULL task. This means the system is in exit mode.
                     isLocalThreadInExitMode = true;
@@ -311,11 +448,6 @@ namespace BitFunnel
                         return 0;
                     }
                 }
-                else
-                {
-                    AsyncTask* asyncTask = static_cast<AsyncTask*>(overlapped);
-                    threadPool->m_taskQueues.PostTask(asyncTask);
-                }
             }    
         }
     }
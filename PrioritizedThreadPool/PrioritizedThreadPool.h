@@ -41,31 +41,51 @@ namespace BitFunnel
         AllCpuGroupsWithUniformAllocation
     };
 
+    enum PrioritizedThreadPoolScheduler
+    {
+        // All tasks are queued on the shared queue of their type.
+        SharedTaskQueues,
+
+        // Tasks invoked from inside a task's Execute go to a local queue of the
+        // worker thread, which runs them newest first; idle threads steal them.
+        // Suits tasks which fan out into smaller ones.
+        WorkStealing
+    };
+
     //*************************************************************************
     //
     // PrioritizedThreadPool manages a pool of threads to excute tasks with
     // different priorities. The tasks with different priorities are controlled 
-    // by the PrioritizedTaskQueues class which internally manages multiple
-    // IOCompletion ports for each type of priority.
+    // by the PrioritizedTaskQueues class which internally keeps a lock-free
+    // queue for each type of priority.
     //
-    // The PrioritizedThreadPool uses IO completion port mechanism to keep track
-    // of tasks posted by different sources. A client can attach a new source 
-    // which could post task to the PrioritizedThreadPool. Similarly, a client
-    // can also detach a source from the PrioritizedThreadPool.
+    // Tasks given to Invoke go straight to the PrioritizedTaskQueues, which
+    // decides the scheduling priority of the tasks. If a thread is parked, one
+    // is woken up for the task. With the WorkStealing scheduler, a task invoked
+    // by a worker thread is queued locally to that thread, see
+    // PrioritizedTaskQueues.
     //
-    // Internally, PrioritizedThreadPool has one IOCompletionPort for accepting
-    // all tasks posted by clients. The tasks will be distributed to an instance
-    // of PrioritizedTaskQueues which decides the scheduling priority of the tasks.
+    // The PrioritizedThreadPool also uses IO completion port mechanism to keep
+    // track of tasks posted by other sources. A client can attach a new source
+    // which could post task to the PrioritizedThreadPool. Similarly, a client
+    // can also detach a source from the PrioritizedThreadPool. Internally,
+    // PrioritizedThreadPool has one main IOCompletionPort for the completions
+    // of the attached sources, the wakeups of parked threads and the exit
+    // notifications.
     //
     // The work flow of the PrioritizedThreadPool is as follows:
     // A thread trys to get the next task from the PrioritizedTaskQueues. The 
     // PrioritizedTaskQueues figures out the task which should have the highest 
-    // priority to be scheduled. If there is no task there, the thread will go 
-    // to the main IO completion port immediately and pull a task from it. 
-    // Then the thread queues the task to the PrioritizedTaskQueues. That means,
-    // the tasks in the PrioritizedTaskQueues always have higher priority to be 
-    // scheduled than the tasks in the main IOCompletion port, since they are older.
-    // And among the tasks in the PrioritizedTaskQueues, the scheduling priorities 
+    // priority to be scheduled. If there is no task there, the thread parks
+    // on the main IO completion port and pulls a batch of packets from it with
+    // a single GetQueuedCompletionStatusEx call. Then the thread queues the
+    // tasks among them to the PrioritizedTaskQueues and wakes up as many of the
+    // idle threads as there are tasks left for them. A thread blocks on the main
+    // IO completion port without a timeout: it counts itself idle before it
+    // checks the PrioritizedTaskQueues for the last time, so a task queued
+    // meanwhile is either seen by that check or followed by a wakeup. A wakeup
+    // is only sent if more threads are idle than wakeups are already on their
+    // way. Among the tasks in the PrioritizedTaskQueues, the scheduling priorities 
     // are determined dynamically by the current situation of the system.
     //
     // During system exiting, a list of NULL task (equal to the number of threads
@@ -87,7 +107,8 @@ namespace BitFunnel
         PrioritizedThreadPool(std::vector<PrioritizedTaskConfig> const & taskConfigList, 
                               const PrioritizedThreadPoolConfig threadpoolConfig,
                               unsigned __int32 threadCount,
-                              unsigned __int32 concurrentThreadCount = 0);
+                              unsigned __int32 concurrentThreadCount = 0,
+                              PrioritizedThreadPoolScheduler scheduler = SharedTaskQueues);
 
 
         ~PrioritizedThreadPool();
@@ -107,8 +128,10 @@ namespace BitFunnel
         static DWORD Run(LPVOID data);
 
         // Internal helper function to process a task, executed by the worker threads.
-        static void ProcessNextTask(PrioritizedThreadPool* threadPool,
-                                    bool isLocalThreadInExitMode);
+        // Returns false if there was no task which could be run.
+        static bool ProcessNextTask(PrioritizedThreadPool* threadPool,
+                                    bool isLocalThreadInExitMode,
+                                    unsigned __int32 workerIndex);
 
         // Internal helper function to do clear up work after a task is done.
         static void FinishTask(PrioritizedThreadPool* threadPool,
@@ -122,19 +145,33 @@ namespace BitFunnel
         template<typename ThreadAllocationStrategy>
         void InitializeThreadsWithAffinity(unsigned __int32 threadCount);
         
-        // Internal helper function to post a task which could be a nullptr.
+        // Internal helper function to post a task which could be a nullptr to the
+        // main IO completion port. Only the exit notification, a nullptr, goes
+        // this way; Invoke queues the tasks directly.
         void PostTaskInternal(AsyncTask* task);
 
+        // Wakes up to taskCount threads blocked on the main IO completion port so
+        // that they pick up tasks which were queued by another thread. Threads
+        // which already have a wakeup on its way are not counted.
+        void WakeUpIdleThreads(unsigned __int32 taskCount);
+
         // Creates a new thread that will execute the worker thread function.
         // The thread that gets created has no specific affinity.
         HANDLE CreateWorkerThread();
 
-        // Main IO completion port to queue all the external tasks.
+        // Main IO completion port for the attached sources, the wakeups and the
+        // exit notifications.
         HANDLE m_completionPort;
 
+        // How tasks are queued.
+        const PrioritizedThreadPoolScheduler m_scheduler;
+
         // The underlying PrioritizedTaskQueues.
         PrioritizedTaskQueues m_taskQueues;
 
+        // Index for the next worker thread to start, which picks its local queues.
+        std::atomic<unsigned __int32> m_nextWorkerIndex;
+
         // Collection of working threads.
         std::vector<HANDLE> m_threads;
 
@@ -143,5 +180,12 @@ namespace BitFunnel
 
         // Flag indicates if the system is exiting.
         std::atomic<bool> m_isExiting;
+
+        // The number of threads currently waiting on the main IO completion port.
+        std::atomic<unsigned __int32> m_idleThreadCount;
+
+        // The number of wakeups posted to the main IO completion port which no
+        // thread has picked up yet.
+        std::atomic<unsigned __int32> m_pendingWakeUpCount;
     };
 }
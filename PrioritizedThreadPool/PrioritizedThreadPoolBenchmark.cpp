@@ -0,0 +1,492 @@
+#include "stdafx.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BitFunnel/AsyncTask.h"
+#include "BitFunnel/PrioritizedTaskConfig.h"
+#include "BitFunnel/PrioritizedThreadPool.h"
+#include "../iocp_server/iocp_server/Stats.h"
+
+
+//*************************************************************************
+//
+// PrioritizedThreadPoolBenchmark measures the dispatch overhead of the
+// PrioritizedThreadPool, as the baseline for scheduler changes:
+//
+//     post latency     - time spent in Invoke by the posting thread.
+//     dispatch latency - time from the Invoke call to the start of Execute.
+//     throughput       - tasks per second from the first Invoke to the end
+//                        of the last Execute.
+//     fairness         - the share of tasks and the dispatch latency of
+//                        each task type when the types are mixed.
+//
+// Each combination of posting threads and pool threads is run on a fresh
+// pool. Every thread records into a Histogram of its own (the one of
+// iocp_server's Stats.h, which load_generator uses too), and they are
+// merged after the run.
+//
+// Usage: PrioritizedThreadPoolBenchmark [--producers=1,2,4] [--threads=1,2,4]
+//            [--tasks=N] [--work-ns=N] [--mix=high|mixed] [--runs=N]
+//            [--scheduler=shared|stealing] [--fanout=N]
+//
+// --tasks is the number of tasks per posting thread, --work-ns the busy
+// time of each task. With --mix=mixed, 30% of the tasks are High, 41%
+// Medium and 29% Low as in PrioritizedThreadPoolUnitTest; the types get
+// the same scheduling config there. --fanout makes each posted task invoke
+// N tasks of its type from its Execute, the nested workload the stealing
+// scheduler is for; tasks counts them too. Each run prints a block of
+// "name value" lines, followed by an empty line.
+//
+//*************************************************************************
+
+namespace BitFunnel
+{
+    namespace PrioritizedThreadPoolBenchmark
+    {
+        static const unsigned c_typeCount = static_cast<unsigned>(PrioritizedTaskConfig::TypeCount);
+        static const char* const c_typeNames[c_typeCount] = { "high", "medium", "low" };
+
+
+        // Dispatch latencies seen by one pool thread, per task type.
+        struct alignas(64) WorkerRecord
+        {
+            Histogram m_dispatchLatency[c_typeCount];
+            unsigned __int64 m_executedCount[c_typeCount] = {};
+        };
+
+
+        //*************************************************************************
+        //
+        // The shared state of one run. Pool threads find their WorkerRecord
+        // through a thread local pointer tagged with the run, since a new pool
+        // (and so new threads) is created for every run.
+        //
+        //*************************************************************************
+        class BenchmarkRun
+        {
+        public:
+            BenchmarkRun(unsigned __int64 expectedTaskCount, __int64 workNs)
+                : m_expectedTaskCount(expectedTaskCount),
+                  m_workNs(workNs),
+                  m_executedCount(0),
+                  m_lastFinishTime(0),
+                  m_runId(++s_runCount)
+            {
+            }
+
+            WorkerRecord& GetWorkerRecord()
+            {
+                thread_local unsigned t_runId = 0;
+                thread_local WorkerRecord* t_record = nullptr;
+
+                if (t_runId != m_runId)
+                {
+                    std::lock_guard<std::mutex> lock(m_workerLock);
+                    m_workers.push_back(std::unique_ptr<WorkerRecord>(new WorkerRecord()));
+                    t_record = m_workers.back().get();
+                    t_runId = m_runId;
+                }
+
+                return *t_record;
+            }
+
+            void OnExecute(PrioritizedTaskConfig::Type type, __int64 postTime)
+            {
+                const __int64 startTime = StatsNow();
+                WorkerRecord& record = GetWorkerRecord();
+                record.m_dispatchLatency[type].Record(startTime - postTime);
+                record.m_executedCount[type]++;
+
+                // Busy work, so that the pool threads are not all waiting on the queues.
+                while (m_workNs > 0 && StatsNow() - startTime < m_workNs)
+                {
+                }
+
+                if (++m_executedCount == m_expectedTaskCount)
+                {
+                    m_lastFinishTime = StatsNow();
+                }
+            }
+
+            // The workers' records, merged; only valid once the pool is gone.
+            void Merge(WorkerRecord& total) const
+            {
+                for (auto const & worker : m_workers)
+                {
+                    for (unsigned i = 0; i < c_typeCount; ++i)
+                    {
+                        total.m_dispatchLatency[i].Add(worker->m_dispatchLatency[i]);
+                        total.m_executedCount[i] += worker->m_executedCount[i];
+                    }
+                }
+            }
+
+            __int64 GetLastFinishTime() const
+            {
+                return m_lastFinishTime;
+            }
+
+        private:
+            static std::atomic<unsigned> s_runCount;
+
+            const unsigned __int64 m_expectedTaskCount;
+            const __int64 m_workNs;
+            std::atomic<unsigned __int64> m_executedCount;
+            std::atomic<__int64> m_lastFinishTime;
+            const unsigned m_runId;
+
+            std::mutex m_workerLock;
+            std::vector<std::unique_ptr<WorkerRecord>> m_workers;
+        };
+
+
+        std::atomic<unsigned> BenchmarkRun::s_runCount(0);
+
+
+        // A task which reports its dispatch latency to the run, then invokes
+        // fanOut tasks of its own type.
+        class TimedAsyncTask : public AsyncTask
+        {
+        public:
+            TimedAsyncTask(BenchmarkRun& run,
+                           PrioritizedTaskConfig::Type type,
+                           PrioritizedThreadPool& threadPool,
+                           unsigned fanOut)
+                : m_run(run),
+                  m_threadPool(threadPool),
+                  m_fanOut(fanOut),
+                  m_postTime(0)
+            {
+                SetType(type);
+            }
+
+            void SetPostTime(__int64 postTime)
+            {
+                m_postTime = postTime;
+            }
+
+            virtual void Execute() override
+            {
+                m_run.OnExecute(GetType(), m_postTime);
+
+                for (unsigned i = 0; i < m_fanOut; ++i)
+                {
+                    TimedAsyncTask* child = new TimedAsyncTask(m_run, GetType(), m_threadPool, 0);
+                    child->SetPostTime(StatsNow());
+                    m_threadPool.Invoke(*child);
+                }
+            }
+
+        private:
+            BenchmarkRun& m_run;
+            PrioritizedThreadPool& m_threadPool;
+            const unsigned m_fanOut;
+            __int64 m_postTime;
+        };
+
+
+        struct BenchmarkOptions
+        {
+            std::vector<unsigned> m_producerCounts;
+            std::vector<unsigned> m_threadCounts;
+            unsigned m_tasksPerProducer = 100000;
+            __int64 m_workNs = 0;
+            bool m_isMixed = false;
+            unsigned m_runs = 1;
+            PrioritizedThreadPoolScheduler m_scheduler = SharedTaskQueues;
+            unsigned m_fanOut = 0;
+        };
+
+
+        // Type of the next task; the mix of PrioritizedThreadPoolUnitTest.
+        static PrioritizedTaskConfig::Type NextType(bool isMixed, std::minstd_rand& random)
+        {
+            if (!isMixed)
+            {
+                return PrioritizedTaskConfig::High;
+            }
+
+            const unsigned draw = random() % 100;
+            if (draw >= 70)
+            {
+                return PrioritizedTaskConfig::High;
+            }
+            else if (draw >= 29)
+            {
+                return PrioritizedTaskConfig::Medium;
+            }
+            return PrioritizedTaskConfig::Low;
+        }
+
+
+        static void RunOnce(BenchmarkOptions const & options, unsigned producerCount, unsigned threadCount)
+        {
+            // Every type may use all of the threads and is always at priority, so the
+            // run measures the dispatch path rather than the throttling.
+            std::vector<PrioritizedTaskConfig> configList;
+            for (unsigned i = 0; i < c_typeCount; ++i)
+            {
+                configList.push_back(PrioritizedTaskConfig(static_cast<PrioritizedTaskConfig::Type>(i),
+                                                           threadCount,
+                                                           threadCount));
+            }
+
+            const unsigned __int64 postedTaskCount = static_cast<unsigned __int64>(producerCount) * options.m_tasksPerProducer;
+            const unsigned __int64 taskCount = postedTaskCount * (1 + options.m_fanOut);
+            BenchmarkRun run(taskCount, options.m_workNs);
+            std::vector<Histogram> postLatencies(producerCount);
+            __int64 startTime = 0;
+            __int64 postedTime = 0;
+
+            {
+                PrioritizedThreadPool threadPool(configList,
+                                                 DefaultCpuGroupOnly,
+                                                 threadCount,
+                                                 threadCount,
+                                                 options.m_scheduler);
+
+                std::atomic<unsigned> readyCount(0);
+                std::atomic<bool> isStarted(false);
+                std::vector<std::thread> producers;
+
+                for (unsigned i = 0; i < producerCount; ++i)
+                {
+                    producers.emplace_back([&, i]()
+                    {
+                        // The tasks are made up front so that allocation is not timed.
+                        std::minstd_rand random(12345 + i);
+                        std::vector<TimedAsyncTask*> tasks;
+                        tasks.reserve(options.m_tasksPerProducer);
+                        for (unsigned index = 0; index < options.m_tasksPerProducer; ++index)
+                        {
+                            tasks.push_back(new TimedAsyncTask(run,
+                                                               NextType(options.m_isMixed, random),
+                                                               threadPool,
+                                                               options.m_fanOut));
+                        }
+
+                        readyCount++;
+                        while (!isStarted)
+                        {
+                            std::this_thread::yield();
+                        }
+
+                        for (TimedAsyncTask* task : tasks)
+                        {
+                            const __int64 postTime = StatsNow();
+                            task->SetPostTime(postTime);
+
+                            // The pool owns the task from here on.
+                            threadPool.Invoke(*task);
+                            postLatencies[i].Record(StatsNow() - postTime);
+                        }
+                    });
+                }
+
+                while (readyCount < producerCount)
+                {
+                    std::this_thread::yield();
+                }
+                startTime = StatsNow();
+                isStarted = true;
+
+                for (auto& producer : producers)
+                {
+                    producer.join();
+                }
+                postedTime = StatsNow();
+
+                // The destructor runs the tasks that are left before the threads exit,
+                // but the pool takes no new ones then, so wait for the nested tasks.
+                while (options.m_fanOut > 0 && run.GetLastFinishTime() == 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+
+            WorkerRecord total;
+            run.Merge(total);
+            Histogram postLatency;
+            for (auto const & histogram : postLatencies)
+            {
+                postLatency.Add(histogram);
+            }
+            Histogram dispatchLatency;
+            unsigned __int64 executedCount = 0;
+            for (unsigned i = 0; i < c_typeCount; ++i)
+            {
+                dispatchLatency.Add(total.m_dispatchLatency[i]);
+                executedCount += total.m_executedCount[i];
+            }
+
+            // Reported like load_generator's results: a name and a value per line,
+            // and the latencies in the percentiles of FormatHistogram.
+            const double seconds = (run.GetLastFinishTime() - startTime) / 1e9;
+            const double postSeconds = (postedTime - startTime) / 1e9;
+            std::string text;
+            char line[256];
+            snprintf(line, sizeof(line), "producers %u\nthreads %u\nmix %s\nscheduler %s\nfanout %u\n",
+                     producerCount,
+                     threadCount,
+                     options.m_isMixed ? "mixed" : "high",
+                     (options.m_scheduler == WorkStealing) ? "stealing" : "shared",
+                     options.m_fanOut);
+            text += line;
+            snprintf(line, sizeof(line), "tasks %llu\ntasks_per_s %.0f\nposts_per_s %.0f\n",
+                     static_cast<unsigned long long>(executedCount),
+                     seconds > 0 ? executedCount / seconds : 0.0,
+                     postSeconds > 0 ? postedTaskCount / postSeconds : 0.0);
+            text += line;
+            FormatHistogram(text, "post_ns", postLatency, 1.0);
+            FormatHistogram(text, "dispatch_us", dispatchLatency, 1000.0);
+            for (unsigned i = 0; i < c_typeCount; ++i)
+            {
+                snprintf(line, sizeof(line), "%s_share %.3f\n",
+                         c_typeNames[i],
+                         executedCount > 0 ? static_cast<double>(total.m_executedCount[i]) / executedCount : 0.0);
+                text += line;
+                FormatHistogram(text, (std::string(c_typeNames[i]) + "_dispatch_us").c_str(), total.m_dispatchLatency[i], 1000.0);
+            }
+            printf("%s\n", text.c_str());
+            fflush(stdout);
+
+            if (executedCount != taskCount)
+            {
+                fprintf(stderr, "Executed %llu tasks out of %llu.\n",
+                        static_cast<unsigned long long>(executedCount),
+                        static_cast<unsigned long long>(taskCount));
+            }
+        }
+
+
+        // Parses "1,2,4" into a list of counts; an empty list is an error.
+        static bool ParseCounts(const char* text, std::vector<unsigned>& counts)
+        {
+            counts.clear();
+            while (*text != '\0')
+            {
+                char* end = nullptr;
+                const unsigned long value = strtoul(text, &end, 10);
+                if (end == text || value == 0)
+                {
+                    return false;
+                }
+                counts.push_back(static_cast<unsigned>(value));
+                text = (*end == ',') ? end + 1 : end;
+            }
+            return !counts.empty();
+        }
+
+
+        // Powers of two up to and including count.
+        static std::vector<unsigned> PowersOfTwoUpTo(unsigned count)
+        {
+            std::vector<unsigned> counts;
+            for (unsigned value = 1; value < count; value *= 2)
+            {
+                counts.push_back(value);
+            }
+            counts.push_back(count);
+            return counts;
+        }
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    using namespace BitFunnel::PrioritizedThreadPoolBenchmark;
+
+    BenchmarkOptions options;
+    const unsigned cpuCount = (std::max)(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; ++i)
+    {
+        bool isValid = true;
+        if (strncmp(argv[i], "--producers=", 12) == 0)
+        {
+            isValid = ParseCounts(argv[i] + 12, options.m_producerCounts);
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            isValid = ParseCounts(argv[i] + 10, options.m_threadCounts);
+        }
+        else if (strncmp(argv[i], "--tasks=", 8) == 0)
+        {
+            options.m_tasksPerProducer = static_cast<unsigned>(strtoul(argv[i] + 8, nullptr, 10));
+            isValid = options.m_tasksPerProducer > 0;
+        }
+        else if (strncmp(argv[i], "--work-ns=", 10) == 0)
+        {
+            options.m_workNs = strtoll(argv[i] + 10, nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--mix=high") == 0)
+        {
+            options.m_isMixed = false;
+        }
+        else if (strcmp(argv[i], "--mix=mixed") == 0)
+        {
+            options.m_isMixed = true;
+        }
+        else if (strcmp(argv[i], "--scheduler=shared") == 0)
+        {
+            options.m_scheduler = BitFunnel::SharedTaskQueues;
+        }
+        else if (strcmp(argv[i], "--scheduler=stealing") == 0)
+        {
+            options.m_scheduler = BitFunnel::WorkStealing;
+        }
+        else if (strncmp(argv[i], "--fanout=", 9) == 0)
+        {
+            options.m_fanOut = static_cast<unsigned>(strtoul(argv[i] + 9, nullptr, 10));
+        }
+        else if (strncmp(argv[i], "--runs=", 7) == 0)
+        {
+            options.m_runs = static_cast<unsigned>(strtoul(argv[i] + 7, nullptr, 10));
+            isValid = options.m_runs > 0;
+        }
+        else
+        {
+            isValid = false;
+        }
+
+        if (!isValid)
+        {
+            fprintf(stderr, "Invalid option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (options.m_producerCounts.empty())
+    {
+        options.m_producerCounts = PowersOfTwoUpTo(cpuCount);
+    }
+    if (options.m_threadCounts.empty())
+    {
+        options.m_threadCounts = PowersOfTwoUpTo(cpuCount);
+    }
+
+    for (unsigned run = 0; run < options.m_runs; ++run)
+    {
+        for (unsigned producerCount : options.m_producerCounts)
+        {
+            for (unsigned threadCount : options.m_threadCounts)
+            {
+                RunOnce(options, producerCount, threadCount);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -1,7 +1,10 @@
 #include "stdafx.h"
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <stdlib.h>
+#include <thread>
 #include <vector>
 
 #include "BitFunnel/AsyncTask.h"
@@ -245,5 +248,373 @@ namespace BitFunnel
 
             PrioritizedThreadPoolLargeMultiThreadTestInternal(PrioritizedThreadPoolConfig::AllCpuGroupsWithUniformAllocation);
         }
+
+
+        // This test runs a pool with more types of task than the named High, Medium
+        // and Low, one per class of service, and checks that each type runs all of
+        // its tasks without going over its maximum number of threads.
+        TestCase(PrioritizedThreadPoolManyTaskTypesTest)
+        {
+            constexpr unsigned c_threadActionTimeoutInMS = 5000;
+
+            constexpr unsigned __int32 c_totalThreadCount = 16;
+            constexpr unsigned c_typeCount = 5;
+
+            // Interactive, batch, compaction, replication and garbage collection.
+            constexpr unsigned __int32 c_priorityGrantingThresholds[c_typeCount] = { 8, 4, 1, 2, 0 };
+            constexpr unsigned __int32 c_maxThreadCounts[c_typeCount] = { 16, 8, 2, 4, 1 };
+
+            std::vector<PrioritizedTaskConfig> configList;
+            for (unsigned i = 0; i < c_typeCount; ++i)
+            {
+                configList.push_back(PrioritizedTaskConfig(static_cast<PrioritizedTaskConfig::Type>(i),
+                                                           c_priorityGrantingThresholds[i],
+                                                           c_maxThreadCounts[i]));
+            }
+
+            constexpr unsigned c_taskPostingThreadCount = 8;
+            constexpr unsigned c_actionCountPerThread = 5000;
+
+            ThreadsafeCounter32 executionCounters[c_typeCount];
+            std::atomic<unsigned> runningCounts[c_typeCount] = {};
+            ThreadsafeCounter32 overLimitCounter;
+
+            {
+                PrioritizedThreadPool threadPool(configList,
+                                                 PrioritizedThreadPoolConfig::DefaultCpuGroupOnly,
+                                                 c_totalThreadCount,
+                                                 c_totalThreadCount);
+
+                std::vector<std::unique_ptr<ThreadAction>> threads;
+
+                for (unsigned i = 0; i < c_taskPostingThreadCount; ++i)
+                {
+                    const auto postTaskAction
+                        = ([&, i]()
+                    {
+                        for (unsigned index = 0; index < c_actionCountPerThread; ++index)
+                        {
+                            const unsigned type = (i + index) % c_typeCount;
+
+                            PrioritizedAsyncTask* task = new PrioritizedAsyncTask(
+                                static_cast<PrioritizedTaskConfig::Type>(type),
+                                [&, type]() {
+                                    if (++runningCounts[type] > c_maxThreadCounts[type])
+                                    {
+                                        overLimitCounter.ThreadsafeIncrement();
+                                    }
+                                    executionCounters[type].ThreadsafeIncrement();
+                                    runningCounts[type]--;
+                                });
+
+                            threadPool.Invoke(*task);
+                        }
+                    });
+
+                    threads.push_back(std::unique_ptr<ThreadAction>(
+                        new ThreadAction(postTaskAction)));
+                }
+
+                for (auto const & thread : threads)
+                {
+                    const bool threadFinished
+                        = thread->WaitForCompletion(c_threadActionTimeoutInMS);
+                    TestAssert(threadFinished);
+                }
+
+                // The tasks left at shutdown run regardless of the limits, so let
+                // them all run before the pool is destroyed.
+                for (unsigned waitedMS = 0; overLimitCounter.ThreadsafeGetValue() == 0; ++waitedMS)
+                {
+                    unsigned executedCount = 0;
+                    for (auto& counter : executionCounters)
+                    {
+                        executedCount += counter.ThreadsafeGetValue();
+                    }
+
+                    if (executedCount == c_taskPostingThreadCount * c_actionCountPerThread)
+                    {
+                        break;
+                    }
+
+                    TestAssert(waitedMS < c_threadActionTimeoutInMS);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+
+            // Every type gets the same share of the tasks.
+            constexpr unsigned c_expectedCountPerType = c_taskPostingThreadCount * c_actionCountPerThread / c_typeCount;
+
+            for (auto& counter : executionCounters)
+            {
+                TestAssert(counter.ThreadsafeGetValue() == c_expectedCountPerType);
+            }
+
+            TestAssert(overLimitCounter.ThreadsafeGetValue() == 0);
+        }
+
+
+        // Waits up to timeoutInMS for the condition to hold, returns whether it did.
+        template <typename Condition>
+        bool WaitFor(Condition condition, unsigned timeoutInMS)
+        {
+            for (unsigned waitedMS = 0; !condition(); ++waitedMS)
+            {
+                if (waitedMS >= timeoutInMS)
+                {
+                    return false;
+                }
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            return true;
+        }
+
+
+        // FanOutState is shared by the tasks of a FanOutAsyncTask tree: how
+        // often each task ran, and how many tasks of each type ran at once.
+        struct FanOutState
+        {
+            static constexpr unsigned c_typeCount = static_cast<unsigned>(PrioritizedTaskConfig::TypeCount);
+            static constexpr unsigned c_fanOut = 4;
+
+            // A root task and two levels of children under it.
+            static constexpr unsigned c_treeSize = 1 + c_fanOut + c_fanOut * c_fanOut;
+
+            FanOutState(unsigned treeCount, unsigned __int32 const * maxThreadCounts);
+
+            std::unique_ptr<std::atomic<unsigned>[]> m_executionCounts;
+            std::atomic<unsigned> m_runningCounts[c_typeCount];
+            unsigned __int32 const * const m_maxThreadCounts;
+            ThreadsafeCounter32 m_executionCounter;
+            ThreadsafeCounter32 m_overLimitCounter;
+        };
+
+
+        FanOutState::FanOutState(unsigned treeCount, unsigned __int32 const * maxThreadCounts)
+            : m_executionCounts(new std::atomic<unsigned>[treeCount * c_treeSize]()),
+              m_runningCounts(),
+              m_maxThreadCounts(maxThreadCounts)
+        {
+
+        }
+
+
+        // FanOutAsyncTask invokes FanOutState::c_fanOut children from its
+        // Execute, down to the last level of its tree. The tasks of a tree are
+        // numbered breadth first, so node n has the children n * c_fanOut + 1
+        // to n * c_fanOut + c_fanOut.
+        class FanOutAsyncTask : public AsyncTask
+        {
+        public:
+            FanOutAsyncTask(PrioritizedThreadPool& threadPool,
+                            FanOutState& state,
+                            unsigned tree,
+                            unsigned node);
+
+            // AsyncTask API.
+            virtual void Execute();
+
+        private:
+            PrioritizedThreadPool& m_threadPool;
+            FanOutState& m_state;
+            const unsigned m_tree;
+            const unsigned m_node;
+        };
+
+
+        FanOutAsyncTask::FanOutAsyncTask(PrioritizedThreadPool& threadPool,
+                                         FanOutState& state,
+                                         unsigned tree,
+                                         unsigned node)
+            : m_threadPool(threadPool),
+              m_state(state),
+              m_tree(tree),
+              m_node(node)
+        {
+            SetType(static_cast<PrioritizedTaskConfig::Type>((tree + node) % FanOutState::c_typeCount));
+        }
+
+
+        void FanOutAsyncTask::Execute()
+        {
+            const unsigned type = static_cast<unsigned>(GetType());
+            if (++m_state.m_runningCounts[type] > m_state.m_maxThreadCounts[type])
+            {
+                m_state.m_overLimitCounter.ThreadsafeIncrement();
+            }
+
+            m_state.m_executionCounts[m_tree * FanOutState::c_treeSize + m_node]++;
+
+            const unsigned firstChild = m_node * FanOutState::c_fanOut + 1;
+            if (firstChild < FanOutState::c_treeSize)
+            {
+                for (unsigned i = 0; i < FanOutState::c_fanOut; ++i)
+                {
+                    m_threadPool.Invoke(*new FanOutAsyncTask(m_threadPool, m_state, m_tree, firstChild + i));
+                }
+            }
+
+            m_state.m_runningCounts[type]--;
+
+            // Counted last, so that the children are queued by the time all of
+            // the tasks are seen to have run.
+            m_state.m_executionCounter.ThreadsafeIncrement();
+        }
+
+
+        // This test runs the WorkStealing scheduler with tasks which invoke
+        // more tasks from their Execute, and checks that every task runs exactly
+        // once, that no type goes over its maximum number of threads, and that
+        // an idle thread steals the High tasks of a busy one before its Low ones.
+        TestCase(PrioritizedThreadPoolWorkStealingTest)
+        {
+            constexpr unsigned c_threadActionTimeoutInMS = 5000;
+            constexpr unsigned c_typeCount = FanOutState::c_typeCount;
+
+            {
+                constexpr unsigned __int32 c_totalThreadCount = 8;
+                constexpr unsigned __int32 c_priorityGrantingThresholds[c_typeCount] = { 4, 2, 1 };
+                constexpr unsigned __int32 c_maxThreadCounts[c_typeCount] = { 8, 4, 2 };
+
+                std::vector<PrioritizedTaskConfig> configList;
+                for (unsigned i = 0; i < c_typeCount; ++i)
+                {
+                    configList.push_back(PrioritizedTaskConfig(static_cast<PrioritizedTaskConfig::Type>(i),
+                                                               c_priorityGrantingThresholds[i],
+                                                               c_maxThreadCounts[i]));
+                }
+
+                constexpr unsigned c_taskPostingThreadCount = 4;
+                constexpr unsigned c_treeCountPerThread = 500;
+                constexpr unsigned c_treeCount = c_taskPostingThreadCount * c_treeCountPerThread;
+                constexpr unsigned c_taskCount = c_treeCount * FanOutState::c_treeSize;
+
+                FanOutState state(c_treeCount, c_maxThreadCounts);
+
+                {
+                    PrioritizedThreadPool threadPool(configList,
+                                                     PrioritizedThreadPoolConfig::DefaultCpuGroupOnly,
+                                                     c_totalThreadCount,
+                                                     c_totalThreadCount,
+                                                     WorkStealing);
+
+                    std::vector<std::unique_ptr<ThreadAction>> threads;
+
+                    for (unsigned i = 0; i < c_taskPostingThreadCount; ++i)
+                    {
+                        const auto postTaskAction
+                            = ([&, i]()
+                        {
+                            for (unsigned index = 0; index < c_treeCountPerThread; ++index)
+                            {
+                                const unsigned tree = i * c_treeCountPerThread + index;
+                                threadPool.Invoke(*new FanOutAsyncTask(threadPool, state, tree, 0));
+                            }
+                        });
+
+                        threads.push_back(std::unique_ptr<ThreadAction>(
+                            new ThreadAction(postTaskAction)));
+                    }
+
+                    for (auto const & thread : threads)
+                    {
+                        const bool threadFinished
+                            = thread->WaitForCompletion(c_threadActionTimeoutInMS);
+                        TestAssert(threadFinished);
+                    }
+
+                    // The pool takes no new tasks once it is exiting, and runs the
+                    // ones left regardless of the limits, so let them all run first.
+                    const bool allExecuted = WaitFor([&]() {
+                        return state.m_executionCounter.ThreadsafeGetValue() == c_taskCount;
+                    }, c_threadActionTimeoutInMS);
+                    TestAssert(allExecuted);
+                }
+
+                for (unsigned i = 0; i < c_taskCount; ++i)
+                {
+                    TestAssert(state.m_executionCounts[i] == 1);
+                }
+
+                TestAssert(state.m_overLimitCounter.ThreadsafeGetValue() == 0);
+            }
+
+            {
+                // One thread runs a task which invokes Low tasks, then High ones,
+                // while the other is held up; once free, the other thread is the
+                // only one taking tasks, and has to steal all of them.
+                constexpr unsigned __int32 c_totalThreadCount = 2;
+                constexpr unsigned c_childCountPerType = 8;
+
+                std::vector<PrioritizedTaskConfig> configList;
+                for (unsigned i = 0; i < c_typeCount; ++i)
+                {
+                    configList.push_back(PrioritizedTaskConfig(static_cast<PrioritizedTaskConfig::Type>(i),
+                                                               c_totalThreadCount,
+                                                               c_totalThreadCount));
+                }
+
+                std::atomic<bool> areChildrenQueued(false);
+                std::atomic<unsigned> nextOrder(0);
+                ThreadsafeCounter32 childExecutionCounter;
+                PrioritizedTaskConfig::Type executedTypes[2 * c_childCountPerType];
+
+                {
+                    PrioritizedThreadPool threadPool(configList,
+                                                     PrioritizedThreadPoolConfig::DefaultCpuGroupOnly,
+                                                     c_totalThreadCount,
+                                                     c_totalThreadCount,
+                                                     WorkStealing);
+
+                    PrioritizedAsyncTask* blockingTask = new PrioritizedAsyncTask(
+                        PrioritizedTaskConfig::Medium,
+                        [&]() {
+                            WaitFor([&]() { return areChildrenQueued.load(); }, c_threadActionTimeoutInMS);
+                        });
+
+                    PrioritizedAsyncTask* parentTask = new PrioritizedAsyncTask(
+                        PrioritizedTaskConfig::Medium,
+                        [&]() {
+                            const PrioritizedTaskConfig::Type childTypes[] = { PrioritizedTaskConfig::Low,
+                                                                               PrioritizedTaskConfig::High };
+                            for (auto const type : childTypes)
+                            {
+                                for (unsigned i = 0; i < c_childCountPerType; ++i)
+                                {
+                                    threadPool.Invoke(*new PrioritizedAsyncTask(type, [&, type]() {
+                                        executedTypes[nextOrder++] = type;
+                                        childExecutionCounter.ThreadsafeIncrement();
+                                    }));
+                                }
+                            }
+
+                            // Hold on to this thread until the children have run.
+                            areChildrenQueued = true;
+                            WaitFor([&]() {
+                                return childExecutionCounter.ThreadsafeGetValue() == 2 * c_childCountPerType;
+                            }, c_threadActionTimeoutInMS);
+                        });
+
+                    // The shared queue is first in, first out, so the blocking task
+                    // gets a thread before the parent does.
+                    threadPool.Invoke(*blockingTask);
+                    threadPool.Invoke(*parentTask);
+
+                    const bool allExecuted = WaitFor([&]() {
+                        return childExecutionCounter.ThreadsafeGetValue() == 2 * c_childCountPerType;
+                    }, c_threadActionTimeoutInMS);
+                    TestAssert(allExecuted);
+                }
+
+                for (unsigned i = 0; i < 2 * c_childCountPerType; ++i)
+                {
+                    const auto expectedType = (i < c_childCountPerType) ? PrioritizedTaskConfig::High
+                                                                        : PrioritizedTaskConfig::Low;
+                    TestAssert(executedTypes[i] == expectedType);
+                }
+            }
+        }
     }
 }
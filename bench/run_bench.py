@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+"""Benchmark matrix for the servers of this repository, on Linux over loopback.
+
+Builds iocp_server, multithread_server and load_generator, then for every server and every
+cell of the matrix (connections x message size x lock-step or pipelined) starts the server
+afresh, drives it with load_generator and records throughput, latency percentiles and the
+server's CPU time per message. Results go to results.csv and results.json in --out.
+
+    python3 bench/run_bench.py                              # full matrix
+    python3 bench/run_bench.py --quick                      # a smaller one, for a quick look
+    python3 bench/run_bench.py --save-baseline=base.json    # keep these results to compare with
+    python3 bench/run_bench.py --baseline=base.json         # exit 1 if a cell got worse
+
+Engine changes should come with the comparison against a baseline taken on the same machine.
+"""
+
+import argparse
+import csv
+import json
+import os
+import resource
+import shlex
+import socket
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# What each binary is built from, relative to the repository root
+SOURCES = {
+    'iocp_server': (['iocp_server/iocp_server/*.cpp'], ['-luring']),
+    'multithread_server': (['multithread_server/multithread_server/main.cpp',
+                            'iocp_server/iocp_server/Framing.cpp',
+                            'iocp_server/iocp_server/Log.cpp',
+                            'iocp_server/iocp_server/Stats.cpp'], []),
+    'load_generator': (['load_generator/*.cpp',
+                        'iocp_server/iocp_server/Framing.cpp',
+                        'iocp_server/iocp_server/Stats.cpp'], []),
+}
+
+# Server configurations: binary and arguments, {port} filled in
+SERVERS = {
+    'iocp_uring': ('iocp_server', ['--engine=uring', '--port={port}', '--connections=20000']),
+    'iocp_epoll': ('iocp_server', ['--engine=epoll', '--port={port}', '--connections=20000']),
+    'multithread_pool': ('multithread_server', ['--protocol=echo', '--port={port}', '--max-frame=1048576']),
+}
+
+FULL_MATRIX = {'connections': [1, 100, 10000], 'sizes': [64, 1024, 65536]}
+QUICK_MATRIX = {'connections': [1, 100], 'sizes': [64, 4096]}
+
+# Columns of the results, in order
+FIELDS = ['server', 'connections', 'size', 'mode', 'concurrency', 'responses_per_s', 'mb_in_per_s',
+          'p50_us', 'p99_us', 'p999_us', 'max_us', 'server_cpu_us_per_msg', 'client_cpu_s', 'errors',
+          'connect_errors', 'outstanding', 'status']
+
+
+def parse_list(text):
+    return [int(value) for value in text.split(',') if value]
+
+
+def build(args):
+    os.makedirs(args.bin_dir, exist_ok=True)
+    for name, (sources, libraries) in SOURCES.items():
+        output = os.path.join(args.bin_dir, name)
+        command = '%s -std=c++17 -O2 -pthread %s %s -o %s %s' % (
+            args.cxx, args.cxxflags, ' '.join(sources), shlex.quote(output), ' '.join(libraries))
+        print('build:', command, flush=True)
+        subprocess.run(command, shell=True, cwd=ROOT, check=True)
+
+
+def free_port():
+    with socket.socket() as probe:
+        probe.bind(('127.0.0.1', 0))
+        return probe.getsockname()[1]
+
+
+def wait_listening(port, process, timeout=10.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if process.poll() is not None:
+            return False
+        try:
+            with socket.create_connection(('127.0.0.1', port), timeout=0.2):
+                return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def parse_output(text):
+    """load_generator prints "name value" lines, and histograms as "name count N mean M p50 ..." """
+    values = {}
+    for line in text.splitlines():
+        parts = line.split()
+        if len(parts) == 2:
+            values[parts[0]] = parts[1]
+        elif len(parts) > 2 and len(parts) % 2 == 1:
+            values[parts[0]] = dict(zip(parts[1::2], parts[2::2]))
+    return values
+
+
+def run_cell(args, server, connections, size, concurrency):
+    binary, server_args = SERVERS[server]
+    port = free_port()
+    command = [os.path.join(args.bin_dir, binary)] + [arg.format(port=port) for arg in server_args]
+    process = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    row = {'server': server, 'connections': connections, 'size': size,
+           'mode': 'pipelined' if concurrency > 1 else 'lockstep', 'concurrency': concurrency}
+    try:
+        if not wait_listening(port, process):
+            row['status'] = 'server_failed'
+            return row
+        load = [os.path.join(args.bin_dir, 'load_generator'), '--port=%d' % port,
+                '--connections=%d' % connections, '--size=%d' % size, '--concurrency=%d' % concurrency,
+                '--duration=%g' % args.duration, '--warmup=%g' % args.warmup, '--cpu-pid=%d' % process.pid]
+        if args.client_threads:
+            load.append('--threads=%d' % args.client_threads)
+        timeout = args.duration + args.warmup + 60
+        try:
+            result = subprocess.run(load, capture_output=True, text=True, timeout=timeout)
+        except subprocess.TimeoutExpired:
+            row['status'] = 'timeout'
+            return row
+        values = parse_output(result.stdout)
+        if 'responses_per_s' not in values:
+            row['status'] = 'client_failed: ' + result.stderr.strip()[:200]
+            return row
+        latency = values.get('latency_us', {})
+        row.update({
+            'responses_per_s': float(values['responses_per_s']),
+            'mb_in_per_s': float(values['mb_in_per_s']),
+            'p50_us': float(latency.get('p50', 0)),
+            'p99_us': float(latency.get('p99', 0)),
+            'p999_us': float(latency.get('p99.9', 0)),
+            'max_us': float(latency.get('max', 0)),
+            'server_cpu_us_per_msg': float(values.get('server_cpu_us_per_response', -1)),
+            'client_cpu_s': float(values.get('client_cpu_s', 0)),
+            'errors': int(values.get('errors', 0)),
+            'connect_errors': int(values.get('connect_errors', 0)),
+            'outstanding': int(values.get('outstanding', 0)),
+            'status': 'ok' if process.poll() is None else 'server_exited',
+        })
+        return row
+    finally:
+        if process.poll() is None:
+            process.terminate()
+            try:
+                process.wait(timeout=10)
+            except subprocess.TimeoutExpired:
+                process.kill()
+                process.wait()
+
+
+def key_of(row):
+    return (row['server'], int(row['connections']), int(row['size']), row['mode'])
+
+
+def compare(rows, baseline, tolerance, latency_tolerance):
+    """Cells whose throughput fell or whose p99 rose by more than the tolerances"""
+    previous = {key_of(row): row for row in baseline if row.get('status') == 'ok'}
+    regressions = []
+    for row in rows:
+        old = previous.get(key_of(row))
+        if old is None or row.get('status') != 'ok':
+            continue
+        name = '%s conns=%d size=%d %s' % key_of(row)
+        if row['responses_per_s'] < old['responses_per_s'] * (1 - tolerance):
+            regressions.append('%s: throughput %.0f/s, baseline %.0f/s' % (
+                name, row['responses_per_s'], old['responses_per_s']))
+        if old['p99_us'] > 0 and row['p99_us'] > old['p99_us'] * (1 + latency_tolerance):
+            regressions.append('%s: p99 %.1fus, baseline %.1fus' % (name, row['p99_us'], old['p99_us']))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--servers', default=','.join(SERVERS), help='comma separated, of: ' + ', '.join(SERVERS))
+    parser.add_argument('--connections', help='comma separated connection counts')
+    parser.add_argument('--sizes', help='comma separated message sizes in bytes')
+    parser.add_argument('--pipeline', type=int, default=16, help='requests in flight per connection when pipelined')
+    parser.add_argument('--duration', type=float, default=5.0, help='seconds measured per cell')
+    parser.add_argument('--warmup', type=float, default=1.0, help='seconds run before measuring')
+    parser.add_argument('--client-threads', type=int, default=0, help='load_generator threads, 0 = one per CPU')
+    parser.add_argument('--max-inflight', type=int, default=1 << 30,
+                        help='skip cells with more bytes than this in flight (connections x size x pipeline)')
+    parser.add_argument('--quick', action='store_true', help='smaller matrix and shorter cells')
+    parser.add_argument('--out', default=os.path.join(ROOT, 'bench_results'), help='directory for the results')
+    parser.add_argument('--bin-dir', default=os.path.join(ROOT, '_bench_build'), help='where the binaries are built')
+    parser.add_argument('--skip-build', action='store_true', help='use the binaries already in --bin-dir')
+    parser.add_argument('--cxx', default=os.environ.get('CXX', 'g++'))
+    parser.add_argument('--cxxflags', default=os.environ.get('CXXFLAGS', ''))
+    parser.add_argument('--baseline', help='results.json to compare with; exit 1 on a regression')
+    parser.add_argument('--tolerance', type=float, default=0.10, help='throughput drop counted as a regression')
+    parser.add_argument('--latency-tolerance', type=float, default=0.25, help='p99 rise counted as a regression')
+    parser.add_argument('--save-baseline', help='also write the results to this path')
+    args = parser.parse_args()
+
+    matrix = QUICK_MATRIX if args.quick else FULL_MATRIX
+    connection_counts = parse_list(args.connections) if args.connections else matrix['connections']
+    sizes = parse_list(args.sizes) if args.sizes else matrix['sizes']
+    if args.quick and args.duration == parser.get_default('duration'):
+        args.duration = 2.0
+    servers = [server for server in args.servers.split(',') if server]
+    for server in servers:
+        if server not in SERVERS:
+            parser.error('unknown server ' + server)
+
+    # 10k connections need as many descriptors on both ends; the children inherit the limit
+    _, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    if not args.skip_build:
+        build(args)
+
+    rows = []
+    for server in servers:
+        for connections in connection_counts:
+            for size in sizes:
+                for concurrency in (1, args.pipeline):
+                    if connections * size * concurrency > args.max_inflight:
+                        row = {'server': server, 'connections': connections, 'size': size,
+                               'mode': 'pipelined' if concurrency > 1 else 'lockstep',
+                               'concurrency': concurrency, 'status': 'skipped'}
+                    else:
+                        row = run_cell(args, server, connections, size, concurrency)
+                    rows.append(row)
+                    print(', '.join('%s=%s' % (field, row[field]) for field in FIELDS if field in row), flush=True)
+
+    os.makedirs(args.out, exist_ok=True)
+    with open(os.path.join(args.out, 'results.csv'), 'w', newline='') as file:
+        writer = csv.DictWriter(file, fieldnames=FIELDS)
+        writer.writeheader()
+        writer.writerows(rows)
+    document = {'host': os.uname().nodename, 'cpus': os.cpu_count(), 'time': time.strftime('%Y-%m-%dT%H:%M:%S'),
+                'duration': args.duration, 'warmup': args.warmup, 'pipeline': args.pipeline, 'results': rows}
+    with open(os.path.join(args.out, 'results.json'), 'w') as file:
+        json.dump(document, file, indent=1)
+    if args.save_baseline:
+        with open(args.save_baseline, 'w') as file:
+            json.dump(document, file, indent=1)
+    print('results in', args.out)
+
+    if args.baseline:
+        with open(args.baseline) as file:
+            baseline = json.load(file)['results']
+        regressions = compare(rows, baseline, args.tolerance, args.latency_tolerance)
+        for regression in regressions:
+            print('REGRESSION', regression)
+        if regressions:
+            return 1
+        print('no regression against', args.baseline)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
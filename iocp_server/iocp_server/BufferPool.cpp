@@ -0,0 +1,69 @@
+#include "stdafx.h"
+#include "Platform.h"
+#include "BufferPool.h"
+#include "Log.h"
+
+#include <new>
+
+BufferPool::BufferPool()
+{
+	m_pMemory = NULL;
+	m_nBuffers = 0;
+	m_nBufferSize = 0;
+}
+
+
+BufferPool::~BufferPool()
+{
+	Destroy();
+}
+
+bool BufferPool::Create(unsigned nBuffers, unsigned nBufferSize)
+{
+	m_pMemory = new (std::nothrow) char[(size_t)nBuffers * nBufferSize];
+	if (m_pMemory == NULL)
+	{
+		LOG_ERROR("Buffer pool allocation failure (%u x %u bytes)", nBuffers, nBufferSize);
+		return false;
+	}
+	m_nBuffers = nBuffers;
+	m_nBufferSize = nBufferSize;
+
+	// Lowest ids on top, so a lightly loaded server keeps reusing the same few buffers.
+	m_free.reserve(nBuffers);
+	for (unsigned i = nBuffers; i-- > 0;)
+	{
+		m_free.push_back((int)i);
+	}
+	return true;
+}
+
+void BufferPool::Destroy()
+{
+	delete[] m_pMemory;
+	m_pMemory = NULL;
+	m_free.clear();
+	m_nBuffers = 0;
+}
+
+int BufferPool::Acquire()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_free.empty())
+	{
+		return -1;
+	}
+	int nBufferId = m_free.back();
+	m_free.pop_back();
+	return nBufferId;
+}
+
+void BufferPool::Release(int nBufferId)
+{
+	if (nBufferId < 0)
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_free.push_back(nBufferId);
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <mutex>
+#include <vector>
+
+/**
+ * Fixed set of equally sized receive buffers shared by the connections of a completion
+ * queue. A buffer is taken only once data is actually there to be read and handed back
+ * as soon as the frames in it have been handled, so an idle connection holds no buffer
+ * at all.
+ */
+class BufferPool
+{
+public:
+	BufferPool();
+	~BufferPool();
+
+	// Allocate nBuffers buffers of nBufferSize bytes
+	bool Create(unsigned nBuffers, unsigned nBufferSize);
+	void Destroy();
+
+	// Take a buffer; -1 when every buffer is in use
+	int Acquire();
+	// Give a buffer back; negative ids are ignored
+	void Release(int nBufferId);
+
+	char* GetBuffer(int nBufferId) const { return m_pMemory + (size_t)nBufferId * m_nBufferSize; }
+	unsigned GetBufferSize() const { return m_nBufferSize; }
+
+private:
+	char*			m_pMemory;
+	unsigned		m_nBuffers;
+	unsigned		m_nBufferSize;
+	std::vector<int> m_free;			// Ids of the buffers not in use
+	std::mutex		m_lock;
+};
@@ -0,0 +1,80 @@
+#include "stdafx.h"
+#include "IOCompletionPort.h"
+#include "IocpCompletionQueue.h"
+#include "UringCompletionQueue.h"
+#include "EpollCompletionQueue.h"
+#include "Log.h"
+
+CompletionQueue::CompletionQueue()
+{
+	m_pFreeSendRequests = NULL;
+}
+
+
+CompletionQueue::~CompletionQueue()
+{
+	while (m_pFreeSendRequests)
+	{
+		stSENDREQUEST* pRequest = m_pFreeSendRequests;
+		m_pFreeSendRequests = pRequest->pNext;
+		delete pRequest;
+	}
+}
+
+stSENDREQUEST* CompletionQueue::NewSendRequest(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength)
+{
+	stSENDREQUEST* pRequest = NULL;
+	{
+		std::lock_guard<std::mutex> lock(m_sendRequestLock);
+		pRequest = m_pFreeSendRequests;
+		if (pRequest)
+		{
+			m_pFreeSendRequests = pRequest->pNext;
+		}
+	}
+	if (pRequest == NULL)
+	{
+		pRequest = new stSENDREQUEST();
+	}
+
+	pRequest->operation = IO_SEND;
+	pRequest->pSocketInfo = pSocketInfo;
+	pRequest->nBufferId = -1;
+	pRequest->pBuffer = pBuffer;
+	pRequest->nLength = nLength;
+	pRequest->nOffset = 0;
+	pRequest->nGeneration = pSocketInfo->nGeneration;
+	pRequest->bZeroCopy = false;
+	pRequest->bDone = false;
+	pRequest->nResult = 0;
+	pRequest->nNotifications = 0;
+	pRequest->pNext = NULL;
+	return pRequest;
+}
+
+void CompletionQueue::DeleteSendRequest(stSENDREQUEST* pRequest)
+{
+	std::lock_guard<std::mutex> lock(m_sendRequestLock);
+	pRequest->pNext = m_pFreeSendRequests;
+	m_pFreeSendRequests = pRequest;
+}
+
+CompletionQueue* CreateCompletionQueue(const stSERVERCONFIG& config)
+{
+	switch (config.engine)
+	{
+#ifdef _WIN32
+	case ENGINE_IOCP:
+		return new IocpCompletionQueue(config);
+#endif
+#ifdef __linux__
+	case ENGINE_URING:
+		return new UringCompletionQueue(config);
+	case ENGINE_EPOLL:
+		return new EpollCompletionQueue(config);
+#endif
+	default:
+		LOG_ERROR("I/O engine %d is not available on this platform", (int)config.engine);
+		return NULL;
+	}
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <mutex>
+
+#include "Platform.h"
+
+struct stSOCKETINFO;
+struct stSERVERCONFIG;
+
+// I/O engine that drives the completion queues
+enum ENGINE_TYPE
+{
+	ENGINE_IOCP,		// Windows I/O completion port
+	ENGINE_URING,		// Linux io_uring
+	ENGINE_EPOLL,		// Linux edge-triggered epoll, completions emulated per worker
+};
+
+// Kind of operation a completion belongs to
+enum IO_OPERATION
+{
+	IO_RECV,
+	IO_SEND,
+	IO_ACCEPT,			// nResult carries the accepted socket
+};
+
+// One harvested completion
+struct stCOMPLETION
+{
+	stSOCKETINFO*	pSocketInfo;	// Connection the operation was posted for (NULL for IO_ACCEPT)
+	IO_OPERATION	operation;		// Which operation completed
+	int				nResult;		// Bytes transferred, 0 on EOF, negative on error
+	char*			pBuffer;		// Received data (IO_RECV), or the buffer that was sent (IO_SEND)
+	int				nBufferId;		// Engine buffer id, -1 when the socket's own buffer was used
+	bool			bMore;			// The receive stays armed and will complete again
+	unsigned short	nGeneration;	// pSocketInfo->nGeneration when the operation was posted
+};
+
+// Per-operation I/O context. A connection embeds the one for its receive, every send
+// gets its own, so the two directions never share an overlapped.
+struct stIOCONTEXT
+{
+#ifdef _WIN32
+	WSAOVERLAPPED	overlapped;		// Completions are mapped back to the context from here
+	WSABUF			dataBuf;
+#endif
+	IO_OPERATION	operation;		// Which operation owns the context
+	stSOCKETINFO*	pSocketInfo;	// Connection the operation belongs to
+	int				nBufferId;		// Engine buffer held by the operation, -1 if none
+};
+
+// A send waiting for (or in) flight; a connection can have any number of them queued
+struct stSENDREQUEST : public stIOCONTEXT
+{
+	char*			pBuffer;
+	int				nLength;
+	int				nOffset;		// Bytes already sent
+	unsigned short	nGeneration;	// Generation of the socket info at PostSend
+	bool			bZeroCopy;		// Sent without copying; the buffer stays pinned until notified
+	bool			bDone;			// Every byte is sent, or the send failed
+	int				nResult;		// Final result once bDone
+	int				nNotifications;	// Zero-copy notifications still to come
+	stSENDREQUEST*	pNext;
+};
+
+
+/**
+ * Completion-based I/O underneath IOCompletionPort.
+ *
+ * Every successful PostRecv/PostSend produces exactly one final completion
+ * (a multishot receive produces completions with bMore set until its final one).
+ * A connection has at most one receive armed, but any number of sends; they go out
+ * in the order they were posted.
+ * A queue may be shared by all workers (IOCP) or owned by a single worker (io_uring,
+ * epoll); IsShared() tells the server which layout to use.
+ */
+class CompletionQueue
+{
+public:
+	CompletionQueue();
+	virtual ~CompletionQueue();
+
+	// Create the underlying kernel object
+	virtual bool Create() = 0;
+	// Release the underlying kernel object
+	virtual void Close() = 0;
+	// Whether all workers drain this one queue
+	virtual bool IsShared() const = 0;
+
+	// Register a freshly accepted socket with the queue
+	virtual bool Associate(stSOCKETINFO* pSocketInfo) = 0;
+	// Arm a receive on the socket
+	virtual bool PostRecv(stSOCKETINFO* pSocketInfo) = 0;
+	// Make an armed multishot receive finish early; its final completion follows, failed if
+	// it was cut short. Engines whose receives complete once have nothing to stop.
+	virtual void StopRecv(stSOCKETINFO* /* pSocketInfo */) {}
+	// Send the buffer; the caller keeps it alive until the send completes
+	virtual bool PostSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength) = 0;
+	// Give back a received buffer once its data has been handled
+	virtual void ReleaseBuffer(int nBufferId) = 0;
+	// Complete the operations the kernel will not finish by itself once the socket is closed
+	virtual void CancelIo(stSOCKETINFO* pSocketInfo) = 0;
+
+	// Accept connections from the listening socket on this queue. Returns false when the
+	// engine cannot accept by itself and the server has to run its own accept loop.
+	virtual bool StartAccept(SOCKET /* listenSocket */) { return false; }
+	// Stop re-arming accepts so the listener can be closed; accepts still in flight
+	// complete without a completion. False if the queue was not (or no longer) accepting.
+	virtual bool StopAccept() { return false; }
+	// Make one worker blocked in GetCompletions() return; callable from any thread
+	virtual void Wake() = 0;
+
+	// Wait up to timeoutMs for completions and harvest up to nMax of them in one go.
+	// Returns how many were stored, 0 on timeout or Wake().
+	virtual int GetCompletions(stCOMPLETION* pCompletions, int nMax, DWORD timeoutMs) = 0;
+
+protected:
+	// Send contexts are recycled through a free list instead of a malloc per message
+	stSENDREQUEST* NewSendRequest(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength);
+	void DeleteSendRequest(stSENDREQUEST* pRequest);
+
+private:
+	std::mutex		m_sendRequestLock;
+	stSENDREQUEST*	m_pFreeSendRequests;
+};
+
+// Create a queue for the configured engine, or NULL if the engine is not available on this platform
+CompletionQueue* CreateCompletionQueue(const stSERVERCONFIG& config);
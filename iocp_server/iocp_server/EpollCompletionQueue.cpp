@@ -0,0 +1,446 @@
+#include "stdafx.h"
+#include "IOCompletionPort.h"
+#include "EpollCompletionQueue.h"
+#include "Log.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+// Events harvested per epoll_wait()
+static const int c_maxEvents = 256;
+// Connections accepted before the listener yields to the other sockets
+static const int c_maxAcceptsPerRound = 64;
+// Pause before accepting again after running out of descriptors
+static const int c_acceptRetryMs = 100;
+
+EpollCompletionQueue::EpollCompletionQueue(const stSERVERCONFIG& config)
+{
+	m_epoll = -1;
+	m_wakeEvent = -1;
+	m_listenSocket = INVALID_SOCKET;
+	m_bAcceptReady = false;
+	m_bAcceptStalled = false;
+	m_nBuffers = config.nRecvBuffers;
+	m_nBufferSize = config.nBufferSize;
+}
+
+
+EpollCompletionQueue::~EpollCompletionQueue()
+{
+	Close();
+}
+
+bool EpollCompletionQueue::Create()
+{
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll < 0)
+	{
+		LOG_ERROR("epoll creation failure : %d", errno);
+		return false;
+	}
+
+	m_wakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &m_wakeEvent;
+	if (m_wakeEvent < 0 || epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeEvent, &event) != 0)
+	{
+		LOG_ERROR("eventfd creation failure : %d", errno);
+		return false;
+	}
+	return m_buffers.Create(m_nBuffers, m_nBufferSize);
+}
+
+void EpollCompletionQueue::Close()
+{
+	if (m_epoll >= 0)
+	{
+		close(m_epoll);
+		m_epoll = -1;
+	}
+	if (m_wakeEvent >= 0)
+	{
+		close(m_wakeEvent);
+		m_wakeEvent = -1;
+	}
+	m_buffers.Destroy();
+}
+
+bool EpollCompletionQueue::Associate(stSOCKETINFO* pSocketInfo)
+{
+	int nFlags = fcntl(pSocketInfo->socket, F_GETFL, 0);
+	if (nFlags < 0 || fcntl(pSocketInfo->socket, F_SETFL, nFlags | O_NONBLOCK) < 0)
+	{
+		return false;
+	}
+
+	// Both directions are registered once; the edges only ever flip the flags.
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = pSocketInfo;
+	return epoll_ctl(m_epoll, EPOLL_CTL_ADD, pSocketInfo->socket, &event) == 0;
+}
+
+bool EpollCompletionQueue::StartAccept(SOCKET listenSocket)
+{
+	int nFlags = fcntl(listenSocket, F_GETFL, 0);
+	if (nFlags < 0 || fcntl(listenSocket, F_SETFL, nFlags | O_NONBLOCK) < 0)
+	{
+		return false;
+	}
+
+	// The listener is the only registration without a socket info.
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+	if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, listenSocket, &event) != 0)
+	{
+		return false;
+	}
+	m_listenSocket = listenSocket;
+	return true;
+}
+
+bool EpollCompletionQueue::StopAccept()
+{
+	if (m_listenSocket == INVALID_SOCKET)
+	{
+		return false;
+	}
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, m_listenSocket, NULL);
+	m_listenSocket = INVALID_SOCKET;
+	m_bAcceptReady = false;
+	m_bAcceptStalled = false;
+	return true;
+}
+
+void EpollCompletionQueue::Wake()
+{
+	eventfd_write(m_wakeEvent, 1);
+}
+
+bool EpollCompletionQueue::PostRecv(stSOCKETINFO* pSocketInfo)
+{
+	pSocketInfo->bRecvPending = true;
+	Schedule(pSocketInfo);
+	return true;
+}
+
+bool EpollCompletionQueue::PostSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength)
+{
+	stSENDREQUEST* pRequest = NewSendRequest(pSocketInfo, pBuffer, nLength);
+
+	if (pSocketInfo->pSendTail)
+	{
+		pSocketInfo->pSendTail->pNext = pRequest;
+	}
+	else
+	{
+		pSocketInfo->pSendHead = pRequest;
+	}
+	pSocketInfo->pSendTail = pRequest;
+	Schedule(pSocketInfo);
+	return true;
+}
+
+void EpollCompletionQueue::ReleaseBuffer(int nBufferId)
+{
+	if (nBufferId < 0)
+	{
+		return;
+	}
+	m_buffers.Release(nBufferId);
+
+	// Let the starved receives compete for it again.
+	for (stSOCKETINFO* pSocketInfo : m_starved)
+	{
+		Schedule(pSocketInfo);
+	}
+	m_starved.clear();
+}
+
+void EpollCompletionQueue::CancelIo(stSOCKETINFO* pSocketInfo)
+{
+	m_starved.erase(std::remove(m_starved.begin(), m_starved.end(), pSocketInfo), m_starved.end());
+
+	if (pSocketInfo->bServiceQueued)
+	{
+		for (std::deque<stSOCKETINFO*>::iterator it = m_ready.begin(); it != m_ready.end(); ++it)
+		{
+			if (*it == pSocketInfo)
+			{
+				m_ready.erase(it);
+				break;
+			}
+		}
+		pSocketInfo->bServiceQueued = false;
+	}
+
+	// Closing the descriptor drops its registration, so no edge will finish these.
+	if (pSocketInfo->bRecvPending)
+	{
+		pSocketInfo->bRecvPending = false;
+		Complete(pSocketInfo, IO_RECV, -ECANCELED, NULL);
+	}
+	while (pSocketInfo->pSendHead)
+	{
+		stSENDREQUEST* pRequest = pSocketInfo->pSendHead;
+		pSocketInfo->pSendHead = pRequest->pNext;
+		Complete(pSocketInfo, IO_SEND, -ECANCELED, pRequest->pBuffer);
+		DeleteSendRequest(pRequest);
+	}
+	pSocketInfo->pSendTail = NULL;
+}
+
+void EpollCompletionQueue::Schedule(stSOCKETINFO* pSocketInfo)
+{
+	if (pSocketInfo->bServiceQueued)
+	{
+		return;
+	}
+	if ((pSocketInfo->bRecvPending && pSocketInfo->bReadable) ||
+		(pSocketInfo->pSendHead && pSocketInfo->bWritable))
+	{
+		pSocketInfo->bServiceQueued = true;
+		m_ready.push_back(pSocketInfo);
+	}
+}
+
+void EpollCompletionQueue::Complete(stSOCKETINFO* pSocketInfo, IO_OPERATION operation, int nResult,
+	char* pBuffer, int nBufferId)
+{
+	stCOMPLETION completion;
+	completion.pSocketInfo = pSocketInfo;
+	completion.operation = operation;
+	completion.nResult = nResult;
+	completion.pBuffer = pBuffer;
+	completion.nBufferId = nBufferId;
+	completion.bMore = false;
+	completion.nGeneration = pSocketInfo ? pSocketInfo->nGeneration : 0;
+	m_completions.push_back(completion);
+}
+
+void EpollCompletionQueue::ServiceSocket(stSOCKETINFO* pSocketInfo)
+{
+	int nBufferId = -1;
+	bool bStarved = false;
+	if (pSocketInfo->bRecvPending && pSocketInfo->bReadable)
+	{
+		nBufferId = m_buffers.Acquire();
+	}
+	if (nBufferId >= 0)
+	{
+		char* pBuffer = m_buffers.GetBuffer(nBufferId);
+		int nResult = (int)recv(pSocketInfo->socket, pBuffer, m_nBufferSize, 0);
+		if (nResult > 0)
+		{
+			// More may still be queued; the flag stays set until recv says otherwise.
+			pSocketInfo->bRecvPending = false;
+			Complete(pSocketInfo, IO_RECV, nResult, pBuffer, nBufferId);
+		}
+		else
+		{
+			m_buffers.Release(nBufferId);
+			if (nResult == 0)
+			{
+				pSocketInfo->bRecvPending = false;
+				Complete(pSocketInfo, IO_RECV, 0, NULL);
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				pSocketInfo->bReadable = false;
+			}
+			else if (errno != EINTR)
+			{
+				pSocketInfo->bRecvPending = false;
+				Complete(pSocketInfo, IO_RECV, -errno, NULL);
+			}
+		}
+	}
+	else if (pSocketInfo->bRecvPending && pSocketInfo->bReadable)
+	{
+		// Every buffer holds a receive not handled yet; wait for one to come back.
+		if (std::find(m_starved.begin(), m_starved.end(), pSocketInfo) == m_starved.end())
+		{
+			m_starved.push_back(pSocketInfo);
+		}
+		bStarved = true;
+	}
+
+	while (pSocketInfo->pSendHead && pSocketInfo->bWritable)
+	{
+		stSENDREQUEST* pRequest = pSocketInfo->pSendHead;
+		int nResult = (int)send(pSocketInfo->socket, pRequest->pBuffer + pRequest->nOffset,
+			pRequest->nLength - pRequest->nOffset, MSG_NOSIGNAL);
+		if (nResult < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				pSocketInfo->bWritable = false;
+				break;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			Complete(pSocketInfo, IO_SEND, -errno, pRequest->pBuffer);
+		}
+		else
+		{
+			pRequest->nOffset += nResult;
+			if (pRequest->nOffset < pRequest->nLength)
+			{
+				continue;
+			}
+			Complete(pSocketInfo, IO_SEND, pRequest->nOffset, pRequest->pBuffer);
+		}
+
+		pSocketInfo->pSendHead = pRequest->pNext;
+		if (pSocketInfo->pSendHead == NULL)
+		{
+			pSocketInfo->pSendTail = NULL;
+		}
+		DeleteSendRequest(pRequest);
+	}
+
+	// Interrupted receive, go round again.
+	if (!bStarved)
+	{
+		Schedule(pSocketInfo);
+	}
+}
+
+void EpollCompletionQueue::ServiceAccept()
+{
+	for (int i = 0; i < c_maxAcceptsPerRound; i++)
+	{
+		SOCKET clientSocket = accept4(m_listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (clientSocket == INVALID_SOCKET)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			if (errno == EMFILE || errno == ENFILE)
+			{
+				// Connections are left in the backlog but no new edge will come for them;
+				// try again after a pause.
+				m_bAcceptStalled = true;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				Complete(NULL, IO_ACCEPT, -errno, NULL);
+			}
+			m_bAcceptReady = false;
+			return;
+		}
+		Complete(NULL, IO_ACCEPT, (int)clientSocket, NULL);
+	}
+}
+
+int EpollCompletionQueue::GetCompletions(stCOMPLETION* pCompletions, int nMax, DWORD timeoutMs)
+{
+	epoll_event events[c_maxEvents];
+
+	for (;;)
+	{
+		if (!m_completions.empty())
+		{
+			int nCount = 0;
+			while (nCount < nMax && !m_completions.empty())
+			{
+				pCompletions[nCount++] = m_completions.front();
+				m_completions.pop_front();
+			}
+			return nCount;
+		}
+
+		// Do the I/O of everything that was ready; sockets re-queued on the way wait a round.
+		if (m_bAcceptReady)
+		{
+			ServiceAccept();
+		}
+		for (size_t nReady = m_ready.size(); nReady > 0 && !m_ready.empty(); nReady--)
+		{
+			stSOCKETINFO* pSocketInfo = m_ready.front();
+			m_ready.pop_front();
+			pSocketInfo->bServiceQueued = false;
+			ServiceSocket(pSocketInfo);
+		}
+		if (!m_completions.empty())
+		{
+			continue;
+		}
+
+		int nTimeout = (timeoutMs == INFINITE) ? -1 : (int)timeoutMs;
+		if (m_bAcceptReady || !m_ready.empty())
+		{
+			nTimeout = 0;
+		}
+		else if (m_bAcceptStalled && (nTimeout < 0 || nTimeout > c_acceptRetryMs))
+		{
+			nTimeout = c_acceptRetryMs;
+		}
+		int nEvents = epoll_wait(m_epoll, events, c_maxEvents, nTimeout);
+		if (nEvents < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return 0;
+		}
+		// A stalled listener gets another try whenever the wait returns.
+		bool bRetryAccept = m_bAcceptStalled;
+		if (bRetryAccept)
+		{
+			m_bAcceptStalled = false;
+			m_bAcceptReady = true;
+		}
+		if (nEvents == 0 && nTimeout != 0 && !bRetryAccept)
+		{
+			return 0;
+		}
+
+		bool bWoken = false;
+		for (int i = 0; i < nEvents; i++)
+		{
+			if (events[i].data.ptr == &m_wakeEvent)
+			{
+				eventfd_t value;
+				eventfd_read(m_wakeEvent, &value);
+				bWoken = true;
+				continue;
+			}
+			stSOCKETINFO* pSocketInfo = (stSOCKETINFO*)events[i].data.ptr;
+			if (pSocketInfo == NULL)
+			{
+				m_bAcceptReady = m_listenSocket != INVALID_SOCKET;
+				continue;
+			}
+			// Errors and hang-ups surface through the next recv/send.
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			{
+				pSocketInfo->bReadable = true;
+			}
+			if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			{
+				pSocketInfo->bWritable = true;
+			}
+			Schedule(pSocketInfo);
+		}
+		if (bWoken)
+		{
+			return 0;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+#include "CompletionQueue.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+#include <deque>
+#include <vector>
+
+#include "BufferPool.h"
+
+/**
+ * CompletionQueue on top of an edge-triggered epoll instance. Each worker owns one
+ * epoll set and one SO_REUSEPORT listener, so a connection lives on a single core
+ * from accept to close.
+ *
+ * Sockets are registered once for both directions with EPOLLET. An edge only marks the
+ * socket readable/writable; the queue then performs the posted recv/send itself until
+ * the kernel reports EAGAIN and turns the result into a completion, which keeps the
+ * proactor contract of CompletionQueue. A receive takes a buffer from the worker's pool
+ * only when recv() actually has data for it. Everything except Create/StartAccept must
+ * be called from the owning worker (Wake() may come from anywhere).
+ */
+class EpollCompletionQueue : public CompletionQueue
+{
+public:
+	explicit EpollCompletionQueue(const stSERVERCONFIG& config);
+	virtual ~EpollCompletionQueue();
+
+	virtual bool Create() override;
+	virtual void Close() override;
+	virtual bool IsShared() const override { return false; }
+
+	virtual bool Associate(stSOCKETINFO* pSocketInfo) override;
+	virtual bool PostRecv(stSOCKETINFO* pSocketInfo) override;
+	virtual bool PostSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength) override;
+	virtual void ReleaseBuffer(int nBufferId) override;
+	virtual void CancelIo(stSOCKETINFO* pSocketInfo) override;
+	virtual bool StartAccept(SOCKET listenSocket) override;
+	virtual bool StopAccept() override;
+	virtual void Wake() override;
+
+	virtual int GetCompletions(stCOMPLETION* pCompletions, int nMax, DWORD timeoutMs) override;
+
+private:
+	// Queue the socket for ServiceSocket() unless it is already waiting
+	void Schedule(stSOCKETINFO* pSocketInfo);
+	// Perform the pending receive and sends the readiness flags allow
+	void ServiceSocket(stSOCKETINFO* pSocketInfo);
+	// Accept until the backlog is empty or the per-round limit is hit
+	void ServiceAccept();
+	// Queue a completion for the worker
+	void Complete(stSOCKETINFO* pSocketInfo, IO_OPERATION operation, int nResult,
+		char* pBuffer, int nBufferId = -1);
+
+	int				m_epoll;			// epoll instance
+	int				m_wakeEvent;		// eventfd Wake() signals
+	SOCKET			m_listenSocket;		// This queue's listener, INVALID_SOCKET if none
+	bool			m_bAcceptReady;		// Listener edge seen and accept has not hit EAGAIN since
+	bool			m_bAcceptStalled;	// Accept ran out of descriptors with connections left
+	unsigned		m_nBuffers;
+	unsigned		m_nBufferSize;
+	BufferPool		m_buffers;			// Receive buffers of this worker's connections
+	std::vector<stSOCKETINFO*> m_starved;	// Readable sockets waiting for a free buffer
+	std::deque<stSOCKETINFO*> m_ready;	// Sockets with posted I/O the flags allow
+	std::deque<stCOMPLETION> m_completions;	// Finished operations not yet handed out
+};
+
+#endif
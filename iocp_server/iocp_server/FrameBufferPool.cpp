@@ -0,0 +1,121 @@
+#include "stdafx.h"
+#include "Platform.h"
+#include "FrameBufferPool.h"
+#include "Log.h"
+
+#include <new>
+
+FrameBufferPool::FrameBufferPool()
+{
+	m_nBlockSize = 0;
+	m_pShards = NULL;
+	m_nShards = 0;
+	m_nBudget = 0;
+	m_nBytesInUse = 0;
+}
+
+
+FrameBufferPool::~FrameBufferPool()
+{
+	Destroy();
+}
+
+bool FrameBufferPool::Create(unsigned nBlockSize, unsigned nShards, uint64_t nBudget)
+{
+	if (nBlockSize == 0 || nShards == 0)
+	{
+		return false;
+	}
+	m_pShards = new (std::nothrow) stSHARD[nShards];
+	if (m_pShards == NULL)
+	{
+		return false;
+	}
+	for (unsigned i = 0; i < nShards; i++)
+	{
+		m_pShards[i].pFreeHead = NULL;
+	}
+	m_nShards = nShards;
+	m_nBlockSize = nBlockSize;
+	m_nBudget = nBudget;
+	return true;
+}
+
+void FrameBufferPool::Destroy()
+{
+	for (unsigned i = 0; i < m_nShards; i++)
+	{
+		while (m_pShards[i].pFreeHead)
+		{
+			stBLOCK* pBlock = m_pShards[i].pFreeHead;
+			m_pShards[i].pFreeHead = pBlock->pNext;
+			delete[] (char*)pBlock;
+		}
+	}
+	delete[] m_pShards;
+	m_pShards = NULL;
+	m_nShards = 0;
+}
+
+char* FrameBufferPool::Allocate(unsigned nSize, unsigned nShard)
+{
+	unsigned nCharge = (nSize <= m_nBlockSize) ? m_nBlockSize : nSize;
+	if (m_nBudget)
+	{
+		// Charged up front, so threads racing for the last of the budget cannot both get it.
+		if (m_nBytesInUse.fetch_add(nCharge, std::memory_order_relaxed) + nCharge > m_nBudget)
+		{
+			m_nBytesInUse.fetch_sub(nCharge, std::memory_order_relaxed);
+			return NULL;
+		}
+	}
+	else
+	{
+		m_nBytesInUse.fetch_add(nCharge, std::memory_order_relaxed);
+	}
+
+	stBLOCK* pBlock = NULL;
+	if (nSize <= m_nBlockSize)
+	{
+		stSHARD& shard = m_pShards[nShard % m_nShards];
+		std::lock_guard<std::mutex> lock(shard.lock);
+		pBlock = shard.pFreeHead;
+		if (pBlock)
+		{
+			shard.pFreeHead = pBlock->pNext;
+		}
+		nSize = m_nBlockSize;
+	}
+	if (pBlock == NULL)
+	{
+		pBlock = (stBLOCK*)new (std::nothrow) char[sizeof(stBLOCK) + nSize];
+		if (pBlock == NULL)
+		{
+			LOG_ERROR("Frame buffer allocation failure (%u bytes)", nSize);
+			m_nBytesInUse.fetch_sub(nCharge, std::memory_order_relaxed);
+			return NULL;
+		}
+		pBlock->nCapacity = nSize;
+	}
+	pBlock->nTag = 0;
+	return (char*)(pBlock + 1);
+}
+
+void FrameBufferPool::Free(char* pBuffer, unsigned nShard)
+{
+	if (pBuffer == NULL)
+	{
+		return;
+	}
+	stBLOCK* pBlock = (stBLOCK*)pBuffer - 1;
+	m_nBytesInUse.fetch_sub(pBlock->nCapacity, std::memory_order_relaxed);
+	if (pBlock->nCapacity != m_nBlockSize)
+	{
+		delete[] (char*)pBlock;
+		return;
+	}
+	stSHARD& shard = m_pShards[nShard % m_nShards];
+	std::lock_guard<std::mutex> lock(shard.lock);
+	pBlock->pNext = shard.pFreeHead;
+	shard.pFreeHead = pBlock;
+}
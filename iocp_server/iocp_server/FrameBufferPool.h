@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+/**
+ * Buffers for outgoing frames and for incoming frames that straddle receives.
+ *
+ * Frames up to the block size (one receive buffer plus a frame header, so any frame
+ * that fit in a single receive) are served from per-worker free lists that grow to the
+ * peak number in flight and are then recycled without reaching malloc. Larger frames
+ * get a buffer of their own that is deleted again on Free.
+ *
+ * With a budget, the bytes handed out (cached blocks not included) never exceed it:
+ * Allocate fails instead, and the caller sheds whatever needed the memory.
+ */
+class FrameBufferPool
+{
+public:
+	FrameBufferPool();
+	~FrameBufferPool();
+
+	// Set the block size, the number of free lists and the budget (0 = unlimited)
+	bool Create(unsigned nBlockSize, unsigned nShards, uint64_t nBudget = 0);
+	// Delete the cached blocks; none may be in use
+	void Destroy();
+
+	// A buffer of at least nSize bytes, preferring the given free list. NULL when out of memory
+	// or over the budget.
+	char* Allocate(unsigned nSize, unsigned nShard);
+	// Give a buffer back; NULL is ignored
+	void Free(char* pBuffer, unsigned nShard);
+
+	unsigned GetBlockSize() const { return m_nBlockSize; }
+	// Bytes of the buffers handed out and not freed yet
+	uint64_t GetBytesInUse() const { return m_nBytesInUse.load(std::memory_order_relaxed); }
+
+	// Bytes a buffer holds, at least the size it was allocated for
+	static unsigned GetCapacity(const char* pBuffer) { return ((const stBLOCK*)pBuffer - 1)->nCapacity; }
+
+	// A value the owner of an allocated buffer keeps with it, 0 after Allocate
+	static int64_t GetTag(const char* pBuffer) { return ((const stBLOCK*)pBuffer - 1)->nTag; }
+	static void SetTag(char* pBuffer, int64_t nTag) { ((stBLOCK*)pBuffer - 1)->nTag = nTag; }
+
+private:
+	// Sits in front of every buffer handed out
+	struct stBLOCK
+	{
+		union
+		{
+			stBLOCK*	pNext;			// Free list link, while the block is free
+			int64_t		nTag;			// Owner's value, while it is allocated
+		};
+		unsigned		nCapacity;		// Bytes after the header
+		unsigned		nReserved;		// Keeps the data 16-byte aligned
+	};
+
+	struct alignas(64) stSHARD
+	{
+		std::mutex		lock;
+		stBLOCK*		pFreeHead;
+	};
+
+	unsigned		m_nBlockSize;
+	stSHARD*		m_pShards;
+	unsigned		m_nShards;
+	uint64_t		m_nBudget;			// 0 when unlimited
+	alignas(64) std::atomic<uint64_t> m_nBytesInUse;	// Shared by every shard, so on a line of its own
+};
@@ -0,0 +1,39 @@
+#include "stdafx.h"
+#include "Framing.h"
+
+int EncodeFrameHeader(char* pHeader, unsigned nLength)
+{
+	int nSize = 0;
+	while (nLength >= 0x80)
+	{
+		pHeader[nSize++] = (char)((nLength & 0x7F) | 0x80);
+		nLength >>= 7;
+	}
+	pHeader[nSize++] = (char)nLength;
+	return nSize;
+}
+
+int DecodeFrameHeader(const char* pData, unsigned nAvailable, unsigned& nLength)
+{
+	unsigned nValue = 0;
+	for (unsigned i = 0; i < FRAME_HEADER_MAX; i++)
+	{
+		if (i == nAvailable)
+		{
+			return 0;
+		}
+		unsigned char byte = (unsigned char)pData[i];
+		// The fifth byte only has room for the top 4 bits of a 32-bit length.
+		if (i == FRAME_HEADER_MAX - 1 && byte > 0x0F)
+		{
+			return -1;
+		}
+		nValue |= (unsigned)(byte & 0x7F) << (7 * i);
+		if ((byte & 0x80) == 0)
+		{
+			nLength = nValue;
+			return (int)i + 1;
+		}
+	}
+	return -1;
+}
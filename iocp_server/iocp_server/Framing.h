@@ -0,0 +1,65 @@
+#pragma once
+
+class IOCompletionPort;
+struct stSOCKETINFO;
+
+/**
+ * Wire format of the server: every message is a frame made of its payload length as an
+ * unsigned LEB128 varint (7 bits per byte, least significant group first, high bit set
+ * on all but the last byte) followed by the payload. Lengths below 128 cost one byte
+ * of header, a 32-bit length at most FRAME_HEADER_MAX.
+ */
+#define FRAME_HEADER_MAX	5
+
+// Write the header for a payload of nLength bytes; returns the header size
+int EncodeFrameHeader(char* pHeader, unsigned nLength);
+// Read a header from the start of nAvailable bytes. Returns the header size with the
+// payload length in nLength, 0 if more bytes are needed, -1 if the header is malformed.
+int DecodeFrameHeader(const char* pData, unsigned nAvailable, unsigned& nLength);
+
+// A frame that straddles receives, collected until it is whole
+struct stFRAMEREASSEMBLY
+{
+	char*			pBuffer;		// Frame being collected, NULL when the last receive ended on a frame boundary
+	unsigned		nLength;		// Bytes collected, header included
+	unsigned		nFrameSize;		// Header plus payload once the header is complete, 0 before
+};
+
+/**
+ * Application logic behind the server, registered with IOCompletionPort::SetFrameHandler().
+ * The server cuts the byte stream into frames and calls OnFrame for each whole one.
+ *
+ * A non-blocking handler runs on the I/O thread that received the frame. A blocking one
+ * runs on the server's handler threads, so the I/O threads never wait for it. Either
+ * way the frames of a connection are handled one after the other (a connection sticks
+ * to one handler thread), so replies sent from OnFrame keep the order of the requests.
+ */
+class FrameHandler
+{
+public:
+	virtual ~FrameHandler() {}
+
+	// Whether OnFrame may block or run long enough to hold up the connections of an I/O thread
+	virtual bool IsBlocking() const { return false; }
+
+	// A whole frame arrived; pPayload is only valid during the call. Replies go out with
+	// server.SendFrame(), during the call or, after server.HoldConnection(), later from
+	// any thread until server.ReleaseConnection().
+	virtual void OnFrame(IOCompletionPort& server, stSOCKETINFO* pSocketInfo,
+		const char* pPayload, unsigned nLength) = 0;
+};
+
+// Sends every frame back as it is
+class EchoFrameHandler : public FrameHandler
+{
+public:
+	// A blocking echo goes through the handler threads, which is only useful to measure them
+	explicit EchoFrameHandler(bool bBlocking = false) : m_bBlocking(bBlocking) {}
+
+	virtual bool IsBlocking() const override { return m_bBlocking; }
+	virtual void OnFrame(IOCompletionPort& server, stSOCKETINFO* pSocketInfo,
+		const char* pPayload, unsigned nLength) override;
+
+private:
+	bool			m_bBlocking;
+};
@@ -1,274 +1,1287 @@
 #include "stdafx.h"
 #include "IOCompletionPort.h"
-#include <process.h>
+#include "Log.h"
 
-unsigned int WINAPI CallWorkerThread(LPVOID p)
+#include <algorithm>
+
+// Worker index of the calling thread; selects its free list in the connection pool
+static thread_local unsigned s_nWorker = 0;
+// Completion queue the calling worker serves, -1 on any other thread
+static thread_local int s_nQueue = -1;
+// Receive completion of the request being handled on this thread, 0 if none; replies
+// carry it to their send completion for the latency histogram
+static thread_local int64_t s_nRecvTime = 0;
+// TimerWheel::Now() when the calling worker's current batch was harvested, 0 on other threads
+static thread_local int64_t s_nNowMs = 0;
+
+// Time for the connection deadlines: once per batch on a worker
+static int64_t NowMs()
 {
-	IOCompletionPort* pOverlappedEvent = (IOCompletionPort*)p;
-	pOverlappedEvent->WorkerThread();
-	return 0;
+	return s_nNowMs ? s_nNowMs : TimerWheel::Now();
 }
 
 IOCompletionPort::IOCompletionPort()
 {
-	m_bWorkerThread = true;
-	m_bAccept = true;
+	m_listenSocket = INVALID_SOCKET;
+	m_nNextQueue = 0;
+	m_bQueueAccept = false;
+	m_state = SERVER_RUNNING;
+	m_nConnections = 0;
+	m_pFrameHandler = &m_echoHandler;
+	m_bBlockingHandler = false;
+	m_pMailboxes = NULL;
+	m_pHandlerQueues = NULL;
+	m_nQueuedBytes = 0;
+	m_pTimers = NULL;
+	m_nTimerCheckMs = INFINITE;
+	m_bHandlersStop = false;
+	m_pStats = NULL;
+	m_nStatsSlots = 0;
+	m_nStartTime = StatsNow();
 }
 
 
 IOCompletionPort::~IOCompletionPort()
 {
-	// winsock end 
-	WSACleanup();
+	// Workers still running would use the queues deleted below.
+	Shutdown();
+
 	// Delete used objects
-	if (m_pSocketInfo)
+	for (CompletionQueue* pQueue : m_queues)
 	{
-		delete[] m_pSocketInfo;
-		m_pSocketInfo = NULL;
+		pQueue->Close();
+		delete pQueue;
 	}
+	m_queues.clear();
+	delete[] m_pMailboxes;
+	m_pMailboxes = NULL;
+	delete[] m_pHandlerQueues;
+	m_pHandlerQueues = NULL;
+	delete[] m_pTimers;
+	m_pTimers = NULL;
+	delete[] m_pStats;
+	m_pStats = NULL;
 
-	if (m_pWorkerHandle)
+	CloseListenSocket(m_listenSocket);
+	for (SOCKET& listenSocket : m_queueListenSockets)
 	{
-		delete[] m_pWorkerHandle;
-		m_pWorkerHandle = NULL;
+		CloseListenSocket(listenSocket);
 	}
+	m_queueListenSockets.clear();
+
+#ifdef _WIN32
+	// winsock end
+	WSACleanup();
+#endif
 }
 
-bool IOCompletionPort::Initialize()
+bool IOCompletionPort::Initialize(const stSERVERCONFIG& config)
 {
+	m_config = config;
+
+#ifdef _WIN32
 	WSADATA wsaData;
-	int nResult;
 	// winsock 2.2
-	nResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	int nResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
 
-	if (nResult != 0) 
+	if (nResult != 0)
 	{
-		printf_s("[ERROR] winsock Initialization failed\n");
+		LOG_ERROR("winsock Initialization failed");
 		return false;
 	}
+#endif
+
+	m_listenSocket = CreateListenSocket(false);
+	return m_listenSocket != INVALID_SOCKET;
+}
+
+SOCKET IOCompletionPort::CreateListenSocket(bool bReusePort)
+{
+	int nResult;
 
 	// Create a socket
-	m_listenSocket = WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
-	if (m_listenSocket == INVALID_SOCKET)
+#ifdef _WIN32
+	SOCKET listenSocket = WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
+#else
+	SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+#endif
+	if (listenSocket == INVALID_SOCKET)
 	{
-		printf_s("[ERROR] Socket creation failed\n");
-		return false;
+		LOG_ERROR("Socket creation failed");
+		return INVALID_SOCKET;
+	}
+
+#ifndef _WIN32
+	int nReuse = 1;
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &nReuse, sizeof(nReuse));
+#endif
+	if (bReusePort)
+	{
+#ifndef _WIN32
+		// Queues that accept by themselves each listen on their own socket for the same port.
+		setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &nReuse, sizeof(nReuse));
+#endif
 	}
 
 	// Set up server information
 	SOCKADDR_IN serverAddr;
+	memset(&serverAddr, 0, sizeof(serverAddr));
 	serverAddr.sin_family = PF_INET;
-	serverAddr.sin_port = htons(SERVER_PORT);
-	serverAddr.sin_addr.S_un.S_addr = htonl(INADDR_ANY);
+	serverAddr.sin_port = htons(m_config.nPort);
+	serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
 	// Socket settings
-	nResult = bind(m_listenSocket, (struct sockaddr*)&serverAddr, sizeof(SOCKADDR_IN));
+	nResult = bind(listenSocket, (struct sockaddr*)&serverAddr, sizeof(SOCKADDR_IN));
 	if (nResult == SOCKET_ERROR)
 	{
-		printf_s("[ERROR] bind failure\n");
-		closesocket(m_listenSocket);
-		WSACleanup();
-		return false;
+		LOG_ERROR("bind failure");
+		closesocket(listenSocket);
+		return INVALID_SOCKET;
 	}
 
-	// Create an incoming queue
-	nResult = listen(m_listenSocket, 5);
+	// Create an incoming queue, deep enough to absorb a burst of connects
+	nResult = listen(listenSocket, m_config.nListenBacklog);
 	if (nResult == SOCKET_ERROR)
 	{
-		printf_s("[ERROR] listen failure\n");
-		closesocket(m_listenSocket);
-		WSACleanup();
-		return false;
+		LOG_ERROR("listen failure");
+		closesocket(listenSocket);
+		return INVALID_SOCKET;
 	}
 
-	return true;
+	return listenSocket;
 }
 
 void IOCompletionPort::StartServer()
 {
-	int nResult;
 	// Client information
 	SOCKADDR_IN clientAddr;
-	int addrLen = sizeof(SOCKADDR_IN);
+	socklen_t addrLen;
 	SOCKET clientSocket;
-	DWORD recvBytes;
-	DWORD flags;
 
-	// Completion Port creating
-	m_hIOCP = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	if (m_state != SERVER_RUNNING) return;
 
-	// Worker Thread creating
+	// Completion queues and worker threads creating
 	if (!CreateWorkerThread()) return;
 
-	printf_s("[INFO]starting server..\n");
+	m_nStartTime = StatsNow();
+	if (m_config.pStatsFile)
+	{
+		m_statsThread = std::thread(&IOCompletionPort::StatsThread, this);
+	}
+	LOG_INFO("starting server..");
 
-	// Receiving client access
-	while (m_bAccept)
-	{		
-		clientSocket = WSAAccept(
-			m_listenSocket, (struct sockaddr *)&clientAddr, &addrLen, NULL, NULL
-		);
+	// Receiving client access, unless every worker accepts on its own listener
+	while (!m_bQueueAccept && m_state == SERVER_RUNNING)
+	{
+		addrLen = sizeof(SOCKADDR_IN);
+		clientSocket = accept(m_listenSocket, (struct sockaddr *)&clientAddr, &addrLen);
 
 		if (clientSocket == INVALID_SOCKET)
 		{
-			printf_s("[ERROR] Accept failure\n");
-			return;
+			if (m_state == SERVER_RUNNING)
+			{
+				LOG_ERROR("Accept failure");
+				ThreadStats().Count(STAT_ERRORS_ACCEPT);
+			}
+			break;
 		}
 
-		m_pSocketInfo = new stSOCKETINFO();
-		m_pSocketInfo->socket = clientSocket;
-		m_pSocketInfo->recvBytes = 0;
-		m_pSocketInfo->sendBytes = 0;
-		m_pSocketInfo->dataBuf.len = MAX_BUFFER;
-		m_pSocketInfo->dataBuf.buf = m_pSocketInfo->messageBuffer;
-		flags = 0;
-
-		m_hIOCP = CreateIoCompletionPort(
-			(HANDLE)clientSocket, m_hIOCP, (DWORD)m_pSocketInfo, 0
-		);
-
-		// Specify a nested socket and hand over a function to be executed upon completion.
-		nResult = WSARecv(
-			m_pSocketInfo->socket,
-			&m_pSocketInfo->dataBuf,
-			1,
-			&recvBytes,
-			&flags,
-			&(m_pSocketInfo->overlapped),
-			NULL
-		);
-
-		if (nResult == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
-		{
-			printf_s("[ERROR] IO Pending failure: %d", WSAGetLastError());
-			return;
+		AcceptSocket(clientSocket, m_nNextQueue % m_queues.size(), m_nNextQueue % m_workerThreads.size());
+		m_nNextQueue++;
+	}
+
+	// The workers are joined by Shutdown().
+	std::unique_lock<std::mutex> lock(m_stateLock);
+	m_stateChanged.wait(lock, [this] { return m_state == SERVER_STOPPED; });
+}
+
+void IOCompletionPort::Shutdown()
+{
+	SERVER_STATE state = SERVER_RUNNING;
+	if (!m_state.compare_exchange_strong(state, SERVER_DRAINING))
+	{
+		// Somebody else is shutting down; wait until they are done.
+		std::unique_lock<std::mutex> lock(m_stateLock);
+		m_stateChanged.wait(lock, [this] { return m_state == SERVER_STOPPED; });
+		return;
+	}
+	LOG_INFO("Shutting down, draining %u connection(s)", m_nConnections.load());
+
+	// The acceptor thread only leaves accept() when its listener goes away; queues that
+	// accept by themselves close theirs in DrainConnections().
+	if (!m_bQueueAccept)
+	{
+		CloseListenSocket(m_listenSocket);
+	}
+	WakeWorkers();
+
+	{
+		std::unique_lock<std::mutex> lock(m_stateLock);
+		if (!m_stateChanged.wait_for(lock, std::chrono::milliseconds(m_config.nDrainTimeoutMs),
+			[this] { return m_nConnections == 0; }))
+		{
+			LOG_INFO("Drain timed out, closing %u connection(s)", m_nConnections.load());
+			m_state = SERVER_STOPPING;
+			lock.unlock();
+			WakeWorkers();
+		}
+	}
+
+	// Workers leave once the last connection is gone.
+	for (std::thread& workerThread : m_workerThreads)
+	{
+		workerThread.join();
+	}
+	m_workerThreads.clear();
+
+	// Every hold has been released, so the handler threads have nothing left to do.
+	m_bHandlersStop = true;
+	for (size_t i = 0; i < m_handlerThreads.size(); i++)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_pHandlerQueues[i].lock);
+		}
+		m_pHandlerQueues[i].ready.notify_all();
+		m_handlerThreads[i].join();
+	}
+	m_handlerThreads.clear();
+	m_socketPool.Destroy();
+	m_frameBuffers.Destroy();
+
+	{
+		std::lock_guard<std::mutex> lock(m_stateLock);
+		m_state = SERVER_STOPPED;
+	}
+	m_stateChanged.notify_all();
+	// Writes the final numbers on its way out
+	if (m_statsThread.joinable())
+	{
+		m_statsThread.join();
+	}
+	LOG_INFO("Server stopped");
+}
+
+void IOCompletionPort::WakeWorkers()
+{
+	// One wake-up per worker; workers sharing a queue each take one of them.
+	for (size_t i = 0; i < m_workerThreads.size(); i++)
+	{
+		m_queues[i % m_queues.size()]->Wake();
+	}
+}
+
+void IOCompletionPort::CloseListenSocket(SOCKET& listenSocket)
+{
+	if (listenSocket == INVALID_SOCKET)
+	{
+		return;
+	}
+	// On Linux closing alone does not end an accept() or io_uring accept that is blocked
+	// on the socket; shutting it down does.
+	shutdown(listenSocket, SD_BOTH);
+	closesocket(listenSocket);
+	listenSocket = INVALID_SOCKET;
+}
+
+void IOCompletionPort::DrainConnections(int nQueue, bool bForce)
+{
+	CompletionQueue* pQueue = m_queues[nQueue];
+
+	// Only one of the workers sharing a queue gets to close its listener.
+	if (m_bQueueAccept && pQueue->StopAccept())
+	{
+		CloseListenSocket(nQueue == 0 ? m_listenSocket : m_queueListenSockets[nQueue - 1]);
+	}
+
+	// Free slots are marked closing, and nothing is allocated once the server drains.
+	for (unsigned i = 0; i < m_socketPool.GetCapacity(); i++)
+	{
+		stSOCKETINFO* pSocketInfo = m_socketPool.GetSlot(i);
+		if (pSocketInfo->bClosing || (!pQueue->IsShared() && pSocketInfo->nQueue != nQueue))
+		{
+			continue;
+		}
+		// The rest close as their last reply completes.
+		if (bForce || pSocketInfo->nPendingSends == 0)
+		{
+			CloseSocket(pSocketInfo);
 		}
 	}
+}
+
+void IOCompletionPort::AcceptSocket(SOCKET clientSocket, int nQueue, unsigned nShard)
+{
+	stSTATS& stats = ThreadStats();
+	stats.Count(STAT_ACCEPTS);
+	if (m_state != SERVER_RUNNING)
+	{
+		// Accepted just before the listener went away.
+		closesocket(clientSocket);
+		return;
+	}
+	if (m_config.nGlobalHighWater && m_nQueuedBytes > (int64_t)m_config.nGlobalHighWater)
+	{
+		// The connections there are cannot get their replies out; shed new ones.
+		LOG_DEBUG("Over the global high watermark, socket(%d) refused", (int)clientSocket);
+		stats.Count(STAT_ERRORS_LIMIT);
+		closesocket(clientSocket);
+		return;
+	}
+
+	stSOCKETINFO* pSocketInfo = m_socketPool.Allocate(nShard);
+	if (pSocketInfo == NULL)
+	{
+		LOG_ERROR("Connection limit (%u) reached, socket(%d) refused",
+			m_socketPool.GetCapacity(), (int)clientSocket);
+		stats.Count(STAT_ERRORS_LIMIT);
+		closesocket(clientSocket);
+		return;
+	}
+	pSocketInfo->socket = clientSocket;
+	pSocketInfo->nQueue = nQueue;
+	pSocketInfo->nPendingIo = 0;
+	pSocketInfo->nPendingSends = 0;
+	pSocketInfo->bClosing = false;
+	pSocketInfo->pSendHead = NULL;
+	pSocketInfo->pSendTail = NULL;
+	pSocketInfo->frame.pBuffer = NULL;
+	pSocketInfo->bReadable = false;
+	pSocketInfo->bWritable = false;
+	pSocketInfo->bRecvPending = false;
+	pSocketInfo->bServiceQueued = false;
+	int64_t nNow = NowMs();
+	pSocketInfo->nLastRecv = nNow;
+	pSocketInfo->nSendProgress = nNow;
+	pSocketInfo->nFrameStart = 0;
+	pSocketInfo->nQueuedBytes = 0;
+	pSocketInfo->bRecvPaused = false;
+	pSocketInfo->bRecvStopping = false;
+	TimerWheel::InitTimer(&pSocketInfo->timer, pSocketInfo);
+
+	if (!m_queues[nQueue]->Associate(pSocketInfo))
+	{
+		LOG_ERROR("Socket(%d) association failure", (int)clientSocket);
+		stats.Count(STAT_ERRORS_ACCEPT);
+		closesocket(clientSocket);
+		pSocketInfo->bClosing = true;
+		m_socketPool.Free(pSocketInfo, nShard);
+		return;
+	}
+	m_nConnections++;
+	stats.Count(STAT_OPENED);
 
+	if (m_pTimers)
+	{
+		const char* pReason;
+		std::lock_guard<std::mutex> lock(m_pTimers[nQueue].lock);
+		ArmTimer(m_pTimers[nQueue], pSocketInfo, GetDeadline(pSocketInfo, pReason), nNow);
+	}
+	if (m_pTimers && s_nQueue != nQueue)
+	{
+		// The queue's workers may be waiting without a timeout, or past this deadline.
+		m_queues[nQueue]->Wake();
+	}
+
+	// Hand the socket over to the engine; the completion is picked up by a worker.
+	pSocketInfo->nPendingIo++;
+	if (!BeginRecv(pSocketInfo))
+	{
+		CloseSocket(pSocketInfo);
+	}
+	EndIo(pSocketInfo);
 }
 
 bool IOCompletionPort::CreateWorkerThread()
 {
-	unsigned int threadId;
-	// Getting system information
-	SYSTEM_INFO sysInfo;
-	GetSystemInfo(&sysInfo);
-	printf_s("[INFO] CPU amount : %d\n", sysInfo.dwNumberOfProcessors);
-	// The number of appropriate work threads (CPU * 2) + 1
-	int nThreadCnt = sysInfo.dwNumberOfProcessors * 2;
-	
-	m_pWorkerHandle = new HANDLE[nThreadCnt];
+	unsigned int nCpuCount = std::thread::hardware_concurrency();
+	if (nCpuCount == 0) nCpuCount = 1;
+	LOG_INFO("CPU amount : %u", nCpuCount);
+
+	int nThreadCnt = m_config.nWorkerThreads;
+	if (nThreadCnt <= 0)
+	{
+		// A shared completion port wants some threads to spare for blocked ones (CPU * 2),
+		// per-worker queues want one thread per core.
+		nThreadCnt = (m_config.engine == ENGINE_IOCP) ? nCpuCount * 2 : nCpuCount;
+	}
+
+	// Every connection context is allocated here, one free list per worker
+	if (!m_socketPool.Create(m_config.nMaxConnections, nThreadCnt))
+	{
+		LOG_ERROR("Connection pool creation failure");
+		return false;
+	}
+	// A block holds any frame that fits in one receive buffer
+	m_frameBuffers.Create(m_config.nBufferSize + FRAME_HEADER_MAX, nThreadCnt, m_config.nMemoryBudget);
+	// Every worker counts on its own cache lines
+	m_nStatsSlots = nThreadCnt + 1;
+	m_pStats = new stSTATS[m_nStatsSlots];
+
+	// Completion queue creating
+	CompletionQueue* pQueue = CreateCompletionQueue(m_config);
+	if (pQueue == NULL || !pQueue->Create())
+	{
+		LOG_ERROR("Completion queue creation failure");
+		delete pQueue;
+		return false;
+	}
+	m_queues.push_back(pQueue);
+
+	if (!pQueue->IsShared())
+	{
+		for (int i = 1; i < nThreadCnt; i++)
+		{
+			pQueue = CreateCompletionQueue(m_config);
+			if (!pQueue->Create())
+			{
+				LOG_ERROR("Completion queue creation failure");
+				delete pQueue;
+				return false;
+			}
+			m_queues.push_back(pQueue);
+		}
+	}
+
+	// Replies from handler threads reach the owning worker through its queue's mailbox
+	m_pMailboxes = new stMAILBOX[m_queues.size()];
+	if (m_config.nIdleTimeoutMs || m_config.nReadTimeoutMs || m_config.nWriteTimeoutMs)
+	{
+		m_pTimers = new stTIMERS[m_queues.size()];
+		for (DWORD nTimeoutMs : { m_config.nIdleTimeoutMs, m_config.nReadTimeoutMs, m_config.nWriteTimeoutMs })
+		{
+			if (nTimeoutMs && nTimeoutMs < m_nTimerCheckMs)
+			{
+				m_nTimerCheckMs = nTimeoutMs;
+			}
+		}
+	}
+
+	// A blocking handler gets threads of its own so the workers only do I/O
+	m_bBlockingHandler = m_pFrameHandler->IsBlocking();
+	if (m_bBlockingHandler)
+	{
+		int nHandlerCnt = (m_config.nHandlerThreads > 0) ? m_config.nHandlerThreads : (int)nCpuCount;
+		m_pHandlerQueues = new stHANDLERQUEUE[nHandlerCnt];
+		for (int i = 0; i < nHandlerCnt; i++)
+		{
+			m_handlerThreads.emplace_back(&IOCompletionPort::HandlerThread, this, i);
+		}
+		LOG_INFO("%d handler thread(s) start...", nHandlerCnt);
+	}
+
+	// Engines that accept by themselves get one listener per queue, and SO_REUSEPORT
+	// spreads incoming connections across them (a shared IOCP port has a single queue
+	// and keeps its AcceptEx slots on the one listener); the others share the
+	// acceptor thread.
+	m_bQueueAccept = m_queues[0]->StartAccept(m_listenSocket);
+#ifndef _WIN32
+	if (m_bQueueAccept && m_queues.size() > 1)
+	{
+		// The port is shared only from here on, so that a second server started on it
+		// by mistake still fails to bind when there is a single listener.
+		int nReuse = 1;
+		setsockopt(m_listenSocket, SOL_SOCKET, SO_REUSEPORT, &nReuse, sizeof(nReuse));
+	}
+#endif
+	for (size_t i = 1; m_bQueueAccept && i < m_queues.size(); i++)
+	{
+		SOCKET listenSocket = CreateListenSocket(true);
+		if (listenSocket == INVALID_SOCKET)
+		{
+			return false;
+		}
+		m_queueListenSockets.push_back(listenSocket);
+		if (!m_queues[i]->StartAccept(listenSocket))
+		{
+			LOG_ERROR("Completion queue accept failure");
+			return false;
+		}
+	}
+
 	// thread creating
 	for (int i = 0; i < nThreadCnt; i++)
-	{		
-		m_pWorkerHandle[i] = (HANDLE *)_beginthreadex(
-			NULL, 0, &CallWorkerThread, this, CREATE_SUSPENDED, &threadId
-		);
-		if (m_pWorkerHandle[i] == NULL) 
+	{
+		m_workerThreads.emplace_back(&IOCompletionPort::WorkerThread, this, i);
+	}
+	LOG_INFO("Worker Thread start...");
+	return true;
+}
+
+bool IOCompletionPort::BeginRecv(stSOCKETINFO* pSocketInfo)
+{
+	pSocketInfo->nPendingIo++;
+	if (!m_queues[pSocketInfo->nQueue]->PostRecv(pSocketInfo))
+	{
+		pSocketInfo->nPendingIo--;
+		return false;
+	}
+	return true;
+}
+
+bool IOCompletionPort::BeginSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength)
+{
+	pSocketInfo->nPendingIo++;
+	pSocketInfo->nPendingSends++;
+	if (!m_queues[pSocketInfo->nQueue]->PostSend(pSocketInfo, pBuffer, nLength))
+	{
+		pSocketInfo->nPendingSends--;
+		pSocketInfo->nPendingIo--;
+		return false;
+	}
+	if (pSocketInfo->nPendingSends == 1)
+	{
+		// The write deadline runs from the first reply owed.
+		pSocketInfo->nSendProgress = NowMs();
+	}
+	stSTATS& stats = ThreadStats();
+	stats.Count(STAT_SENDS_POSTED);
+	stats.sendDepth.Record((uint64_t)pSocketInfo->nPendingSends.load(std::memory_order_relaxed));
+	return true;
+}
+
+void IOCompletionPort::EndIo(stSOCKETINFO* pSocketInfo)
+{
+	if (--pSocketInfo->nPendingIo == 0)
+	{
+		// Nothing outstanding any more, the context can go.
+		CloseSocket(pSocketInfo);
+		m_frameBuffers.Free(pSocketInfo->frame.pBuffer, s_nWorker);
+		pSocketInfo->frame.pBuffer = NULL;
+		if (m_pTimers)
 		{
-			printf_s("[ERROR] Worker thread creation failure\n");
-			return false;
+			std::lock_guard<std::mutex> lock(m_pTimers[pSocketInfo->nQueue].lock);
+			m_pTimers[pSocketInfo->nQueue].wheel.Cancel(&pSocketInfo->timer);
+		}
+		m_socketPool.Free(pSocketInfo, s_nWorker);
+		ThreadStats().Count(STAT_CLOSED);
+
+		if (--m_nConnections == 0 && m_state != SERVER_RUNNING)
+		{
+			// Shutdown() and the other workers wait for this.
+			{
+				std::lock_guard<std::mutex> lock(m_stateLock);
+			}
+			m_stateChanged.notify_all();
+			WakeWorkers();
+		}
+	}
+}
+
+char* IOCompletionPort::AllocateQueued(stSOCKETINFO* pSocketInfo, unsigned nSize)
+{
+	char* pBuffer = m_frameBuffers.Allocate(nSize, s_nWorker);
+	if (pBuffer)
+	{
+		int64_t nCapacity = FrameBufferPool::GetCapacity(pBuffer);
+		pSocketInfo->nQueuedBytes += nCapacity;
+		m_nQueuedBytes += nCapacity;
+	}
+	return pBuffer;
+}
+
+void IOCompletionPort::FreeQueued(stSOCKETINFO* pSocketInfo, char* pBuffer)
+{
+	int64_t nCapacity = FrameBufferPool::GetCapacity(pBuffer);
+	pSocketInfo->nQueuedBytes -= nCapacity;
+	m_nQueuedBytes -= nCapacity;
+	m_frameBuffers.Free(pBuffer, s_nWorker);
+}
+
+bool IOCompletionPort::IsBacklogged(stSOCKETINFO* pSocketInfo)
+{
+	int64_t nQueued = pSocketInfo->nQueuedBytes;
+	if (m_config.nHighWater && nQueued > (int64_t)m_config.nHighWater)
+	{
+		return true;
+	}
+	// Over the global mark, only connections with nothing queued keep reading.
+	return nQueued > 0 && m_config.nGlobalHighWater && m_nQueuedBytes > (int64_t)m_config.nGlobalHighWater;
+}
+
+bool IOCompletionPort::CanResume(stSOCKETINFO* pSocketInfo)
+{
+	int64_t nQueued = pSocketInfo->nQueuedBytes;
+	if (nQueued == 0)
+	{
+		// Nothing of its own left to complete, so nothing else would resume it.
+		return true;
+	}
+	return (m_config.nHighWater == 0 || nQueued <= (int64_t)m_config.nLowWater) &&
+		(m_config.nGlobalHighWater == 0 || m_nQueuedBytes <= (int64_t)m_config.nGlobalLowWater);
+}
+
+void IOCompletionPort::ContinueRecv(stSOCKETINFO* pSocketInfo, bool bArmed)
+{
+	// A draining server takes no new requests.
+	if (pSocketInfo->bClosing || m_state != SERVER_RUNNING)
+	{
+		return;
+	}
+	if (!IsBacklogged(pSocketInfo))
+	{
+		if (!bArmed && !BeginRecv(pSocketInfo))
+		{
+			LOG_ERROR("Recv failure");
+			CloseSocket(pSocketInfo);
+		}
+		return;
+	}
+	if (bArmed)
+	{
+		// The multishot receive has to end first; its final completion comes back here.
+		// An engine whose stop missed clears the flag, and the next completion asks again.
+		if (!pSocketInfo->bRecvStopping)
+		{
+			pSocketInfo->bRecvStopping = true;
+			m_queues[pSocketInfo->nQueue]->StopRecv(pSocketInfo);
+		}
+		return;
+	}
+
+	// From here on the completion that drains the queue re-arms the receive. It may
+	// have come and gone before the flag went up, so the queue is looked at once more.
+	ThreadStats().Count(STAT_RECV_PAUSED);
+	pSocketInfo->bRecvPaused = true;
+	if (CanResume(pSocketInfo))
+	{
+		ResumeRecv(pSocketInfo);
+	}
+}
+
+void IOCompletionPort::ResumeRecv(stSOCKETINFO* pSocketInfo)
+{
+	// Completions on several workers of a shared queue may get here together.
+	if (!pSocketInfo->bRecvPaused.exchange(false))
+	{
+		return;
+	}
+	if (!pSocketInfo->bClosing && m_state == SERVER_RUNNING && !BeginRecv(pSocketInfo))
+	{
+		LOG_ERROR("Recv failure");
+		CloseSocket(pSocketInfo);
+	}
+}
+
+void EchoFrameHandler::OnFrame(IOCompletionPort& server, stSOCKETINFO* pSocketInfo,
+	const char* pPayload, unsigned nLength)
+{
+	server.SendFrame(pSocketInfo, pPayload, nLength);
+}
+
+void IOCompletionPort::SetFrameHandler(FrameHandler* pHandler)
+{
+	m_pFrameHandler = pHandler ? pHandler : &m_echoHandler;
+}
+
+bool IOCompletionPort::SendFrame(stSOCKETINFO* pSocketInfo, const char* pPayload, unsigned nLength)
+{
+	if (pSocketInfo->bClosing)
+	{
+		return false;
+	}
+
+	// The frame owns its buffer until the send completes.
+	char* pBuffer = AllocateQueued(pSocketInfo, FRAME_HEADER_MAX + nLength);
+	if (pBuffer == NULL)
+	{
+		// A reply missing from the stream would pair the next ones with the wrong requests.
+		if (s_nQueue == pSocketInfo->nQueue)
+		{
+			ThreadStats().Count(STAT_ERRORS_MEMORY);
+			CloseSocket(pSocketInfo);
+		}
+		return false;
+	}
+	FrameBufferPool::SetTag(pBuffer, s_nRecvTime);
+	int nHeader = EncodeFrameHeader(pBuffer, nLength);
+	memcpy(pBuffer + nHeader, pPayload, nLength);
+
+	// Only the connection's own worker posts to its queue (any worker of a shared one).
+	if (s_nQueue != pSocketInfo->nQueue)
+	{
+		PostReply(pSocketInfo, pBuffer, nHeader + (int)nLength);
+		return true;
+	}
+
+	if (!BeginSend(pSocketInfo, pBuffer, nHeader + (int)nLength))
+	{
+		LOG_ERROR("Send failure");
+		FreeQueued(pSocketInfo, pBuffer);
+		CloseSocket(pSocketInfo);
+		return false;
+	}
+	return true;
+}
+
+void IOCompletionPort::HoldConnection(stSOCKETINFO* pSocketInfo)
+{
+	// Counted like a reply in flight: EOF and a drain leave the connection open for it,
+	// and the write deadline runs.
+	pSocketInfo->nPendingIo++;
+	if (++pSocketInfo->nPendingSends == 1)
+	{
+		pSocketInfo->nSendProgress = NowMs();
+	}
+}
+
+void IOCompletionPort::ReleaseConnection(stSOCKETINFO* pSocketInfo)
+{
+	// Goes through the mailbox even on the owning worker, so it stays behind the replies
+	// other threads have queued.
+	PostReply(pSocketInfo, NULL, 0);
+}
+
+void IOCompletionPort::PostReply(stSOCKETINFO* pSocketInfo, char* pFrame, int nLength)
+{
+	stMAILBOX& mailbox = m_pMailboxes[pSocketInfo->nQueue];
+	bool bWake;
+	{
+		std::lock_guard<std::mutex> lock(mailbox.lock);
+		// A worker is already on its way for a non-empty mailbox.
+		bWake = mailbox.replies.empty();
+		stREPLY reply = { pSocketInfo, pFrame, nLength };
+		mailbox.replies.push_back(reply);
+	}
+	if (bWake)
+	{
+		m_queues[pSocketInfo->nQueue]->Wake();
+	}
+}
+
+void IOCompletionPort::DeliverReplies(int nQueue, std::vector<stREPLY>& replies)
+{
+	stMAILBOX& mailbox = m_pMailboxes[nQueue];
+	{
+		std::lock_guard<std::mutex> lock(mailbox.lock);
+		if (mailbox.replies.empty())
+		{
+			return;
+		}
+		replies.swap(mailbox.replies);
+	}
+
+	for (stREPLY& reply : replies)
+	{
+		stSOCKETINFO* pSocketInfo = reply.pSocketInfo;
+		if (reply.pFrame)
+		{
+			if (pSocketInfo->bClosing)
+			{
+				FreeQueued(pSocketInfo, reply.pFrame);
+			}
+			else if (!BeginSend(pSocketInfo, reply.pFrame, reply.nLength))
+			{
+				LOG_ERROR("Send failure");
+				FreeQueued(pSocketInfo, reply.pFrame);
+				CloseSocket(pSocketInfo);
+			}
+			continue;
+		}
+
+		// End of a hold, handled like the completion of a reply.
+		if (--pSocketInfo->nPendingSends == 0 && m_state != SERVER_RUNNING)
+		{
+			CloseSocket(pSocketInfo);
+		}
+		else if (pSocketInfo->bRecvPaused && CanResume(pSocketInfo))
+		{
+			ResumeRecv(pSocketInfo);
+		}
+		EndIo(pSocketInfo);
+	}
+	replies.clear();
+}
+
+void IOCompletionPort::DispatchFrame(stSOCKETINFO* pSocketInfo, const char* pPayload, unsigned nLength)
+{
+	ThreadStats().Count(STAT_MESSAGES_IN);
+	if (!m_bBlockingHandler)
+	{
+		m_pFrameHandler->OnFrame(*this, pSocketInfo, pPayload, nLength);
+		return;
+	}
+
+	// The receive buffer goes back to the engine before a handler thread gets to the frame.
+	char* pCopy = AllocateQueued(pSocketInfo, nLength);
+	if (pCopy == NULL)
+	{
+		ThreadStats().Count(STAT_ERRORS_MEMORY);
+		CloseSocket(pSocketInfo);
+		return;
+	}
+	memcpy(pCopy, pPayload, nLength);
+	HoldConnection(pSocketInfo);
+
+	// Pinning the connection to one thread keeps its frames, and so its replies, in order.
+	size_t nThread = (size_t)(pSocketInfo - m_socketPool.GetSlot(0)) % m_handlerThreads.size();
+	stHANDLERQUEUE& queue = m_pHandlerQueues[nThread];
+	stHANDLERTASK task = { pSocketInfo, pCopy, nLength, s_nRecvTime };
+	bool bWake;
+	{
+		std::lock_guard<std::mutex> lock(queue.lock);
+		bWake = queue.tasks.empty();
+		queue.tasks.push_back(task);
+	}
+	if (bWake)
+	{
+		queue.ready.notify_one();
+	}
+}
+
+void IOCompletionPort::HandlerThread(int nThread)
+{
+	stHANDLERQUEUE& queue = m_pHandlerQueues[nThread];
+	s_nWorker = nThread;
+
+	for (;;)
+	{
+		stHANDLERTASK task;
+		{
+			std::unique_lock<std::mutex> lock(queue.lock);
+			queue.ready.wait(lock, [&] { return !queue.tasks.empty() || m_bHandlersStop; });
+			if (queue.tasks.empty())
+			{
+				break;
+			}
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+		}
+
+		s_nRecvTime = task.nRecvTime;
+		m_pFrameHandler->OnFrame(*this, task.pSocketInfo, task.pPayload, task.nLength);
+		s_nRecvTime = 0;
+		FreeQueued(task.pSocketInfo, task.pPayload);
+		ReleaseConnection(task.pSocketInfo);
+	}
+}
+
+bool IOCompletionPort::ReceiveFrames(stSOCKETINFO* pSocketInfo, const char* pData, unsigned nLength)
+{
+	stFRAMEREASSEMBLY& frame = pSocketInfo->frame;
+	unsigned nPayload = 0;
+	int nHeader = 0;
+
+	while (nLength > 0 && !pSocketInfo->bClosing)
+	{
+		if (frame.pBuffer == NULL)
+		{
+			nHeader = DecodeFrameHeader(pData, nLength, nPayload);
+			if (nHeader < 0 || (nHeader > 0 && nPayload > m_config.nMaxFrameSize))
+			{
+				break;
+			}
+			if (nHeader > 0 && nPayload <= nLength - nHeader)
+			{
+				// The whole frame is in this receive: the handler reads it in place.
+				DispatchFrame(pSocketInfo, pData + nHeader, nPayload);
+				pData += nHeader + nPayload;
+				nLength -= nHeader + nPayload;
+				continue;
+			}
+
+			// The frame goes on in the next receive; collect it aside until then.
+			frame.nFrameSize = (nHeader > 0) ? nHeader + nPayload : 0;
+			frame.nLength = 0;
+			frame.pBuffer = m_frameBuffers.Allocate((std::max)(frame.nFrameSize, (unsigned)FRAME_HEADER_MAX), s_nWorker);
+			if (frame.pBuffer == NULL)
+			{
+				ThreadStats().Count(STAT_ERRORS_MEMORY);
+				return false;
+			}
+			pSocketInfo->nFrameStart = NowMs();
+		}
+
+		if (frame.nFrameSize == 0)
+		{
+			// Header split across receives: take it byte by byte so nothing of the
+			// payload lands in a buffer sized before the length was known.
+			frame.pBuffer[frame.nLength++] = *pData++;
+			nLength--;
+			nHeader = DecodeFrameHeader(frame.pBuffer, frame.nLength, nPayload);
+			if (nHeader < 0 || (nHeader > 0 && nPayload > m_config.nMaxFrameSize))
+			{
+				break;
+			}
+			if (nHeader == 0)
+			{
+				continue;
+			}
+			frame.nFrameSize = nHeader + nPayload;
+			if (frame.nFrameSize > m_frameBuffers.GetBlockSize())
+			{
+				char* pBuffer = m_frameBuffers.Allocate(frame.nFrameSize, s_nWorker);
+				if (pBuffer == NULL)
+				{
+					ThreadStats().Count(STAT_ERRORS_MEMORY);
+					return false;
+				}
+				memcpy(pBuffer, frame.pBuffer, frame.nLength);
+				m_frameBuffers.Free(frame.pBuffer, s_nWorker);
+				frame.pBuffer = pBuffer;
+			}
 		}
-		ResumeThread(m_pWorkerHandle[i]);
+
+		unsigned nCopy = (std::min)(nLength, frame.nFrameSize - frame.nLength);
+		memcpy(frame.pBuffer + frame.nLength, pData, nCopy);
+		frame.nLength += nCopy;
+		pData += nCopy;
+		nLength -= nCopy;
+
+		if (frame.nLength == frame.nFrameSize)
+		{
+			nHeader = DecodeFrameHeader(frame.pBuffer, frame.nLength, nPayload);
+			DispatchFrame(pSocketInfo, frame.pBuffer + nHeader, nPayload);
+			m_frameBuffers.Free(frame.pBuffer, s_nWorker);
+			frame.pBuffer = NULL;
+			pSocketInfo->nFrameStart = 0;
+		}
+	}
+
+	if (nHeader < 0)
+	{
+		LOG_ERROR("socket(%d) sent a malformed frame header", (int)pSocketInfo->socket);
+		ThreadStats().Count(STAT_ERRORS_FRAME);
+		return false;
+	}
+	if (nHeader > 0 && nPayload > m_config.nMaxFrameSize)
+	{
+		LOG_ERROR("socket(%d) sent a frame of %u bytes, limit is %u",
+			(int)pSocketInfo->socket, nPayload, m_config.nMaxFrameSize);
+		ThreadStats().Count(STAT_ERRORS_FRAME);
+		return false;
 	}
-	printf_s("[INFO] Worker Thread start...\n");
 	return true;
 }
 
-void IOCompletionPort::WorkerThread()
-{		
-	// Is the function call successful?
-	BOOL	bResult;
-	int		nResult;
-	// Overlapped The size of the data sent by the operation
-	DWORD	recvBytes;
-	DWORD	sendBytes;
-	// Completion Key
-	stSOCKETINFO *	pCompletionKey;
-	//  Pointer to receive overlapped structure requested for I/O operation	
-	stSOCKETINFO *	pSocketInfo;
-	// 
-	DWORD	dwFlags = 0;
+void IOCompletionPort::CloseSocket(stSOCKETINFO* pSocketInfo)
+{
+	// Receive and send completions of one socket may race here on a shared queue.
+	if (pSocketInfo->bClosing.exchange(true))
+	{
+		return;
+	}
+	// shutdown() wakes operations that are still parked on the socket; the engine
+	// completes the ones that only exist in user space.
+	shutdown(pSocketInfo->socket, SD_BOTH);
+	m_queues[pSocketInfo->nQueue]->CancelIo(pSocketInfo);
+	closesocket(pSocketInfo->socket);
+}
+
+void IOCompletionPort::WorkerThread(int nWorker)
+{
+	int nQueue = nWorker % (int)m_queues.size();
+	CompletionQueue* pQueue = m_queues[nQueue];
+	s_nWorker = nWorker;
+	s_nQueue = nQueue;
+	std::vector<stREPLY> replies;
+	int nBatch = m_config.nCompletionBatch > 0 ? (int)m_config.nCompletionBatch : 1;
+	std::vector<stCOMPLETION> completions(nBatch);
+	SERVER_STATE drainedState = SERVER_RUNNING;
+	stSTATS& stats = ThreadStats();
+	DWORD timeoutMs = INFINITE;
 
-	while (m_bWorkerThread)
+	for (;;)
 	{
 		/**
-		 * This function causes threads to be put on hold in the WaitingThread Queue, 
-		 which will take the completed work from the IOCP Queue and process it after 
-		 the overlapped I/O operation occurs.		 	 
+		 * Wait for the engine to hand over finished operations, as many as are ready up to
+		 * the batch size. On IOCP this parks the thread in the port's waiting queue and
+		 * dequeues with GetQueuedCompletionStatusEx; on io_uring it flushes the SQEs queued
+		 * while the previous batch was processed and peeks the CQEs in bulk; on epoll it
+		 * performs the I/O of the sockets that became ready.
 		 */
-		bResult = GetQueuedCompletionStatus(m_hIOCP,
-			&recvBytes,				// Bytes actually sent
-			(PULONG_PTR)&pCompletionKey,	// completion key
-			(LPOVERLAPPED *)&pSocketInfo,			// overlapped I/O 
-			INFINITE				
-		);
-
-		if (!bResult && recvBytes == 0)
-		{
-			printf_s("[INFO] socket(%d) connection disrupted n", pSocketInfo->socket);
-			closesocket(pSocketInfo->socket);
-			free(pSocketInfo);
-			continue;
+		int nCompletions = pQueue->GetCompletions(completions.data(), nBatch, timeoutMs);
+		stats.batch.Record((uint64_t)nCompletions);
+		s_nNowMs = TimerWheel::Now();
+
+		for (int i = 0; i < nCompletions; i++)
+		{
+			HandleCompletion(completions[i], nQueue, nWorker);
+		}
+		DeliverReplies(nQueue, replies);
+		if (m_pTimers)
+		{
+			timeoutMs = ExpireTimers(nQueue);
+		}
+
+		// Shutting down: sweep the connections once per state, then keep handling their
+		// completions until every context is back in the pool.
+		SERVER_STATE state = m_state;
+		if (state != SERVER_RUNNING)
+		{
+			if (state != drainedState)
+			{
+				drainedState = state;
+				DrainConnections(nQueue, state == SERVER_STOPPING);
+			}
+			if (m_nConnections == 0)
+			{
+				break;
+			}
 		}
+	}
+}
 
-		pSocketInfo->dataBuf.len = recvBytes;
+void IOCompletionPort::HandleCompletion(stCOMPLETION& completion, int nQueue, int nWorker)
+{
+	CompletionQueue* pQueue = m_queues[nQueue];
 
-		if (recvBytes == 0)
+	if (completion.operation == IO_ACCEPT)
+	{
+		if (completion.nResult < 0)
 		{
-			closesocket(pSocketInfo->socket);
-			free(pSocketInfo);
-			continue;
+			LOG_ERROR("Accept failure : %d", completion.nResult);
+			ThreadStats().CountError(STAT_ERRORS_ACCEPT, completion.nResult);
+		}
+		else
+		{
+			AcceptSocket((SOCKET)completion.nResult, nQueue, nWorker);
+		}
+		return;
+	}
+
+	stSOCKETINFO* pSocketInfo = completion.pSocketInfo;
+
+	if (completion.nGeneration != pSocketInfo->nGeneration)
+	{
+		// The slot has been recycled since the operation was posted; the connection
+		// it belonged to is gone and holds no reference any more.
+		LOG_ERROR("Stale completion for socket(%d)", (int)pSocketInfo->socket);
+		pQueue->ReleaseBuffer(completion.nBufferId);
+		if (completion.operation == IO_SEND)
+		{
+			ThreadStats().Count(STAT_SENDS_DONE);
+			m_nQueuedBytes -= FrameBufferPool::GetCapacity(completion.pBuffer);
+			m_frameBuffers.Free(completion.pBuffer, nWorker);
+		}
+		return;
+	}
+
+	if (completion.operation == IO_RECV)
+	{
+		if (completion.nResult < 0 && pSocketInfo->bRecvStopping && !pSocketInfo->bClosing)
+		{
+			// Stopped for flow control, not a failure.
+			pSocketInfo->bRecvStopping = false;
+			ContinueRecv(pSocketInfo, false);
+		}
+		else if (completion.nResult < 0)
+		{
+			if (!pSocketInfo->bClosing)
+			{
+				LOG_DEBUG("socket(%d) connection disrupted", (int)pSocketInfo->socket);
+				ThreadStats().CountError(STAT_ERRORS_RECV, completion.nResult);
+			}
+			CloseSocket(pSocketInfo);
+		}
+		else if (completion.nResult == 0)
+		{
+			// The peer is done sending but still gets the replies in flight; the last one
+			// to complete closes the socket through EndIo.
+			if (pSocketInfo->nPendingSends == 0)
+			{
+				CloseSocket(pSocketInfo);
+			}
+		}
+		else if (!pSocketInfo->bClosing)
+		{
+			// Replies are copied into frames of their own, so the receive buffer goes
+			// back to the engine as soon as its frames have been handled.
+			ThreadStats().Count(STAT_BYTES_IN, (uint64_t)completion.nResult);
+			pSocketInfo->nLastRecv = s_nNowMs;
+			s_nRecvTime = StatsNow();
+			bool bFramed = ReceiveFrames(pSocketInfo, completion.pBuffer, (unsigned)completion.nResult);
+			s_nRecvTime = 0;
+			pQueue->ReleaseBuffer(completion.nBufferId);
+			if (!bFramed)
+			{
+				CloseSocket(pSocketInfo);
+			}
+			else
+			{
+				// Keep reading while the replies are in flight so pipelined requests are not
+				// held back (they were posted first, so they keep the order of the requests),
+				// up to the high watermarks.
+				if (!completion.bMore)
+				{
+					pSocketInfo->bRecvStopping = false;
+				}
+				ContinueRecv(pSocketInfo, completion.bMore);
+			}
 		}
 		else
 		{
-			printf_s("[INFO] Message received  Bytes : [%d], Msg : [%s]\n",
-				pSocketInfo->dataBuf.len, pSocketInfo->dataBuf.buf);
-
-			// Send the client's response as it is				
-			nResult = WSASend(
-				pSocketInfo->socket,
-				&(pSocketInfo->dataBuf),
-				1,
-				&sendBytes,
-				dwFlags,
-				NULL,
-				NULL
-			);
-
-			if (nResult == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+			pQueue->ReleaseBuffer(completion.nBufferId);
+		}
+	}
+	else
+	{
+		stSTATS& stats = ThreadStats();
+		stats.Count(STAT_SENDS_DONE);
+		if (completion.nResult >= 0)
+		{
+			pSocketInfo->nSendProgress = s_nNowMs;
+			stats.Count(STAT_BYTES_OUT, (uint64_t)completion.nResult);
+			stats.Count(STAT_MESSAGES_OUT);
+			// Replies to requests carry the receive completion time; others carry 0.
+			int64_t nRecvTime = FrameBufferPool::GetTag(completion.pBuffer);
+			if (nRecvTime != 0)
 			{
-				printf_s("[ERROR] WSASend failure: ", WSAGetLastError());
+				stats.latency.Record((uint64_t)(StatsNow() - nRecvTime));
 			}
-
-			printf_s("[INFO] Send message - Bytes : [%d], Msg : [%s]\n",
-				pSocketInfo->dataBuf.len, pSocketInfo->dataBuf.buf);
-
-			// stSOCKETINFO data wipe
-			ZeroMemory(&(pSocketInfo->overlapped), sizeof(OVERLAPPED));
-			pSocketInfo->dataBuf.len = MAX_BUFFER;
-			pSocketInfo->dataBuf.buf = pSocketInfo->messageBuffer;
- 			ZeroMemory(pSocketInfo->messageBuffer, MAX_BUFFER);			
- 			pSocketInfo->recvBytes = 0;
- 			pSocketInfo->sendBytes = 0;
- 			
-			dwFlags = 0;			
-
-			// Call WSARecv to get a response back from the client
-			nResult = WSARecv(
-				pSocketInfo->socket,
-				&(pSocketInfo->dataBuf),
-				1,
-				&recvBytes,
-				&dwFlags,
-				(LPWSAOVERLAPPED)&(pSocketInfo->overlapped),
-				NULL
-			);
-
-			if (nResult == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+		}
+		FreeQueued(pSocketInfo, completion.pBuffer);
+		int nPendingSends = --pSocketInfo->nPendingSends;
+		if (completion.nResult < 0)
+		{
+			if (!pSocketInfo->bClosing)
 			{
-				printf_s("[ERROR] WSARecv failure : ", WSAGetLastError());
+				LOG_ERROR("Send failure : %d", completion.nResult);
+				stats.CountError(STAT_ERRORS_SEND, completion.nResult);
 			}
+			CloseSocket(pSocketInfo);
+		}
+		else if (nPendingSends == 0 && m_state != SERVER_RUNNING)
+		{
+			// Last reply is out; a draining server lets the connection go.
+			CloseSocket(pSocketInfo);
+		}
+		else if (pSocketInfo->bRecvPaused && CanResume(pSocketInfo))
+		{
+			ResumeRecv(pSocketInfo);
+		}
+	}
+
+	// A multishot receive keeps its reference until its final completion.
+	if (completion.operation != IO_RECV || !completion.bMore)
+	{
+		EndIo(pSocketInfo);
+	}
+}
+
+int64_t IOCompletionPort::GetDeadline(stSOCKETINFO* pSocketInfo, const char*& pReason)
+{
+	int64_t nDeadline = INT64_MAX;
+	pReason = NULL;
+	if (pSocketInfo->nPendingSends > 0)
+	{
+		// Owing a reply is not idling; the peer has to keep taking the replies.
+		if (m_config.nWriteTimeoutMs)
+		{
+			nDeadline = pSocketInfo->nSendProgress + m_config.nWriteTimeoutMs;
+			pReason = "write";
+		}
+	}
+	else if (m_config.nIdleTimeoutMs)
+	{
+		nDeadline = (std::max)(pSocketInfo->nLastRecv.load(), pSocketInfo->nSendProgress.load()) + m_config.nIdleTimeoutMs;
+		pReason = "idle";
+	}
+	int64_t nFrameStart = pSocketInfo->nFrameStart;
+	if (nFrameStart && m_config.nReadTimeoutMs && nFrameStart + m_config.nReadTimeoutMs < nDeadline)
+	{
+		// A frame trickling in, a byte at a time, does not count as activity.
+		nDeadline = nFrameStart + m_config.nReadTimeoutMs;
+		pReason = "read";
+	}
+	return nDeadline;
+}
+
+void IOCompletionPort::ArmTimer(stTIMERS& timers, stSOCKETINFO* pSocketInfo, int64_t nDeadline, int64_t nNowMs)
+{
+	// A deadline can start after the timer was armed (a send stalls, a frame begins)
+	// without anyone touching the wheel, so the timer never sleeps longer than the
+	// shortest timeout: such a deadline is seen at most that much late.
+	timers.wheel.Schedule(&pSocketInfo->timer, (std::min)(nDeadline, nNowMs + (int64_t)m_nTimerCheckMs));
+}
+
+DWORD IOCompletionPort::ExpireTimers(int nQueue)
+{
+	stTIMERS& timers = m_pTimers[nQueue];
+	// Held throughout, so EndIo() on another worker cannot release an expired socket
+	// while it is being looked at.
+	std::lock_guard<std::mutex> lock(timers.lock);
+	timers.expired.clear();
+	timers.wheel.Advance(s_nNowMs, timers.expired);
+
+	for (stTIMER* pTimer : timers.expired)
+	{
+		stSOCKETINFO* pSocketInfo = (stSOCKETINFO*)pTimer->pContext;
+		if (pSocketInfo->bClosing)
+		{
+			// EndIo() is on its way; nothing left to time.
+			continue;
+		}
+		const char* pReason;
+		int64_t nDeadline = GetDeadline(pSocketInfo, pReason);
+		if (nDeadline > s_nNowMs)
+		{
+			// There was progress since the timer was armed, or it was only a check.
+			ArmTimer(timers, pSocketInfo, nDeadline, s_nNowMs);
+			continue;
 		}
+		LOG_DEBUG("socket(%d) %s timeout", (int)pSocketInfo->socket, pReason);
+		ThreadStats().Count(STAT_ERRORS_TIMEOUT);
+		CloseSocket(pSocketInfo);
+	}
+	return timers.wheel.GetTimeout(s_nNowMs);
+}
+
+stSTATS& IOCompletionPort::ThreadStats()
+{
+	// Workers have a slot each; the acceptor thread has the last one to itself.
+	return m_pStats[(s_nQueue >= 0) ? s_nWorker : m_nStatsSlots - 1];
+}
+
+void IOCompletionPort::GetStats(stSTATS& stats)
+{
+	stats.Reset();
+	for (unsigned i = 0; i < m_nStatsSlots; i++)
+	{
+		stats.Add(m_pStats[i]);
+	}
+}
+
+void IOCompletionPort::StatsThread()
+{
+	stSTATS* pTotal = new stSTATS();
+	DWORD nIntervalMs = (std::max)(m_config.nStatsIntervalMs, (DWORD)10);
+
+	std::unique_lock<std::mutex> lock(m_stateLock);
+	while (!m_stateChanged.wait_for(lock, std::chrono::milliseconds(nIntervalMs),
+		[this] { return m_state == SERVER_STOPPED; }))
+	{
+		lock.unlock();
+		DumpStats(*pTotal);
+		lock.lock();
+	}
+	lock.unlock();
+
+	// The workers are gone, so these are the final numbers.
+	DumpStats(*pTotal);
+	delete pTotal;
+}
+
+void IOCompletionPort::DumpStats(stSTATS& total)
+{
+	char line[64];
+	std::string text;
+	snprintf(line, sizeof(line), "uptime_ms %lld\n", (long long)((StatsNow() - m_nStartTime) / 1000000));
+	text += line;
+	snprintf(line, sizeof(line), "queued_bytes %lld\nframe_memory %llu\n", (long long)m_nQueuedBytes.load(),
+		(unsigned long long)m_frameBuffers.GetBytesInUse());
+	text += line;
+
+	GetStats(total);
+	FormatStats(text, total);
+	for (unsigned i = 0; i + 1 < m_nStatsSlots; i++)
+	{
+		snprintf(line, sizeof(line), "worker %u", i);
+		FormatStats(text, m_pStats[i], line);
+	}
+	FormatStats(text, m_pStats[m_nStatsSlots - 1], "acceptor");
+
+	if (!WriteStatsFile(m_config.pStatsFile, text))
+	{
+		LOG_ERROR("Stats file %s could not be written", m_config.pStatsFile);
 	}
 }
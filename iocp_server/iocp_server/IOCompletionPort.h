@@ -1,20 +1,101 @@
 #pragma once
-#pragma comment(lib, "ws2_32.lib")
-#include <WinSock2.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CompletionQueue.h"
+#include "FrameBufferPool.h"
+#include "Framing.h"
+#include "SocketInfoPool.h"
+#include "Stats.h"
+#include "TimerWheel.h"
 
 #define	MAX_BUFFER		1024
 #define SERVER_PORT		8000
 
-struct stSOCKETINFO
+#ifdef _WIN32
+#define DEFAULT_ENGINE	ENGINE_IOCP
+#else
+#define DEFAULT_ENGINE	ENGINE_URING
+#endif
+
+// Slots come from SocketInfoPool; a cache line of their own keeps workers from false sharing
+struct alignas(64) stSOCKETINFO
 {
-	WSAOVERLAPPED	overlapped;
-	WSABUF			dataBuf;
+#ifdef _WIN32
+	stIOCONTEXT		recvContext;		// Overlapped of the receive; sends bring their own
+#endif
 	SOCKET			socket;
-	char			messageBuffer[MAX_BUFFER];
-	int				recvBytes;
-	int				sendBytes;
+	int				nQueue;				// Index of the completion queue that owns the socket
+	std::atomic<int> nPendingIo;		// Posted operations whose final completion has not arrived
+	std::atomic<int> nPendingSends;		// Sends among them
+	std::atomic<bool> bClosing;			// Socket closed, waiting for outstanding I/O to drain (set on free slots)
+	stSENDREQUEST*	pSendHead;			// Send in flight (engines with asynchronous sends)
+	stSENDREQUEST*	pSendTail;			// Last queued send
+	stFRAMEREASSEMBLY frame;			// Incoming frame split across receives
+	// Deadlines are checked when the timer fires rather than moved on every completion
+	stTIMER			timer;				// Next deadline check, on the wheel of the socket's queue
+	std::atomic<int64_t> nLastRecv;		// Last receive completion, or the accept (TimerWheel::Now())
+	std::atomic<int64_t> nSendProgress;	// Last send completion, or when a reply came to be owed
+	std::atomic<int64_t> nFrameStart;	// First bytes of the frame being reassembled, 0 without one
+	// The receive waits while the connection has too much queued (flow control)
+	std::atomic<int64_t> nQueuedBytes;	// Frame memory of its replies not yet sent and its frames waiting for a handler
+	std::atomic<bool> bRecvPaused;		// No receive armed; whoever clears this re-arms it
+	bool			bRecvStopping;		// StopRecv() issued, the receive's final completion is still to come
+	// Readiness engines (epoll) perform the I/O themselves and track the socket state here
+	bool			bReadable;			// Readable edge seen and recv has not hit EAGAIN since
+	bool			bWritable;			// Writable edge seen and send has not hit EAGAIN since
+	bool			bRecvPending;		// PostRecv waiting for data
+	bool			bServiceQueued;		// Queued for the engine to perform pending I/O
+	unsigned short	nGeneration;		// Bumped each time the pool slot is recycled
+	stSOCKETINFO*	pNextFree;			// Pool free list link
 };
 
+struct stSERVERCONFIG
+{
+	ENGINE_TYPE		engine = DEFAULT_ENGINE;
+	unsigned short	nPort = SERVER_PORT;
+	int				nWorkerThreads = 0;		// 0 picks a default for the engine
+	unsigned		nQueueDepth = 4096;		// io_uring submission queue entries
+	unsigned		nRecvBuffers = 4096;	// Receive buffers per completion queue
+	unsigned		nBufferSize = MAX_BUFFER;	// Bytes per receive buffer
+	unsigned		nZeroCopyThreshold = 0;	// Sends of at least this size skip the kernel copy (0 = off;
+											// io_uring SEND_ZC, IOCP SO_SNDBUF=0, ignored by epoll)
+	unsigned		nMaxConnections = 16384;	// Connection contexts allocated up front
+	unsigned		nCompletionBatch = 64;		// Completions a worker harvests per wakeup
+	int				nListenBacklog = SOMAXCONN;	// Pending connections the kernel queues per listener
+	DWORD			nDrainTimeoutMs = 5000;		// Shutdown waits this long for in-flight replies
+	unsigned		nAcceptsInFlight = 32;		// Accepts kept posted per queue (IOCP AcceptEx,
+												// io_uring without multishot accept)
+	unsigned		nMaxFrameSize = 1 << 20;	// Payload limit of an incoming frame; larger ones close the connection
+	int				nHandlerThreads = 0;		// Threads running a blocking FrameHandler (0 = one per CPU)
+	const char*		pStatsFile = NULL;			// Stats are written here every nStatsIntervalMs (NULL = off)
+	DWORD			nStatsIntervalMs = 1000;
+	DWORD			nIdleTimeoutMs = 60000;		// Close a connection that neither sent anything nor was owed a
+												// reply for this long (0 = never)
+	DWORD			nReadTimeoutMs = 10000;		// Time a frame may take to arrive once it has started (0 = no limit)
+	DWORD			nWriteTimeoutMs = 10000;	// Time an owed reply may go without any send completing (0 = no limit)
+	unsigned		nHighWater = 256 << 10;		// Stop receiving on a connection with more queued than this (0 = never)
+	unsigned		nLowWater = 64 << 10;		// Receive again once a paused connection is down to this
+	uint64_t		nGlobalHighWater = 128ull << 20;	// Past this much queued in all, connections with anything
+												// queued stop receiving and new ones are refused (0 = never)
+	uint64_t		nGlobalLowWater = 64ull << 20;	// Resume (and accept) once the total is down to this
+	uint64_t		nMemoryBudget = 512ull << 20;	// Cap on frame buffer memory; a connection whose frame
+												// does not fit is closed (0 = unlimited)
+};
+
+
+// Life cycle of the server
+enum SERVER_STATE
+{
+	SERVER_RUNNING,
+	SERVER_DRAINING,	// No new connections; open ones close once their replies are sent
+	SERVER_STOPPING,	// Drain deadline passed; every connection is closed now
+	SERVER_STOPPED,		// Workers joined and contexts released
+};
 
 class IOCompletionPort
 {
@@ -23,19 +104,162 @@ public:
 	~IOCompletionPort();
 
 	// Socket registration and server information settings
-	bool Initialize();
-	// Start the server
+	bool Initialize(const stSERVERCONFIG& config = stSERVERCONFIG());
+	// Start the server; returns once it has been shut down
 	void StartServer();
+	// Stop accepting, let in-flight replies go out for up to nDrainTimeoutMs, then close
+	// what is left, join the workers and release the connection contexts. Can be called
+	// from any thread but a worker; returns once the server has stopped.
+	void Shutdown();
+	// Application logic the frames go to, echo by default; set before StartServer(). The
+	// handler has to outlive the server.
+	void SetFrameHandler(FrameHandler* pHandler);
+	// Send a frame with the given payload, which is copied. Called from FrameHandler::OnFrame,
+	// or from any thread while the connection is held; the frame is then handed to the
+	// worker that owns the connection. False if the connection is closing or the frame
+	// could not be sent.
+	bool SendFrame(stSOCKETINFO* pSocketInfo, const char* pPayload, unsigned nLength);
+	// Keep the connection open (and a draining server waiting) for replies sent after
+	// OnFrame returns; called from OnFrame
+	void HoldConnection(stSOCKETINFO* pSocketInfo);
+	// End a hold once its last reply is sent; callable from any thread
+	void ReleaseConnection(stSOCKETINFO* pSocketInfo);
+	// Sum of every thread's counters and histograms; callable from any thread at any time
+	void GetStats(stSTATS& stats);
 	// Create a working thread
 	bool CreateWorkerThread();
 	// Working thread
-	void WorkerThread();
+	void WorkerThread(int nWorker);
+	// Thread running a blocking frame handler
+	void HandlerThread(int nThread);
+	// Thread writing the stats file until the server stops
+	void StatsThread();
 
 private:
-	stSOCKETINFO* m_pSocketInfo;		// About sockets
+	// Frame (or, without one, the end of a hold) handed to the worker owning the connection
+	struct stREPLY
+	{
+		stSOCKETINFO*	pSocketInfo;
+		char*			pFrame;			// Encoded frame from m_frameBuffers, NULL to release the hold
+		int				nLength;
+	};
+
+	// Replies for the connections of one completion queue, sent from other threads
+	struct alignas(64) stMAILBOX
+	{
+		std::mutex		lock;
+		std::vector<stREPLY> replies;
+	};
+
+	// Frame waiting for a handler thread
+	struct stHANDLERTASK
+	{
+		stSOCKETINFO*	pSocketInfo;	// Held until the handler returns
+		char*			pPayload;		// Copy from m_frameBuffers
+		unsigned		nLength;
+		int64_t			nRecvTime;		// Receive completion that brought the frame
+	};
+
+	// Deadlines of the connections of one completion queue; locked, since a shared queue
+	// has several workers and the acceptor thread arms timers too
+	struct alignas(64) stTIMERS
+	{
+		std::mutex		lock;
+		TimerWheel		wheel;
+		std::vector<stTIMER*> expired;	// Scratch space for Advance()
+	};
+
+	// Frames for one handler thread
+	struct alignas(64) stHANDLERQUEUE
+	{
+		std::mutex		lock;
+		std::condition_variable ready;
+		std::deque<stHANDLERTASK> tasks;
+	};
+
+	// Create, bind and listen on a socket for the configured port; bReusePort shares the
+	// port with the other listeners of queues that accept by themselves
+	SOCKET CreateListenSocket(bool bReusePort);
+	// Set up a freshly accepted socket on a completion queue and arm its first receive;
+	// the context comes from the pool's nShard free list
+	void AcceptSocket(SOCKET clientSocket, int nQueue, unsigned nShard);
+	// Arm a receive, taking an I/O reference on the socket
+	bool BeginRecv(stSOCKETINFO* pSocketInfo);
+	// Send a buffer, taking an I/O reference on the socket
+	bool BeginSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength);
+	// Frame buffer charged to the connection's queue, NULL when out of memory or budget
+	char* AllocateQueued(stSOCKETINFO* pSocketInfo, unsigned nSize);
+	// Give back a buffer from AllocateQueued()
+	void FreeQueued(stSOCKETINFO* pSocketInfo, char* pBuffer);
+	// Whether the connection has queued too much to take more requests
+	bool IsBacklogged(stSOCKETINFO* pSocketInfo);
+	// Whether a paused connection has drained enough to take requests again
+	bool CanResume(stSOCKETINFO* pSocketInfo);
+	// After a receive completion: keep receiving, or pause while the connection is
+	// backlogged. bArmed when a multishot receive is still armed.
+	void ContinueRecv(stSOCKETINFO* pSocketInfo, bool bArmed);
+	// Re-arm a paused receive, unless another thread already did
+	void ResumeRecv(stSOCKETINFO* pSocketInfo);
+	// Cut received bytes into frames and hand the whole ones to the frame handler; false
+	// when the peer broke the framing
+	bool ReceiveFrames(stSOCKETINFO* pSocketInfo, const char* pData, unsigned nLength);
+	// Run the frame handler on this thread, or queue the frame for the handler threads
+	void DispatchFrame(stSOCKETINFO* pSocketInfo, const char* pPayload, unsigned nLength);
+	// Put a reply in the mailbox of the connection's queue and wake a worker for it
+	void PostReply(stSOCKETINFO* pSocketInfo, char* pFrame, int nLength);
+	// Send what other threads left in the queue's mailbox; replies is scratch space
+	void DeliverReplies(int nQueue, std::vector<stREPLY>& replies);
+	// Drop an I/O reference; the socket info is freed once it is closed and idle
+	void EndIo(stSOCKETINFO* pSocketInfo);
+	// Shut the socket down so outstanding operations complete
+	void CloseSocket(stSOCKETINFO* pSocketInfo);
+	// Act on one harvested completion of the worker's queue
+	void HandleCompletion(stCOMPLETION& completion, int nQueue, int nWorker);
+	// Close the worker's connections that have no reply in flight, or all of them when
+	// bForce; the first call also stops the queue accepting
+	void DrainConnections(int nQueue, bool bForce);
+	// Make every worker look at the server state
+	void WakeWorkers();
+	// Close a listener, waking a thread blocked in accept() on it
+	void CloseListenSocket(SOCKET& listenSocket);
+	// Stats of the calling thread: its worker's, or the last slot for any other thread
+	stSTATS& ThreadStats();
+	// Earliest deadline of the connection that applies now, INT64_MAX when none does;
+	// pReason names the deadline
+	int64_t GetDeadline(stSOCKETINFO* pSocketInfo, const char*& pReason);
+	// (Re-)arm the connection's timer, under the lock of its queue's timers
+	void ArmTimer(stTIMERS& timers, stSOCKETINFO* pSocketInfo, int64_t nDeadline, int64_t nNowMs);
+	// Close the queue's connections whose deadline passed, re-arm the others; returns how
+	// long the worker may wait for completions before the next timer
+	DWORD ExpireTimers(int nQueue);
+	// Write the stats file; total is scratch space
+	void DumpStats(stSTATS& total);
+
+	stSERVERCONFIG	m_config;			// Server settings
 	SOCKET			m_listenSocket;		// Listening socket
-	HANDLE			m_hIOCP;			// IOCP object handles
-	bool			m_bAccept;			// Request action flag
-	bool			m_bWorkerThread;	// Action thread action flag
-	HANDLE* m_pWorkerHandle;	// Work thread handles
+	std::vector<SOCKET> m_queueListenSockets;	// Extra SO_REUSEPORT listeners for per-queue accept
+	bool			m_bQueueAccept;		// Completion queues accept connections themselves
+	SocketInfoPool	m_socketPool;		// Connection contexts
+	FrameBufferPool	m_frameBuffers;		// Outgoing frames and incoming ones being reassembled
+	FrameHandler*	m_pFrameHandler;	// Receives every whole frame
+	EchoFrameHandler m_echoHandler;
+	bool			m_bBlockingHandler;	// Frames go to the handler threads
+	stMAILBOX*		m_pMailboxes;		// One per completion queue
+	stHANDLERQUEUE*	m_pHandlerQueues;	// One per handler thread; a connection always maps to the same
+	alignas(64) std::atomic<int64_t> m_nQueuedBytes;	// Sum of the connections' nQueuedBytes
+	stTIMERS*		m_pTimers;			// One per completion queue, NULL when every timeout is off
+	DWORD			m_nTimerCheckMs;	// Shortest timeout; no timer is armed further ahead
+	std::atomic<bool> m_bHandlersStop;	// Handler threads leave once their tasks are done
+	std::vector<std::thread> m_handlerThreads;
+	std::vector<CompletionQueue*> m_queues;	// Completion queues (one shared, or one per worker)
+	unsigned		m_nNextQueue;		// Round-robin cursor for accepted sockets
+	std::atomic<SERVER_STATE> m_state;
+	std::atomic<unsigned> m_nConnections;	// Connection contexts in use
+	std::mutex		m_stateLock;
+	std::condition_variable m_stateChanged;	// Signals the last connection gone and SERVER_STOPPED
+	std::vector<std::thread> m_workerThreads;	// Work threads
+	stSTATS*		m_pStats;			// One per worker, then one for the acceptor
+	unsigned		m_nStatsSlots;
+	int64_t			m_nStartTime;		// StatsNow() when the server started
+	std::thread		m_statsThread;
 };
@@ -0,0 +1,440 @@
+#include "stdafx.h"
+#include "IOCompletionPort.h"
+#include "IocpCompletionQueue.h"
+#include "Log.h"
+
+#ifdef _WIN32
+#include <algorithm>
+
+// Entries removed from the port per GetQueuedCompletionStatusEx()
+static const int c_maxEntries = 64;
+
+IocpCompletionQueue::IocpCompletionQueue(const stSERVERCONFIG& config)
+{
+	m_hIOCP = NULL;
+	m_nBuffers = config.nRecvBuffers;
+	m_nBufferSize = config.nBufferSize;
+	m_bZeroCopy = config.nZeroCopyThreshold > 0;
+	m_listenSocket = INVALID_SOCKET;
+	m_pfnAcceptEx = NULL;
+	m_bAccepting = false;
+	m_nAccepts = config.nAcceptsInFlight > 0 ? config.nAcceptsInFlight : 1;
+}
+
+
+IocpCompletionQueue::~IocpCompletionQueue()
+{
+	Close();
+}
+
+bool IocpCompletionQueue::Create()
+{
+	// Completion Port creating
+	m_hIOCP = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	if (m_hIOCP == NULL)
+	{
+		return false;
+	}
+	return m_buffers.Create(m_nBuffers, m_nBufferSize);
+}
+
+void IocpCompletionQueue::Close()
+{
+	// Closing the sockets the accepts are pending on ends them.
+	for (stACCEPTCONTEXT& context : m_accepts)
+	{
+		if (context.acceptSocket != INVALID_SOCKET)
+		{
+			closesocket(context.acceptSocket);
+			context.acceptSocket = INVALID_SOCKET;
+		}
+	}
+	m_bAccepting = false;
+	m_listenSocket = INVALID_SOCKET;
+
+	if (m_hIOCP)
+	{
+		CloseHandle(m_hIOCP);
+		m_hIOCP = NULL;
+	}
+	m_buffers.Destroy();
+}
+
+bool IocpCompletionQueue::Associate(stSOCKETINFO* pSocketInfo)
+{
+	if (m_bZeroCopy)
+	{
+		// Without a send buffer an overlapped WSASend transmits from the reply frame
+		// itself, which the server keeps until the send completes; the threshold cannot
+		// be applied per send here.
+		int nSendBuffer = 0;
+		setsockopt(pSocketInfo->socket, SOL_SOCKET, SO_SNDBUF, (const char*)&nSendBuffer, sizeof(nSendBuffer));
+	}
+
+	// The key is fixed for the lifetime of the handle, so it remembers which
+	// generation of the pooled context the socket belongs to.
+	return CreateIoCompletionPort(
+		(HANDLE)pSocketInfo->socket, m_hIOCP, (ULONG_PTR)pSocketInfo->nGeneration, 0
+	) != NULL;
+}
+
+bool IocpCompletionQueue::PostRecv(stSOCKETINFO* pSocketInfo)
+{
+	DWORD recvBytes;
+	DWORD flags = 0;
+	stIOCONTEXT* pContext = &pSocketInfo->recvContext;
+
+	ZeroMemory(&(pContext->overlapped), sizeof(OVERLAPPED));
+	pContext->operation = IO_RECV;
+	pContext->pSocketInfo = pSocketInfo;
+	pContext->nBufferId = -1;
+	pContext->dataBuf.len = 0;
+	pContext->dataBuf.buf = NULL;
+
+	// Zero-byte receive: completes once data (or the end of the stream) is there
+	// without tying a buffer to the idle connection.
+	int nResult = WSARecv(
+		pSocketInfo->socket,
+		&pContext->dataBuf,
+		1,
+		&recvBytes,
+		&flags,
+		&(pContext->overlapped),
+		NULL
+	);
+
+	if (nResult == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+	{
+		LOG_ERROR("WSARecv failure : %d", WSAGetLastError());
+		return false;
+	}
+	return true;
+}
+
+bool IocpCompletionQueue::PostSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength)
+{
+	stSENDREQUEST* pRequest = NewSendRequest(pSocketInfo, pBuffer, nLength);
+	ZeroMemory(&(pRequest->overlapped), sizeof(OVERLAPPED));
+	pRequest->dataBuf.len = nLength;
+	pRequest->dataBuf.buf = pBuffer;
+
+	// Overlapped send straight out of the caller's buffer, which stays in use until the
+	// completion. Sends posted on one socket go out in the order WSASend was called, so
+	// any number may be outstanding.
+	int nResult = WSASend(
+		pSocketInfo->socket,
+		&(pRequest->dataBuf),
+		1,
+		NULL,
+		0,
+		&(pRequest->overlapped),
+		NULL
+	);
+
+	if (nResult == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+	{
+		LOG_ERROR("WSASend failure : %d", WSAGetLastError());
+		DeleteSendRequest(pRequest);
+		return false;
+	}
+	return true;
+}
+
+bool IocpCompletionQueue::StartAccept(SOCKET listenSocket)
+{
+	GUID guidAcceptEx = WSAID_ACCEPTEX;
+	DWORD nBytes = 0;
+	if (WSAIoctl(listenSocket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guidAcceptEx, sizeof(guidAcceptEx),
+		&m_pfnAcceptEx, sizeof(m_pfnAcceptEx), &nBytes, NULL, NULL) == SOCKET_ERROR)
+	{
+		LOG_ERROR("AcceptEx lookup failure : %d", WSAGetLastError());
+		return false;
+	}
+
+	// Accept completions carry no socket info, so the key is never looked at.
+	if (CreateIoCompletionPort((HANDLE)listenSocket, m_hIOCP, 0, 0) == NULL)
+	{
+		return false;
+	}
+	m_listenSocket = listenSocket;
+	m_bAccepting = true;
+
+	// The slots are posted once and never move, the kernel holds on to them.
+	m_accepts.resize(m_nAccepts);
+	unsigned nPosted = 0;
+	for (stACCEPTCONTEXT& context : m_accepts)
+	{
+		context.acceptSocket = INVALID_SOCKET;
+		if (PostAccept(&context))
+		{
+			nPosted++;
+		}
+	}
+	return nPosted > 0;
+}
+
+bool IocpCompletionQueue::StopAccept()
+{
+	return m_bAccepting.exchange(false);
+}
+
+void IocpCompletionQueue::Wake()
+{
+	// A packet without an overlapped names no operation.
+	PostQueuedCompletionStatus(m_hIOCP, 0, 0, NULL);
+}
+
+bool IocpCompletionQueue::PostAccept(stACCEPTCONTEXT* pContext)
+{
+	pContext->acceptSocket = WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, WSA_FLAG_OVERLAPPED);
+	if (pContext->acceptSocket == INVALID_SOCKET)
+	{
+		LOG_ERROR("Socket creation failed");
+		return false;
+	}
+
+	ZeroMemory(&(pContext->overlapped), sizeof(OVERLAPPED));
+	pContext->operation = IO_ACCEPT;
+	pContext->pSocketInfo = NULL;
+	pContext->nBufferId = -1;
+
+	// No receive data: the accept completes as soon as the handshake is done, and the
+	// first read goes through the usual zero-byte receive.
+	DWORD nBytes = 0;
+	if (!m_pfnAcceptEx(m_listenSocket, pContext->acceptSocket, pContext->addresses, 0,
+		ACCEPT_ADDRESS_LENGTH, ACCEPT_ADDRESS_LENGTH, &nBytes, &(pContext->overlapped)) &&
+		WSAGetLastError() != ERROR_IO_PENDING)
+	{
+		LOG_ERROR("AcceptEx failure : %d", WSAGetLastError());
+		closesocket(pContext->acceptSocket);
+		pContext->acceptSocket = INVALID_SOCKET;
+		return false;
+	}
+	return true;
+}
+
+bool IocpCompletionQueue::FinishAccept(stACCEPTCONTEXT* pContext, bool bSuccess, stCOMPLETION& completion)
+{
+	SOCKET clientSocket = pContext->acceptSocket;
+	pContext->acceptSocket = INVALID_SOCKET;
+
+	if (!m_bAccepting)
+	{
+		// The listener is going away; nobody takes the connection any more.
+		closesocket(clientSocket);
+		return false;
+	}
+
+	completion.pSocketInfo = NULL;
+	completion.operation = IO_ACCEPT;
+	completion.pBuffer = NULL;
+	completion.nBufferId = -1;
+	completion.bMore = false;
+	completion.nGeneration = 0;
+
+	if (bSuccess)
+	{
+		// Lets shutdown() and getpeername() treat the socket like one from accept().
+		setsockopt(clientSocket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+			(const char*)&m_listenSocket, sizeof(m_listenSocket));
+		completion.nResult = (int)clientSocket;
+	}
+	else
+	{
+		DWORD transferred = 0;
+		DWORD flags = 0;
+		WSAGetOverlappedResult(m_listenSocket, &(pContext->overlapped), &transferred, FALSE, &flags);
+		completion.nResult = -(int)WSAGetLastError();
+		closesocket(clientSocket);
+	}
+
+	// Keep the number of accepts in flight.
+	PostAccept(pContext);
+	return true;
+}
+
+void IocpCompletionQueue::ReleaseBuffer(int nBufferId)
+{
+	if (nBufferId < 0)
+	{
+		return;
+	}
+	m_buffers.Release(nBufferId);
+
+	// A parked socket still has its data waiting, so its receive completes right away.
+	stSOCKETINFO* pSocketInfo = NULL;
+	{
+		std::lock_guard<std::mutex> lock(m_parkedLock);
+		if (!m_parked.empty())
+		{
+			pSocketInfo = m_parked.back();
+			m_parked.pop_back();
+		}
+	}
+	if (pSocketInfo)
+	{
+		RepostParked(pSocketInfo);
+	}
+}
+
+void IocpCompletionQueue::CancelIo(stSOCKETINFO* pSocketInfo)
+{
+	// A parked receive is not known to the kernel, so closesocket() will not end it.
+	{
+		std::lock_guard<std::mutex> lock(m_parkedLock);
+		std::vector<stSOCKETINFO*>::iterator it = std::find(m_parked.begin(), m_parked.end(), pSocketInfo);
+		if (it == m_parked.end())
+		{
+			return;
+		}
+		m_parked.erase(it);
+	}
+	RepostParked(pSocketInfo);
+}
+
+void IocpCompletionQueue::RepostParked(stSOCKETINFO* pSocketInfo)
+{
+	// Goes through the same path as a finished zero-byte receive.
+	stIOCONTEXT* pContext = &pSocketInfo->recvContext;
+	ZeroMemory(&(pContext->overlapped), sizeof(OVERLAPPED));
+	PostQueuedCompletionStatus(
+		m_hIOCP, 0, (ULONG_PTR)pSocketInfo->nGeneration, &(pContext->overlapped)
+	);
+}
+
+bool IocpCompletionQueue::FinishRecv(stSOCKETINFO* pSocketInfo, stCOMPLETION& completion)
+{
+	if (pSocketInfo->bClosing)
+	{
+		// The handle may already belong to another connection.
+		completion.nResult = -WSAECONNABORTED;
+		return true;
+	}
+
+	u_long nAvailable = 0;
+	if (ioctlsocket(pSocketInfo->socket, FIONREAD, &nAvailable) == SOCKET_ERROR || nAvailable == 0)
+	{
+		// Nothing to read after a zero-byte receive completed: the peer closed.
+		completion.nResult = 0;
+		return true;
+	}
+
+	int nBufferId = m_buffers.Acquire();
+	if (nBufferId < 0)
+	{
+		// Every buffer holds a receive not handled yet; retry once one comes back.
+		// Checking again under the lock catches a buffer released in between.
+		std::lock_guard<std::mutex> lock(m_parkedLock);
+		nBufferId = m_buffers.Acquire();
+		if (nBufferId < 0)
+		{
+			m_parked.push_back(pSocketInfo);
+			return false;
+		}
+	}
+
+	// FIONREAD said the data is there, so this recv does not block.
+	char* pBuffer = m_buffers.GetBuffer(nBufferId);
+	int nResult = recv(pSocketInfo->socket, pBuffer, m_nBufferSize, 0);
+	if (nResult <= 0)
+	{
+		ReleaseBuffer(nBufferId);
+		completion.nResult = (nResult == 0) ? 0 : -WSAGetLastError();
+		return true;
+	}
+	completion.nResult = nResult;
+	completion.pBuffer = pBuffer;
+	completion.nBufferId = nBufferId;
+	return true;
+}
+
+int IocpCompletionQueue::GetCompletions(stCOMPLETION* pCompletions, int nMax, DWORD timeoutMs)
+{
+	OVERLAPPED_ENTRY entries[c_maxEntries];
+
+	for (;;)
+	{
+		ULONG nEntries = 0;
+
+		/**
+		 * This function causes threads to be put on hold in the WaitingThread Queue,
+		 which will take the completed work from the IOCP Queue and process it after
+		 the overlapped I/O operation occurs. Everything already queued, up to the
+		 array size, is removed in the same call.
+		 */
+		BOOL bResult = GetQueuedCompletionStatusEx(m_hIOCP,
+			entries,						// Completed operations
+			(ULONG)(std::min)(nMax, c_maxEntries),
+			&nEntries,						// Number of entries removed
+			timeoutMs,
+			FALSE							// Not alertable
+		);
+
+		if (!bResult)
+		{
+			// Timed out, or the port itself failed.
+			return 0;
+		}
+
+		int nCount = 0;
+		bool bWoken = false;
+		for (ULONG i = 0; i < nEntries; i++)
+		{
+			if (entries[i].lpOverlapped == NULL)
+			{
+				bWoken = true;
+			}
+			else if (TranslateEntry(entries[i], pCompletions[nCount]))
+			{
+				nCount++;
+			}
+		}
+		if (nCount > 0 || bWoken)
+		{
+			return nCount;
+		}
+	}
+}
+
+bool IocpCompletionQueue::TranslateEntry(const OVERLAPPED_ENTRY& entry, stCOMPLETION& completion)
+{
+	// The operation tag of the context says which direction completed.
+	stIOCONTEXT* pContext = CONTAINING_RECORD(entry.lpOverlapped, stIOCONTEXT, overlapped);
+	if (pContext->operation == IO_ACCEPT)
+	{
+		return FinishAccept(static_cast<stACCEPTCONTEXT*>(pContext), entry.lpOverlapped->Internal == 0, completion);
+	}
+
+	stSOCKETINFO* pSocketInfo = pContext->pSocketInfo;
+	completion.pSocketInfo = pSocketInfo;
+	completion.operation = pContext->operation;
+	completion.nResult = (int)entry.dwNumberOfBytesTransferred;
+	completion.pBuffer = NULL;
+	completion.nBufferId = -1;
+	completion.bMore = false;
+	completion.nGeneration = (unsigned short)entry.lpCompletionKey;
+
+	// The entry carries no error code; the overlapped still holds the operation's status.
+	bool bResult = entry.lpOverlapped->Internal == 0;
+	if (!bResult)
+	{
+		DWORD transferred = 0;
+		DWORD flags = 0;
+		WSAGetOverlappedResult(pSocketInfo->socket, entry.lpOverlapped, &transferred, FALSE, &flags);
+		completion.nResult = -(int)WSAGetLastError();
+	}
+
+	if (completion.operation == IO_SEND)
+	{
+		stSENDREQUEST* pRequest = static_cast<stSENDREQUEST*>(pContext);
+		completion.pBuffer = pRequest->pBuffer;
+		DeleteSendRequest(pRequest);
+	}
+	else if (bResult)
+	{
+		return FinishRecv(pSocketInfo, completion);
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+#include "CompletionQueue.h"
+
+#ifdef _WIN32
+#include <MSWSock.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "BufferPool.h"
+
+// Room AcceptEx needs for one address
+static const DWORD ACCEPT_ADDRESS_LENGTH = sizeof(SOCKADDR_IN) + 16;
+
+// An AcceptEx kept posted on the listener
+struct stACCEPTCONTEXT : public stIOCONTEXT
+{
+	SOCKET			acceptSocket;	// Socket the next connection is accepted into
+	char			addresses[2 * ACCEPT_ADDRESS_LENGTH];	// Local and remote address
+};
+
+/**
+ * CompletionQueue on top of a Windows I/O completion port. One port is shared
+ * by every worker thread.
+ *
+ * Receives are posted with a zero-byte WSARecv, which pins no memory while the
+ * connection is idle. When it completes the data is already in the socket buffer and
+ * is copied into a buffer from the shared pool with a recv() that cannot block.
+ * That buffer is recycled once the server has cut it into frames; replies are
+ * overlapped WSASends out of frame buffers the server keeps untouched until the send
+ * completes.
+ *
+ * Connections are accepted with a fixed number of AcceptEx calls kept posted on the
+ * listener; each one completes on the port like any other operation and is posted
+ * again right away.
+ */
+class IocpCompletionQueue : public CompletionQueue
+{
+public:
+	explicit IocpCompletionQueue(const stSERVERCONFIG& config);
+	virtual ~IocpCompletionQueue();
+
+	virtual bool Create() override;
+	virtual void Close() override;
+	virtual bool IsShared() const override { return true; }
+
+	virtual bool Associate(stSOCKETINFO* pSocketInfo) override;
+	virtual bool PostRecv(stSOCKETINFO* pSocketInfo) override;
+	virtual bool PostSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength) override;
+	virtual void ReleaseBuffer(int nBufferId) override;
+	virtual void CancelIo(stSOCKETINFO* pSocketInfo) override;
+	virtual bool StartAccept(SOCKET listenSocket) override;
+	virtual bool StopAccept() override;
+	virtual void Wake() override;
+
+	virtual int GetCompletions(stCOMPLETION* pCompletions, int nMax, DWORD timeoutMs) override;
+
+private:
+	// Copy the data a zero-byte receive announced into a pool buffer; false when the
+	// pool is empty and the socket has been parked
+	bool FinishRecv(stSOCKETINFO* pSocketInfo, stCOMPLETION& completion);
+	// Turn a dequeued port entry into a completion; false when it produced none
+	bool TranslateEntry(const OVERLAPPED_ENTRY& entry, stCOMPLETION& completion);
+	// Hand a parked receive back to the port so it completes through a worker
+	void RepostParked(stSOCKETINFO* pSocketInfo);
+	// Post an AcceptEx for the slot with a fresh socket
+	bool PostAccept(stACCEPTCONTEXT* pContext);
+	// Hand the accepted socket over and post the slot again; false once accepting stopped
+	bool FinishAccept(stACCEPTCONTEXT* pContext, bool bSuccess, stCOMPLETION& completion);
+
+	HANDLE			m_hIOCP;			// IOCP object handles
+	unsigned		m_nBuffers;
+	unsigned		m_nBufferSize;
+	bool			m_bZeroCopy;		// Sockets get no send buffer, so WSASend never copies
+	BufferPool		m_buffers;			// Receive buffers shared by all connections
+	std::mutex		m_parkedLock;
+	std::vector<stSOCKETINFO*> m_parked;	// Readable sockets waiting for a free buffer
+	SOCKET			m_listenSocket;		// Listener the accepts are posted on, INVALID_SOCKET if none
+	LPFN_ACCEPTEX	m_pfnAcceptEx;		// Extension function pointer of the listener's provider
+	std::atomic<bool> m_bAccepting;		// Finished accepts are handed out and posted again
+	unsigned		m_nAccepts;			// AcceptEx calls kept in flight
+	std::vector<stACCEPTCONTEXT> m_accepts;
+};
+
+#endif
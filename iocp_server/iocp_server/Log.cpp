@@ -0,0 +1,458 @@
+#include "stdafx.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+static_assert(sizeof(stLOGRECORD) == LOG_RECORD_SIZE, "Log record layout");
+
+static const uint32_t c_ringSize = 2048;		// Records per thread, a power of two
+static const int c_flushIntervalMs = 10;		// How long the flusher sleeps when every ring is empty
+static const size_t c_lineSize = 1024;			// Longest line written; longer ones are cut off
+static const size_t c_outputSize = 64 * 1024;	// Bytes collected before a write
+
+// Records of one thread. The owner only moves nHead, the flusher only nTail.
+struct stLOGRING
+{
+	stLOGRECORD		records[c_ringSize];
+	std::atomic<uint32_t> nHead;		// Next record the owner fills
+	char			padHead[60];		// Keeps the two cursors on separate cache lines
+	std::atomic<uint32_t> nTail;		// Next record the flusher reads
+	std::atomic<uint32_t> nDropped;		// Records lost to a full ring since the last pass
+	std::atomic<bool> bRetired;			// The owner has exited; freed once drained
+};
+
+// Gives the calling thread's ring back when the thread exits
+struct stLOGTHREAD
+{
+	stLOGRING*		pRing = NULL;
+
+	~stLOGTHREAD()
+	{
+		if (pRing)
+		{
+			pRing->bRetired = true;
+		}
+	}
+};
+
+static thread_local stLOGTHREAD s_logThread;
+
+static struct stLOGGER
+{
+	std::mutex		lock;				// Guards rings
+	std::vector<stLOGRING*> rings;
+	std::mutex		threadLock;			// Guards starting and joining the flusher
+	std::thread		flusher;
+	std::atomic<bool> bRunning;			// The flusher is started
+	std::atomic<bool> bStop;
+	std::mutex		wakeLock;
+	std::condition_variable wake;		// Ends the flusher's sleep early on shutdown
+
+	stLOGGER() : bRunning(false), bStop(false) {}
+	~stLOGGER() { LogShutdown(); }
+} s_logger;
+
+static void FlushThread();
+
+// Start the flusher unless it is already running. Out of threads, the records wait in
+// their rings and the next one tries again; logging must not bring the process down.
+static void StartFlusher()
+{
+	std::lock_guard<std::mutex> threadLock(s_logger.threadLock);
+	if (!s_logger.flusher.joinable())
+	{
+		try
+		{
+			s_logger.flusher = std::thread(FlushThread);
+		}
+		catch (const std::system_error&)
+		{
+			return;
+		}
+		s_logger.bRunning = true;
+	}
+}
+
+stLOGRECORD* LogBegin(int nLevel)
+{
+	stLOGRING* pRing = s_logThread.pRing;
+	if (pRing == NULL)
+	{
+		// First record of this thread: its ring is created and announced to the flusher.
+		pRing = new stLOGRING();
+		pRing->nHead = 0;
+		pRing->nTail = 0;
+		pRing->nDropped = 0;
+		pRing->bRetired = false;
+		{
+			std::lock_guard<std::mutex> lock(s_logger.lock);
+			s_logger.rings.push_back(pRing);
+		}
+		s_logThread.pRing = pRing;
+	}
+	if (!s_logger.bRunning.load(std::memory_order_relaxed))
+	{
+		// First record ever, or the first since LogShutdown()
+		StartFlusher();
+	}
+
+	uint32_t nHead = pRing->nHead.load(std::memory_order_relaxed);
+	if (nHead - pRing->nTail.load(std::memory_order_acquire) == c_ringSize)
+	{
+		pRing->nDropped.fetch_add(1, std::memory_order_relaxed);
+		return NULL;
+	}
+
+	stLOGRECORD* pRecord = &pRing->records[nHead & (c_ringSize - 1)];
+	pRecord->nTime = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	pRecord->nLevel = (unsigned char)nLevel;
+	pRecord->nArgs = 0;
+	pRecord->nText = 0;
+	return pRecord;
+}
+
+void LogCommit(stLOGRECORD* /* pRecord */)
+{
+	// Records are filled in ring order, so publishing one is moving the head past it.
+	stLOGRING* pRing = s_logThread.pRing;
+	pRing->nHead.store(pRing->nHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void LogShutdown()
+{
+	// The flusher takes the ring lock while it writes, so only the thread lock is held here.
+	std::lock_guard<std::mutex> threadLock(s_logger.threadLock);
+	if (!s_logger.flusher.joinable())
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> wakeLock(s_logger.wakeLock);
+		s_logger.bStop = true;
+	}
+	s_logger.wake.notify_all();
+	s_logger.flusher.join();
+	s_logger.bRunning = false;
+	s_logger.bStop = false;
+}
+
+// Format the record the way printf would have at the time of the call
+static size_t FormatMessage(const stLOGRECORD& record, char* pOut, size_t nSize)
+{
+	const char* pFormat = record.pFormat;
+	unsigned nArg = 0;
+	size_t nOut = 0;
+	char spec[64];
+
+	while (*pFormat && nOut + 1 < nSize)
+	{
+		if (*pFormat != '%')
+		{
+			pOut[nOut++] = *pFormat++;
+			continue;
+		}
+		if (pFormat[1] == '%')
+		{
+			pOut[nOut++] = '%';
+			pFormat += 2;
+			continue;
+		}
+
+		// Flags, width and precision are kept; a '*' takes its value from the arguments.
+		size_t nSpec = 0;
+		spec[nSpec++] = *pFormat++;
+		while (*pFormat && strchr("-+ #0", *pFormat) && nSpec < 6)
+		{
+			spec[nSpec++] = *pFormat++;
+		}
+		for (int nField = 0; nField < 2; nField++)
+		{
+			if (nField == 1)
+			{
+				if (*pFormat != '.')
+				{
+					break;
+				}
+				spec[nSpec++] = *pFormat++;
+			}
+			if (*pFormat == '*' && nSpec < 30)
+			{
+				int nValue = (nArg < record.nArgs) ? (int)(int64_t)record.args[nArg] : 0;
+				nArg++;
+				nSpec += snprintf(spec + nSpec, 12, "%d", nValue);
+				pFormat++;
+			}
+			while (*pFormat >= '0' && *pFormat <= '9' && nSpec < 30)
+			{
+				spec[nSpec++] = *pFormat++;
+			}
+		}
+
+		// The length modifier only tells how wide the argument was when it was captured.
+		int nBits = 32;
+		int nShort = 0;
+		int nLong = 0;
+		while (*pFormat && strchr("hlLqjztI", *pFormat))
+		{
+			if (*pFormat == 'h')
+			{
+				nShort++;
+			}
+			else if (*pFormat == 'l')
+			{
+				nLong++;
+			}
+			else
+			{
+				nLong = 2;
+			}
+			pFormat++;
+			// Microsoft's I64 / I32
+			while (*pFormat >= '0' && *pFormat <= '9')
+			{
+				pFormat++;
+			}
+		}
+		if (nShort > 0)
+		{
+			nBits = (nShort > 1) ? 8 : 16;
+		}
+		else if (nLong > 0)
+		{
+			nBits = (nLong > 1) ? 64 : (int)sizeof(long) * 8;
+		}
+
+		char conversion = *pFormat;
+		if (conversion == '\0')
+		{
+			break;
+		}
+		pFormat++;
+		uint64_t nValue = (nArg < record.nArgs) ? record.args[nArg] : 0;
+		nArg++;
+
+		int nWritten = 0;
+		switch (conversion)
+		{
+		case 'd':
+		case 'i':
+			memcpy(spec + nSpec, "lld", 4);
+			nWritten = snprintf(pOut + nOut, nSize - nOut, spec, (long long)nValue);
+			break;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			if (nBits < 64)
+			{
+				nValue &= ((uint64_t)1 << nBits) - 1;
+			}
+			spec[nSpec++] = 'l';
+			spec[nSpec++] = 'l';
+			spec[nSpec++] = conversion;
+			spec[nSpec] = '\0';
+			nWritten = snprintf(pOut + nOut, nSize - nOut, spec, (unsigned long long)nValue);
+			break;
+		case 'c':
+			memcpy(spec + nSpec, "c", 2);
+			nWritten = snprintf(pOut + nOut, nSize - nOut, spec, (int)nValue);
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+		{
+			double dValue;
+			memcpy(&dValue, &nValue, sizeof(dValue));
+			spec[nSpec++] = conversion;
+			spec[nSpec] = '\0';
+			nWritten = snprintf(pOut + nOut, nSize - nOut, spec, dValue);
+			break;
+		}
+		case 's':
+		{
+			const char* pString = "(null)";
+			if (nValue != UINT64_MAX)
+			{
+				pString = (nValue < sizeof(record.text)) ? record.text + nValue : "";
+			}
+			memcpy(spec + nSpec, "s", 2);
+			nWritten = snprintf(pOut + nOut, nSize - nOut, spec, pString);
+			break;
+		}
+		case 'p':
+			memcpy(spec + nSpec, "p", 2);
+			nWritten = snprintf(pOut + nOut, nSize - nOut, spec, (void*)(uintptr_t)nValue);
+			break;
+		default:
+			// Not a conversion printf knows; keep it as written.
+			nArg--;
+			spec[nSpec] = '\0';
+			nWritten = snprintf(pOut + nOut, nSize - nOut, "%s%c", spec, conversion);
+			break;
+		}
+		if (nWritten > 0)
+		{
+			nOut += (std::min)((size_t)nWritten, nSize - nOut - 1);
+		}
+	}
+	pOut[nOut] = '\0';
+	return nOut;
+}
+
+// Append "HH:MM:SS.uuuuuu [LEVEL] " for the given time
+static size_t FormatPrefix(int64_t nTime, int nLevel, char* pOut, size_t nSize)
+{
+	static const char* const c_levels[] = { "DEBUG", "INFO", "ERROR" };
+
+	time_t seconds = (time_t)(nTime / 1000000);
+	struct tm local;
+#ifdef _WIN32
+	localtime_s(&local, &seconds);
+#else
+	localtime_r(&seconds, &local);
+#endif
+	int nWritten = snprintf(pOut, nSize, "%02d:%02d:%02d.%06d [%s] ", local.tm_hour, local.tm_min, local.tm_sec,
+		(int)(nTime % 1000000), c_levels[(nLevel >= 0 && nLevel <= LOG_LEVEL_ERROR) ? nLevel : LOG_LEVEL_ERROR]);
+	return (nWritten > 0) ? (std::min)((size_t)nWritten, nSize - 1) : 0;
+}
+
+// Drain every ring once, writing the records in time order
+static void FlushRings(std::vector<char>& output)
+{
+	struct stCURSOR
+	{
+		stLOGRING*		pRing;
+		uint32_t		nNext;			// Next record to write
+		uint32_t		nEnd;			// Head when the pass started
+		bool			bRetired;
+	};
+	std::vector<stCURSOR> cursors;
+	{
+		std::lock_guard<std::mutex> lock(s_logger.lock);
+		for (stLOGRING* pRing : s_logger.rings)
+		{
+			stCURSOR cursor;
+			cursor.pRing = pRing;
+			// Retirement is read before the head, so a retired ring's head is final.
+			cursor.bRetired = pRing->bRetired;
+			cursor.nNext = pRing->nTail.load(std::memory_order_relaxed);
+			cursor.nEnd = pRing->nHead.load(std::memory_order_acquire);
+			cursors.push_back(cursor);
+		}
+	}
+
+	size_t nUsed = 0;
+	char line[c_lineSize];
+	for (;;)
+	{
+		// Oldest pending record over all rings; each ring is already in time order.
+		stCURSOR* pOldest = NULL;
+		for (stCURSOR& cursor : cursors)
+		{
+			if (cursor.nNext != cursor.nEnd && (pOldest == NULL ||
+				cursor.pRing->records[cursor.nNext & (c_ringSize - 1)].nTime <
+				pOldest->pRing->records[pOldest->nNext & (c_ringSize - 1)].nTime))
+			{
+				pOldest = &cursor;
+			}
+		}
+		if (pOldest == NULL)
+		{
+			break;
+		}
+
+		const stLOGRECORD& record = pOldest->pRing->records[pOldest->nNext & (c_ringSize - 1)];
+		size_t nLine = FormatPrefix(record.nTime, record.nLevel, line, sizeof(line));
+		nLine += FormatMessage(record, line + nLine, sizeof(line) - nLine - 1);
+		line[nLine++] = '\n';
+		pOldest->nNext++;
+		// The slot can be reused as soon as it is formatted.
+		pOldest->pRing->nTail.store(pOldest->nNext, std::memory_order_release);
+
+		if (nUsed + nLine > output.size())
+		{
+			fwrite(output.data(), 1, nUsed, stdout);
+			nUsed = 0;
+		}
+		memcpy(output.data() + nUsed, line, nLine);
+		nUsed += nLine;
+	}
+
+	for (stCURSOR& cursor : cursors)
+	{
+		uint32_t nDropped = cursor.pRing->nDropped.exchange(0);
+		if (nDropped > 0)
+		{
+			stLOGRECORD record;
+			record.pFormat = "Log ring full, %u record(s) dropped";
+			record.nTime = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
+			record.nLevel = LOG_LEVEL_ERROR;
+			record.nArgs = 1;
+			record.nText = 0;
+			record.args[0] = nDropped;
+			size_t nLine = FormatPrefix(record.nTime, record.nLevel, line, sizeof(line));
+			nLine += FormatMessage(record, line + nLine, sizeof(line) - nLine - 1);
+			line[nLine++] = '\n';
+			fwrite(output.data(), 1, nUsed, stdout);
+			nUsed = 0;
+			fwrite(line, 1, nLine, stdout);
+		}
+	}
+	if (nUsed > 0)
+	{
+		fwrite(output.data(), 1, nUsed, stdout);
+	}
+	fflush(stdout);
+
+	// Rings of exited threads go once everything in them is written.
+	std::lock_guard<std::mutex> lock(s_logger.lock);
+	for (stCURSOR& cursor : cursors)
+	{
+		if (cursor.bRetired && cursor.nNext == cursor.nEnd)
+		{
+			for (size_t i = 0; i < s_logger.rings.size(); i++)
+			{
+				if (s_logger.rings[i] == cursor.pRing)
+				{
+					s_logger.rings.erase(s_logger.rings.begin() + i);
+					break;
+				}
+			}
+			delete cursor.pRing;
+		}
+	}
+}
+
+static void FlushThread()
+{
+	std::vector<char> output(c_outputSize);
+
+	for (;;)
+	{
+		// Read before the pass, so whatever was logged before LogShutdown() gets written.
+		bool bStop = s_logger.bStop;
+		FlushRings(output);
+		if (bStop)
+		{
+			break;
+		}
+		std::unique_lock<std::mutex> lock(s_logger.wakeLock);
+		s_logger.wake.wait_for(lock, std::chrono::milliseconds(c_flushIntervalMs),
+			[] { return s_logger.bStop.load(); });
+	}
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// Log levels, least severe first
+#define LOG_LEVEL_DEBUG		0
+#define LOG_LEVEL_INFO		1
+#define LOG_LEVEL_ERROR		2
+
+// Calls below this level compile to nothing, arguments included
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL		LOG_LEVEL_INFO
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...)		LogWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)		((void)0)
+#endif
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...)		LogWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)		((void)0)
+#endif
+#define LOG_ERROR(...)		LogWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#define LOG_MAX_ARGS		8
+#define LOG_RECORD_SIZE		256
+
+/**
+ * Asynchronous, binary logging for the server threads.
+ *
+ * A log call does not format anything and takes no lock: it stores the format pointer,
+ * a timestamp and the raw arguments in a fixed-size record of a ring buffer that belongs
+ * to the calling thread. A background thread drains the rings, formats the records in
+ * time order and writes them out in bulk, one line each, prefixed with the time and the
+ * level. When a thread's ring is full the record is dropped and counted.
+ *
+ * The format has to be a string literal, since it is only read when the record is
+ * formatted. Arguments are numbers, pointers or NUL-terminated strings; strings are
+ * copied into the record and cut off once it is full.
+ */
+struct stLOGRECORD
+{
+	const char*		pFormat;
+	int64_t			nTime;			// Microseconds since the epoch
+	unsigned char	nLevel;
+	unsigned char	nArgs;
+	unsigned short	nText;			// Bytes of text in use
+	uint64_t		args[LOG_MAX_ARGS];	// Integers, pointers, double bit patterns, or offsets into text
+	char			text[LOG_RECORD_SIZE - 24 - LOG_MAX_ARGS * 8];	// Copies of the string arguments
+};
+
+// Slot for a record in the calling thread's ring, NULL when the ring is full
+stLOGRECORD* LogBegin(int nLevel);
+// Hand a filled record to the flusher
+void LogCommit(stLOGRECORD* pRecord);
+// Write out everything logged so far and stop the flusher; later calls start it again
+void LogShutdown();
+
+inline void LogCapture(stLOGRECORD& /* record */)
+{
+}
+
+inline void LogCaptureString(stLOGRECORD& record, const char* pString)
+{
+	if (pString == NULL)
+	{
+		record.args[record.nArgs++] = UINT64_MAX;
+		return;
+	}
+	// Room is kept for the terminator; an argument that does not fit is cut short.
+	size_t nRoom = sizeof(record.text) - record.nText;
+	size_t nLength = strlen(pString);
+	if (nLength >= nRoom)
+	{
+		nLength = nRoom ? nRoom - 1 : 0;
+	}
+	record.args[record.nArgs++] = record.nText;
+	if (nRoom > 0)
+	{
+		memcpy(record.text + record.nText, pString, nLength);
+		record.text[record.nText + nLength] = '\0';
+		record.nText = (unsigned short)(record.nText + nLength + 1);
+	}
+}
+
+template <typename T>
+inline void LogCaptureValue(stLOGRECORD& record, const T& value)
+{
+	uint64_t nValue = 0;
+	if (std::is_floating_point<T>::value)
+	{
+		double dValue = (double)value;
+		memcpy(&nValue, &dValue, sizeof(nValue));
+	}
+	else if (std::is_signed<T>::value)
+	{
+		nValue = (uint64_t)(int64_t)value;
+	}
+	else
+	{
+		nValue = (uint64_t)value;
+	}
+	record.args[record.nArgs++] = nValue;
+}
+
+inline void LogCaptureOne(stLOGRECORD& record, const char* pString) { LogCaptureString(record, pString); }
+inline void LogCaptureOne(stLOGRECORD& record, char* pString) { LogCaptureString(record, pString); }
+inline void LogCaptureOne(stLOGRECORD& record, const void* pValue) { record.args[record.nArgs++] = (uint64_t)(uintptr_t)pValue; }
+inline void LogCaptureOne(stLOGRECORD& record, void* pValue) { record.args[record.nArgs++] = (uint64_t)(uintptr_t)pValue; }
+
+template <typename T>
+inline typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type
+LogCaptureOne(stLOGRECORD& record, const T& value)
+{
+	typedef typename std::conditional<std::is_enum<T>::value, int, T>::type tVALUE;
+	LogCaptureValue(record, (tVALUE)value);
+}
+
+template <size_t N>
+inline void LogCaptureOne(stLOGRECORD& record, const char (&string)[N]) { LogCaptureString(record, string); }
+template <size_t N>
+inline void LogCaptureOne(stLOGRECORD& record, char (&string)[N]) { LogCaptureString(record, string); }
+
+template <typename T, typename... Args>
+inline void LogCapture(stLOGRECORD& record, const T& value, const Args&... args)
+{
+	LogCaptureOne(record, value);
+	LogCapture(record, args...);
+}
+
+template <typename... Args>
+inline void LogWrite(int nLevel, const char* pFormat, const Args&... args)
+{
+	static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many log arguments");
+	stLOGRECORD* pRecord = LogBegin(nLevel);
+	if (pRecord == NULL)
+	{
+		return;
+	}
+	pRecord->pFormat = pFormat;
+	LogCapture(*pRecord, args...);
+	LogCommit(pRecord);
+}
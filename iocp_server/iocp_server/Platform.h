@@ -0,0 +1,36 @@
+#pragma once
+
+// Thin portability layer so the server core can be built with WinSock on
+// Windows and with BSD sockets on Linux.
+
+#ifdef _WIN32
+
+#pragma comment(lib, "ws2_32.lib")
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+
+#else
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef int				SOCKET;
+typedef uint32_t		DWORD;
+typedef sockaddr_in		SOCKADDR_IN;
+
+#define INVALID_SOCKET	(-1)
+#define SOCKET_ERROR	(-1)
+#define INFINITE		0xFFFFFFFF
+#define SD_BOTH			SHUT_RDWR
+
+#define closesocket		close
+#define printf_s		printf
+
+#endif
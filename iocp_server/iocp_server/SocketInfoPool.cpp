@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include "IOCompletionPort.h"
+#include "SocketInfoPool.h"
+#include "Log.h"
+
+#include <new>
+#include <stdint.h>
+
+static const size_t c_cacheLine = 64;
+
+SocketInfoPool::SocketInfoPool()
+{
+	m_pMemory = NULL;
+	m_pSlots = NULL;
+	m_nCapacity = 0;
+	m_pShards = NULL;
+	m_nShards = 0;
+}
+
+
+SocketInfoPool::~SocketInfoPool()
+{
+	Destroy();
+}
+
+bool SocketInfoPool::Create(unsigned nCapacity, unsigned nShards)
+{
+	if (nCapacity == 0 || nShards == 0)
+	{
+		return false;
+	}
+
+	// Shards and slots share one block; both are whole cache lines, so aligning the
+	// start aligns every element.
+	size_t nBytes = nShards * sizeof(stSHARD) + (size_t)nCapacity * sizeof(stSOCKETINFO);
+	m_pMemory = new (std::nothrow) char[nBytes + c_cacheLine - 1];
+	if (m_pMemory == NULL)
+	{
+		LOG_ERROR("Connection pool allocation failure (%u slots)", nCapacity);
+		return false;
+	}
+	char* pAligned = (char*)(((uintptr_t)m_pMemory + c_cacheLine - 1) & ~(uintptr_t)(c_cacheLine - 1));
+
+	m_nShards = nShards;
+	m_pShards = (stSHARD*)pAligned;
+	for (unsigned i = 0; i < m_nShards; i++)
+	{
+		new (&m_pShards[i]) stSHARD();
+		m_pShards[i].pFreeHead = NULL;
+	}
+
+	// Deal the slots out round-robin so every worker starts with its share.
+	m_nCapacity = nCapacity;
+	m_pSlots = (stSOCKETINFO*)(pAligned + m_nShards * sizeof(stSHARD));
+	for (unsigned i = m_nCapacity; i-- > 0;)
+	{
+		stSOCKETINFO* pSocketInfo = new (&m_pSlots[i]) stSOCKETINFO();
+		pSocketInfo->nGeneration = 0;
+		pSocketInfo->bClosing = true;
+		stSHARD& shard = m_pShards[i % m_nShards];
+		pSocketInfo->pNextFree = shard.pFreeHead;
+		shard.pFreeHead = pSocketInfo;
+	}
+	return true;
+}
+
+void SocketInfoPool::Destroy()
+{
+	if (m_pMemory == NULL)
+	{
+		return;
+	}
+	for (unsigned i = 0; i < m_nCapacity; i++)
+	{
+		m_pSlots[i].~stSOCKETINFO();
+	}
+	for (unsigned i = 0; i < m_nShards; i++)
+	{
+		m_pShards[i].~stSHARD();
+	}
+	delete[] m_pMemory;
+	m_pMemory = NULL;
+	m_pSlots = NULL;
+	m_pShards = NULL;
+	m_nCapacity = 0;
+	m_nShards = 0;
+}
+
+stSOCKETINFO* SocketInfoPool::GetSlot(unsigned nIndex) const
+{
+	return &m_pSlots[nIndex];
+}
+
+stSOCKETINFO* SocketInfoPool::Allocate(unsigned nShard)
+{
+	for (unsigned i = 0; i < m_nShards; i++)
+	{
+		stSHARD& shard = m_pShards[(nShard + i) % m_nShards];
+		std::lock_guard<std::mutex> lock(shard.lock);
+		stSOCKETINFO* pSocketInfo = shard.pFreeHead;
+		if (pSocketInfo)
+		{
+			shard.pFreeHead = pSocketInfo->pNextFree;
+			pSocketInfo->pNextFree = NULL;
+			return pSocketInfo;
+		}
+	}
+	return NULL;
+}
+
+void SocketInfoPool::Free(stSOCKETINFO* pSocketInfo, unsigned nShard)
+{
+	// Completions still carrying the old generation are now recognizably stale.
+	pSocketInfo->nGeneration++;
+
+	stSHARD& shard = m_pShards[nShard % m_nShards];
+	std::lock_guard<std::mutex> lock(shard.lock);
+	pSocketInfo->pNextFree = shard.pFreeHead;
+	shard.pFreeHead = pSocketInfo;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <mutex>
+
+struct stSOCKETINFO;
+
+/**
+ * Fixed-capacity pool of connection contexts.
+ *
+ * All slots are carved out of one cache-line-aligned block at startup, so accepting a
+ * connection never reaches malloc and memory stays flat under churn. Free slots are
+ * spread over per-worker free lists; a worker frees into its own list and an allocation
+ * that finds its list empty takes from the others. Every free bumps the slot's
+ * generation so completions that outlive their connection can be recognized.
+ */
+class SocketInfoPool
+{
+public:
+	SocketInfoPool();
+	~SocketInfoPool();
+
+	// Allocate nCapacity slots split over nShards free lists
+	bool Create(unsigned nCapacity, unsigned nShards);
+	// Release the slots; none may be in use
+	void Destroy();
+
+	// Take a slot, preferring the given free list. NULL when the pool is exhausted.
+	stSOCKETINFO* Allocate(unsigned nShard);
+	// Put a slot back on the given free list
+	void Free(stSOCKETINFO* pSocketInfo, unsigned nShard);
+
+	unsigned GetCapacity() const { return m_nCapacity; }
+	// Slot by index, in use or not, for sweeping over every connection
+	stSOCKETINFO* GetSlot(unsigned nIndex) const;
+
+private:
+	struct alignas(64) stSHARD
+	{
+		std::mutex		lock;
+		stSOCKETINFO*	pFreeHead;
+	};
+
+	char*			m_pMemory;			// Backing block, over-allocated for alignment
+	stSOCKETINFO*	m_pSlots;			// First cache-line-aligned slot
+	unsigned		m_nCapacity;
+	stSHARD*		m_pShards;
+	unsigned		m_nShards;
+};
@@ -0,0 +1,318 @@
+#include "stdafx.h"
+#include "Stats.h"
+
+#include <chrono>
+#include <stdio.h>
+#ifdef _WIN32
+#include <intrin.h>
+#include <windows.h>
+#endif
+
+static const char* const c_counterNames[STAT_COUNTER_MAX] =
+{
+	"accepts",
+	"connections_opened",
+	"connections_closed",
+	"bytes_in",
+	"bytes_out",
+	"messages_in",
+	"messages_out",
+	"sends_posted",
+	"sends_done",
+	"recv_paused",
+	"errors_accept",
+	"errors_recv",
+	"errors_send",
+	"errors_frame",
+	"errors_limit",
+	"errors_memory",
+	"errors_timeout",
+};
+
+int64_t StatsNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Position of the highest set bit; nValue is not 0
+static unsigned HighestBit(uint64_t nValue)
+{
+#ifdef _MSC_VER
+	unsigned long nBit;
+	_BitScanReverse64(&nBit, nValue);
+	return (unsigned)nBit;
+#else
+	return 63 - (unsigned)__builtin_clzll(nValue);
+#endif
+}
+
+Histogram::Histogram()
+{
+	Reset();
+}
+
+void Histogram::Reset()
+{
+	for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		m_counts[i].store(0, std::memory_order_relaxed);
+	}
+	m_nCount.store(0, std::memory_order_relaxed);
+	m_nSum.store(0, std::memory_order_relaxed);
+	m_nMax.store(0, std::memory_order_relaxed);
+}
+
+unsigned Histogram::BucketOf(uint64_t nValue)
+{
+	// Values below 2^(SUB_BITS + 1) get a bucket each; above, the bits under the top
+	// SUB_BITS + 1 are shifted out, and each shift starts a new row of sub-buckets.
+	unsigned nShift = 0;
+	if (nValue >> (HISTOGRAM_SUB_BITS + 1))
+	{
+		nShift = HighestBit(nValue) - HISTOGRAM_SUB_BITS;
+	}
+	return (nShift << HISTOGRAM_SUB_BITS) + (unsigned)(nValue >> nShift);
+}
+
+uint64_t Histogram::BucketHighest(unsigned nBucket)
+{
+	if (nBucket < (2u << HISTOGRAM_SUB_BITS))
+	{
+		return nBucket;
+	}
+	unsigned nShift = (nBucket >> HISTOGRAM_SUB_BITS) - 1;
+	uint64_t nMantissa = nBucket - (nShift << HISTOGRAM_SUB_BITS);
+	return ((nMantissa + 1) << nShift) - 1;
+}
+
+void Histogram::Record(uint64_t nValue)
+{
+	std::atomic<uint64_t>& count = m_counts[BucketOf(nValue)];
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	m_nCount.store(m_nCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	m_nSum.store(m_nSum.load(std::memory_order_relaxed) + nValue, std::memory_order_relaxed);
+	if (nValue > m_nMax.load(std::memory_order_relaxed))
+	{
+		m_nMax.store(nValue, std::memory_order_relaxed);
+	}
+}
+
+void Histogram::Add(const Histogram& other)
+{
+	for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		uint64_t nCount = other.m_counts[i].load(std::memory_order_relaxed);
+		if (nCount)
+		{
+			m_counts[i].store(m_counts[i].load(std::memory_order_relaxed) + nCount, std::memory_order_relaxed);
+		}
+	}
+	m_nCount.store(GetCount() + other.GetCount(), std::memory_order_relaxed);
+	m_nSum.store(m_nSum.load(std::memory_order_relaxed) + other.m_nSum.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+	if (other.GetMax() > GetMax())
+	{
+		m_nMax.store(other.GetMax(), std::memory_order_relaxed);
+	}
+}
+
+double Histogram::GetMean() const
+{
+	uint64_t nCount = GetCount();
+	return nCount ? (double)m_nSum.load(std::memory_order_relaxed) / nCount : 0.0;
+}
+
+uint64_t Histogram::GetPercentile(double dPercent) const
+{
+	// The bucket counts were read one by one while the owner kept recording, so they
+	// need not add up to m_nCount; the walk goes by their own sum.
+	uint64_t nTotal = 0;
+	for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		nTotal += m_counts[i].load(std::memory_order_relaxed);
+	}
+	if (nTotal == 0)
+	{
+		return 0;
+	}
+	uint64_t nRank = (uint64_t)(dPercent / 100.0 * nTotal + 0.5);
+	if (nRank < 1)
+	{
+		nRank = 1;
+	}
+	uint64_t nSeen = 0;
+	for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		nSeen += m_counts[i].load(std::memory_order_relaxed);
+		if (nSeen >= nRank)
+		{
+			uint64_t nHighest = BucketHighest(i);
+			return (nHighest < GetMax()) ? nHighest : GetMax();
+		}
+	}
+	return GetMax();
+}
+
+stSTATS::stSTATS()
+{
+	Reset();
+}
+
+void stSTATS::Reset()
+{
+	for (int i = 0; i < STAT_COUNTER_MAX; i++)
+	{
+		counters[i].store(0, std::memory_order_relaxed);
+	}
+	for (int i = 0; i < STATS_ERROR_CODES; i++)
+	{
+		errorCodes[i].nCode.store(0, std::memory_order_relaxed);
+		errorCodes[i].nCount.store(0, std::memory_order_relaxed);
+	}
+	latency.Reset();
+	batch.Reset();
+	sendDepth.Reset();
+}
+
+void stSTATS::CountError(STAT_COUNTER counter, int nCode)
+{
+	Count(counter);
+	// A handful of distinct codes in practice; once the table is full the rest are
+	// only counted by operation.
+	for (int i = 0; i < STATS_ERROR_CODES; i++)
+	{
+		stERRORCODE& entry = errorCodes[i];
+		uint64_t nCount = entry.nCount.load(std::memory_order_relaxed);
+		if (nCount == 0)
+		{
+			// The code goes in first, so a reader never pairs a count with another code.
+			entry.nCode.store(nCode, std::memory_order_relaxed);
+			entry.nCount.store(1, std::memory_order_release);
+			return;
+		}
+		if (entry.nCode.load(std::memory_order_relaxed) == nCode)
+		{
+			entry.nCount.store(nCount + 1, std::memory_order_relaxed);
+			return;
+		}
+	}
+}
+
+void stSTATS::Add(const stSTATS& other)
+{
+	for (int i = 0; i < STAT_COUNTER_MAX; i++)
+	{
+		Count((STAT_COUNTER)i, other.Get((STAT_COUNTER)i));
+	}
+	for (int i = 0; i < STATS_ERROR_CODES; i++)
+	{
+		uint64_t nCount = other.errorCodes[i].nCount.load(std::memory_order_acquire);
+		if (nCount == 0)
+		{
+			break;
+		}
+		int nCode = other.errorCodes[i].nCode.load(std::memory_order_relaxed);
+		for (int j = 0; j < STATS_ERROR_CODES; j++)
+		{
+			stERRORCODE& entry = errorCodes[j];
+			uint64_t nOwn = entry.nCount.load(std::memory_order_relaxed);
+			if (nOwn == 0)
+			{
+				entry.nCode.store(nCode, std::memory_order_relaxed);
+				entry.nCount.store(nCount, std::memory_order_release);
+				break;
+			}
+			if (entry.nCode.load(std::memory_order_relaxed) == nCode)
+			{
+				entry.nCount.store(nOwn + nCount, std::memory_order_relaxed);
+				break;
+			}
+		}
+	}
+	latency.Add(other.latency);
+	batch.Add(other.batch);
+	sendDepth.Add(other.sendDepth);
+}
+
+void FormatHistogram(std::string& text, const char* pName, const Histogram& histogram, double dUnit)
+{
+	char line[256];
+	snprintf(line, sizeof(line), "%s count %llu mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+		pName, (unsigned long long)histogram.GetCount(), histogram.GetMean() / dUnit,
+		histogram.GetPercentile(50.0) / dUnit, histogram.GetPercentile(90.0) / dUnit,
+		histogram.GetPercentile(99.0) / dUnit, histogram.GetPercentile(99.9) / dUnit,
+		histogram.GetMax() / dUnit);
+	text += line;
+}
+
+void FormatStats(std::string& text, const stSTATS& stats, const char* pPrefix)
+{
+	char line[128];
+	int64_t nConnections = (int64_t)(stats.Get(STAT_OPENED) - stats.Get(STAT_CLOSED));
+	int64_t nSendsInFlight = (int64_t)(stats.Get(STAT_SENDS_POSTED) - stats.Get(STAT_SENDS_DONE));
+
+	if (pPrefix)
+	{
+		text += pPrefix;
+		for (int i = 0; i < STAT_COUNTER_MAX; i++)
+		{
+			snprintf(line, sizeof(line), " %s %llu", c_counterNames[i], (unsigned long long)stats.Get((STAT_COUNTER)i));
+			text += line;
+		}
+		snprintf(line, sizeof(line), " connections %lld sends_in_flight %lld\n",
+			(long long)nConnections, (long long)nSendsInFlight);
+		text += line;
+		return;
+	}
+
+	for (int i = 0; i < STAT_COUNTER_MAX; i++)
+	{
+		snprintf(line, sizeof(line), "%s %llu\n", c_counterNames[i], (unsigned long long)stats.Get((STAT_COUNTER)i));
+		text += line;
+	}
+	snprintf(line, sizeof(line), "connections %lld\nsends_in_flight %lld\n",
+		(long long)nConnections, (long long)nSendsInFlight);
+	text += line;
+	for (int i = 0; i < STATS_ERROR_CODES; i++)
+	{
+		uint64_t nCount = stats.errorCodes[i].nCount.load(std::memory_order_acquire);
+		if (nCount == 0)
+		{
+			break;
+		}
+		snprintf(line, sizeof(line), "error_code %d %llu\n",
+			stats.errorCodes[i].nCode.load(std::memory_order_relaxed), (unsigned long long)nCount);
+		text += line;
+	}
+	FormatHistogram(text, "latency_us", stats.latency, 1000.0);
+	FormatHistogram(text, "batch", stats.batch, 1.0);
+	FormatHistogram(text, "send_depth", stats.sendDepth, 1.0);
+}
+
+bool WriteStatsFile(const char* pPath, const std::string& text)
+{
+	std::string temporary = std::string(pPath) + ".tmp";
+	FILE* pFile = NULL;
+#ifdef _WIN32
+	fopen_s(&pFile, temporary.c_str(), "wb");
+#else
+	pFile = fopen(temporary.c_str(), "wb");
+#endif
+	if (pFile == NULL)
+	{
+		return false;
+	}
+	bool bWritten = fwrite(text.data(), 1, text.size(), pFile) == text.size();
+	bWritten = (fclose(pFile) == 0) && bWritten;
+	if (!bWritten)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+#ifdef _WIN32
+	return MoveFileExA(temporary.c_str(), pPath, MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+	return rename(temporary.c_str(), pPath) == 0;
+#endif
+}
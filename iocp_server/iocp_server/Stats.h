@@ -0,0 +1,115 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+// Sub-buckets per power of two; values are kept to within 1/32 (about 3%)
+#define HISTOGRAM_SUB_BITS		5
+#define HISTOGRAM_BUCKETS		((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+// System error codes counted one by one; the rest only by the operation that failed
+#define STATS_ERROR_CODES		16
+
+// Monotonic counters; gauges are the difference of two of them
+enum STAT_COUNTER
+{
+	STAT_ACCEPTS,				// Connections accepted
+	STAT_OPENED,				// Connections that got a context
+	STAT_CLOSED,				// Contexts released (open connections = opened - closed)
+	STAT_BYTES_IN,
+	STAT_BYTES_OUT,
+	STAT_MESSAGES_IN,			// Whole frames received
+	STAT_MESSAGES_OUT,			// Frames sent
+	STAT_SENDS_POSTED,
+	STAT_SENDS_DONE,			// Sends in flight = posted - done
+	STAT_RECV_PAUSED,			// Receives held back while a connection had too much queued
+	STAT_ERRORS_ACCEPT,
+	STAT_ERRORS_RECV,
+	STAT_ERRORS_SEND,
+	STAT_ERRORS_FRAME,			// Malformed or oversized frames
+	STAT_ERRORS_LIMIT,			// Connections refused at the connection limit
+	STAT_ERRORS_MEMORY,			// Buffer allocation failures
+	STAT_ERRORS_TIMEOUT,		// Connections closed for an idle, read or write timeout
+	STAT_COUNTER_MAX,
+};
+
+// Nanoseconds on a monotonic clock
+int64_t StatsNow();
+
+/**
+ * HDR-style histogram: exact below 2^HISTOGRAM_SUB_BITS, then 2^HISTOGRAM_SUB_BITS
+ * linear sub-buckets per power of two, so any 64-bit value is recorded with a bounded
+ * relative error in a fixed array, with no allocation and no search.
+ *
+ * Record() has a single writer; the counts are atomics so that another thread can read
+ * or merge them while it runs, at the cost of seeing a recording half done.
+ */
+class Histogram
+{
+public:
+	Histogram();
+
+	// Count one value; only the owning thread calls this
+	void Record(uint64_t nValue);
+	// Add another histogram's counts to this one
+	void Add(const Histogram& other);
+	void Reset();
+
+	uint64_t GetCount() const { return m_nCount.load(std::memory_order_relaxed); }
+	uint64_t GetMax() const { return m_nMax.load(std::memory_order_relaxed); }
+	double GetMean() const;
+	// Highest value of the bucket holding the given percentile, 0 when empty
+	uint64_t GetPercentile(double dPercent) const;
+
+private:
+	static unsigned BucketOf(uint64_t nValue);
+	static uint64_t BucketHighest(unsigned nBucket);
+
+	std::atomic<uint64_t> m_counts[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> m_nCount;
+	std::atomic<uint64_t> m_nSum;
+	std::atomic<uint64_t> m_nMax;
+};
+
+/**
+ * Counters of one thread, on cache lines of their own so that threads counting side
+ * by side do not false share. Each is updated by its thread alone, with plain loads
+ * and stores rather than locked instructions; readers sum the threads' stats on demand.
+ */
+struct alignas(64) stSTATS
+{
+	// A failure's system error code and how often it was seen
+	struct stERRORCODE
+	{
+		std::atomic<int>	nCode;
+		std::atomic<uint64_t> nCount;	// 0 while the entry is unused
+	};
+
+	std::atomic<uint64_t> counters[STAT_COUNTER_MAX];
+	stERRORCODE		errorCodes[STATS_ERROR_CODES];
+	Histogram		latency;			// Nanoseconds from a request's receive completion to its reply's send completion
+	Histogram		batch;				// Completions harvested per wakeup
+	Histogram		sendDepth;			// Sends a connection had in flight when another one was posted
+
+	stSTATS();
+
+	void Count(STAT_COUNTER counter, uint64_t nAmount = 1)
+	{
+		counters[counter].store(counters[counter].load(std::memory_order_relaxed) + nAmount, std::memory_order_relaxed);
+	}
+	// Count a failure under its counter and its system error code
+	void CountError(STAT_COUNTER counter, int nCode);
+	uint64_t Get(STAT_COUNTER counter) const { return counters[counter].load(std::memory_order_relaxed); }
+
+	// Add another thread's stats to these
+	void Add(const stSTATS& other);
+	void Reset();
+};
+
+// Append "name count N mean M p50 ... max X" for a histogram, values divided by dUnit
+void FormatHistogram(std::string& text, const char* pName, const Histogram& histogram, double dUnit);
+// Append the stats as text, a "name value..." line each. With a prefix (one thread's
+// stats) the counters go on a single line that starts with it, without the histograms.
+void FormatStats(std::string& text, const stSTATS& stats, const char* pPrefix = NULL);
+// Replace the file with the text in one step, so readers never see it half written
+bool WriteStatsFile(const char* pPath, const std::string& text);
@@ -0,0 +1,220 @@
+#include "stdafx.h"
+#include "Platform.h"
+#include "TimerWheel.h"
+
+#include <chrono>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define TIMER_ROOT_MASK		(TIMER_ROOT_SLOTS - 1)
+#define TIMER_LEVEL_MASK	(TIMER_LEVEL_SLOTS - 1)
+// Ticks ahead the wheel can hold; later deadlines are clamped to its end
+#define TIMER_RANGE_BITS	(TIMER_ROOT_BITS + (TIMER_LEVELS - 1) * TIMER_LEVEL_BITS)
+
+// Position of the lowest set bit; nValue is not 0
+static unsigned LowestBit(uint64_t nValue)
+{
+#ifdef _MSC_VER
+	unsigned long nBit;
+	_BitScanForward64(&nBit, nValue);
+	return (unsigned)nBit;
+#else
+	return (unsigned)__builtin_ctzll(nValue);
+#endif
+}
+
+TimerWheel::TimerWheel()
+{
+	for (stTIMER& head : m_slots)
+	{
+		head.pNext = &head;
+		head.pPrev = &head;
+	}
+	for (uint64_t& nWord : m_rootUsed)
+	{
+		nWord = 0;
+	}
+	m_nTick = (uint64_t)Now() / TIMER_TICK_MS;
+	m_nTimers = 0;
+}
+
+int64_t TimerWheel::Now()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TimerWheel::InitTimer(stTIMER* pTimer, void* pContext)
+{
+	pTimer->pNext = NULL;
+	pTimer->pPrev = NULL;
+	pTimer->nExpires = 0;
+	pTimer->nSlot = 0;
+	pTimer->pContext = pContext;
+}
+
+void TimerWheel::Schedule(stTIMER* pTimer, int64_t nDeadlineMs)
+{
+	if (IsArmed(pTimer))
+	{
+		Cancel(pTimer);
+	}
+	// Rounded up, so a timer never fires before its deadline.
+	pTimer->nExpires = (nDeadlineMs > 0) ? ((uint64_t)nDeadlineMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS : 0;
+	Insert(pTimer);
+	m_nTimers++;
+}
+
+void TimerWheel::Cancel(stTIMER* pTimer)
+{
+	if (!IsArmed(pTimer))
+	{
+		return;
+	}
+	pTimer->pPrev->pNext = pTimer->pNext;
+	pTimer->pNext->pPrev = pTimer->pPrev;
+	unsigned nSlot = pTimer->nSlot;
+	if (nSlot < TIMER_ROOT_SLOTS && m_slots[nSlot].pNext == &m_slots[nSlot])
+	{
+		m_rootUsed[nSlot / 64] &= ~((uint64_t)1 << (nSlot % 64));
+	}
+	pTimer->pNext = NULL;
+	pTimer->pPrev = NULL;
+	m_nTimers--;
+}
+
+void TimerWheel::Insert(stTIMER* pTimer)
+{
+	if (pTimer->nExpires < m_nTick)
+	{
+		pTimer->nExpires = m_nTick;
+	}
+	uint64_t nDelta = pTimer->nExpires - m_nTick;
+	if (nDelta >= ((uint64_t)1 << TIMER_RANGE_BITS))
+	{
+		// Fires at the end of the range; the owner finds it early and arms it again.
+		nDelta = ((uint64_t)1 << TIMER_RANGE_BITS) - 1;
+		pTimer->nExpires = m_nTick + nDelta;
+	}
+
+	unsigned nSlot;
+	if (nDelta < TIMER_ROOT_SLOTS)
+	{
+		nSlot = (unsigned)(pTimer->nExpires & TIMER_ROOT_MASK);
+		m_rootUsed[nSlot / 64] |= (uint64_t)1 << (nSlot % 64);
+	}
+	else
+	{
+		// The coarsest level whose slots span the distance, indexed by the tick's bits
+		// of that level.
+		unsigned nLevel = 1;
+		unsigned nShift = TIMER_ROOT_BITS;
+		while (nDelta >= ((uint64_t)1 << (nShift + TIMER_LEVEL_BITS)))
+		{
+			nLevel++;
+			nShift += TIMER_LEVEL_BITS;
+		}
+		nSlot = TIMER_ROOT_SLOTS + (nLevel - 1) * TIMER_LEVEL_SLOTS +
+			(unsigned)((pTimer->nExpires >> nShift) & TIMER_LEVEL_MASK);
+	}
+
+	stTIMER& head = m_slots[nSlot];
+	pTimer->nSlot = nSlot;
+	pTimer->pPrev = head.pPrev;
+	pTimer->pNext = &head;
+	head.pPrev->pNext = pTimer;
+	head.pPrev = pTimer;
+}
+
+void TimerWheel::Cascade(unsigned nSlot)
+{
+	stTIMER& head = m_slots[nSlot];
+	stTIMER* pTimer = head.pNext;
+	head.pNext = &head;
+	head.pPrev = &head;
+	while (pTimer != &head)
+	{
+		stTIMER* pNext = pTimer->pNext;
+		Insert(pTimer);
+		pTimer = pNext;
+	}
+}
+
+unsigned TimerWheel::NextRootSlot(unsigned nIndex) const
+{
+	unsigned nWord = nIndex / 64;
+	uint64_t nBits = m_rootUsed[nWord] & (~(uint64_t)0 << (nIndex % 64));
+	while (nBits == 0 && ++nWord < TIMER_ROOT_SLOTS / 64)
+	{
+		nBits = m_rootUsed[nWord];
+	}
+	return nBits ? nWord * 64 + LowestBit(nBits) : TIMER_ROOT_SLOTS;
+}
+
+void TimerWheel::Advance(int64_t nNowMs, std::vector<stTIMER*>& expired)
+{
+	uint64_t nNowTick = (nNowMs > 0) ? (uint64_t)nNowMs / TIMER_TICK_MS : 0;
+	while (m_nTick <= nNowTick)
+	{
+		if (m_nTimers == 0)
+		{
+			m_nTick = nNowTick + 1;
+			break;
+		}
+
+		unsigned nIndex = (unsigned)(m_nTick & TIMER_ROOT_MASK);
+		if (nIndex == 0)
+		{
+			// The first level has gone round: bring the next slot of each coarser level
+			// one level down, as far as the levels below it have gone round too.
+			unsigned nShift = TIMER_ROOT_BITS;
+			for (unsigned nLevel = 1; nLevel < TIMER_LEVELS; nLevel++)
+			{
+				unsigned nLevelIndex = (unsigned)((m_nTick >> nShift) & TIMER_LEVEL_MASK);
+				Cascade(TIMER_ROOT_SLOTS + (nLevel - 1) * TIMER_LEVEL_SLOTS + nLevelIndex);
+				if (nLevelIndex != 0)
+				{
+					break;
+				}
+				nShift += TIMER_LEVEL_BITS;
+			}
+		}
+
+		stTIMER& head = m_slots[nIndex];
+		while (head.pNext != &head)
+		{
+			stTIMER* pTimer = head.pNext;
+			Cancel(pTimer);
+			expired.push_back(pTimer);
+		}
+
+		// Empty slots up to the next one in use (or the next cascade) are skipped.
+		m_nTick++;
+		nIndex = (unsigned)(m_nTick & TIMER_ROOT_MASK);
+		if (nIndex != 0)
+		{
+			uint64_t nNextTick = m_nTick - nIndex + NextRootSlot(nIndex);
+			m_nTick = (nNextTick < nNowTick + 1) ? nNextTick : nNowTick + 1;
+		}
+	}
+}
+
+uint32_t TimerWheel::GetTimeout(int64_t nNowMs) const
+{
+	if (m_nTimers == 0)
+	{
+		return INFINITE;
+	}
+
+	// The next slot in use, or the next cascade, which may bring timers into the first
+	// level; at index 0 the cascade is still ahead.
+	unsigned nIndex = (unsigned)(m_nTick & TIMER_ROOT_MASK);
+	unsigned nNext = (nIndex == 0) ? 0 : NextRootSlot(nIndex);
+	int64_t nDueMs = (int64_t)(m_nTick - nIndex + nNext) * TIMER_TICK_MS;
+	if (nDueMs <= nNowMs)
+	{
+		return 0;
+	}
+	return (nDueMs - nNowMs < (int64_t)INFINITE) ? (uint32_t)(nDueMs - nNowMs) : INFINITE - 1;
+}
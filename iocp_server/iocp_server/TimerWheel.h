@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+
+#include <vector>
+
+#define TIMER_TICK_MS		10		// Resolution of the wheel
+#define TIMER_ROOT_BITS		8		// Slots of the first level, one tick each
+#define TIMER_LEVEL_BITS	6		// Slots of each coarser level
+#define TIMER_LEVELS		4		// 2.56s, 164s, 2.9h and 7.7 days of range at 10ms ticks
+
+#define TIMER_ROOT_SLOTS	(1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SLOTS	(1 << TIMER_LEVEL_BITS)
+
+// Embedded in the object it times; a wheel never allocates
+struct stTIMER
+{
+	stTIMER*		pNext;				// Links in the slot list, NULL while not armed
+	stTIMER*		pPrev;
+	uint64_t		nExpires;			// Tick the timer is due at
+	unsigned		nSlot;				// Slot list it is on
+	void*			pContext;			// Owner, for whoever handles the expiry
+};
+
+/**
+ * Hierarchical timer wheel: timers due within TIMER_ROOT_SLOTS ticks sit in the slot of
+ * their tick; later ones sit in a slot of a coarser level and are redistributed
+ * (cascaded) one level down each time the level below has gone round once. Arming and
+ * cancelling are a list insert and unlink, and advancing touches only the slots of the
+ * ticks that went by, so the cost does not depend on how many timers there are.
+ *
+ * Not thread-safe; times are milliseconds on the Now() clock.
+ */
+class TimerWheel
+{
+public:
+	TimerWheel();
+
+	// Milliseconds on a monotonic clock
+	static int64_t Now();
+	static void InitTimer(stTIMER* pTimer, void* pContext);
+	static bool IsArmed(const stTIMER* pTimer) { return pTimer->pNext != NULL; }
+
+	// Arm the timer for the deadline, moving it if it is armed already; a deadline in
+	// the past expires on the next Advance()
+	void Schedule(stTIMER* pTimer, int64_t nDeadlineMs);
+	// Disarm the timer; does nothing if it is not armed
+	void Cancel(stTIMER* pTimer);
+	// Move the wheel up to nNowMs, appending the timers that came due (disarmed) to expired
+	void Advance(int64_t nNowMs, std::vector<stTIMER*>& expired);
+	// How long a caller may wait before the next Advance() has work, 0xFFFFFFFF
+	// (INFINITE) when no timer is armed
+	uint32_t GetTimeout(int64_t nNowMs) const;
+
+	unsigned GetCount() const { return m_nTimers; }
+
+private:
+	// Put an unarmed timer in the slot for its tick
+	void Insert(stTIMER* pTimer);
+	// Re-insert the timers of a coarser slot, which now fall within the levels below
+	void Cascade(unsigned nSlot);
+	// First slot in use of the first level from nIndex on, TIMER_ROOT_SLOTS if none
+	unsigned NextRootSlot(unsigned nIndex) const;
+
+	stTIMER			m_slots[TIMER_ROOT_SLOTS + (TIMER_LEVELS - 1) * TIMER_LEVEL_SLOTS];	// List heads
+	uint64_t		m_rootUsed[TIMER_ROOT_SLOTS / 64];	// Bit per first level slot with timers
+	uint64_t		m_nTick;			// Next tick to process
+	unsigned		m_nTimers;
+};
@@ -0,0 +1,625 @@
+#include "stdafx.h"
+#include "IOCompletionPort.h"
+#include "UringCompletionQueue.h"
+#include "Log.h"
+
+#ifdef __linux__
+#include <stdint.h>
+
+#include <algorithm>
+
+// Buffer group id of the provided-buffer ring
+static const int c_bufferGroup = 0;
+// The kernel caps provided-buffer rings at 32768 entries
+static const unsigned c_maxBuffers = 32768;
+// CQEs peeked from the completion ring at a time
+static const int c_maxPeek = 64;
+// Pause before accepting again after running out of descriptors
+static const int c_acceptRetryMs = 100;
+// Low bits of user_data carry the operation, the top 16 bits the socket info generation
+// (user-space pointers fit in 48 bits), the rest is a pointer
+static const uint64_t c_operationMask = 7;
+static const int c_generationShift = 48;
+static const uint64_t c_pointerMask = ((1ull << c_generationShift) - 1) & ~c_operationMask;
+// Operation of the cancel SQEs StopRecv() submits, past the IO_OPERATION values
+static const uint64_t c_cancelOperation = 3;
+
+static inline uint64_t EncodeUserData(void* pObject, IO_OPERATION operation, unsigned short nGeneration)
+{
+	return ((uint64_t)nGeneration << c_generationShift) | (uint64_t)(uintptr_t)pObject | (uint64_t)operation;
+}
+
+UringCompletionQueue::UringCompletionQueue(const stSERVERCONFIG& config)
+{
+	m_nQueueDepth = config.nQueueDepth;
+	m_nBuffers = 1;
+	while (m_nBuffers < config.nRecvBuffers && m_nBuffers < c_maxBuffers)
+	{
+		m_nBuffers <<= 1;
+	}
+	m_nBufferSize = config.nBufferSize;
+	m_nZeroCopyThreshold = config.nZeroCopyThreshold;
+	m_bCreated = false;
+	m_bMultishot = true;
+	m_bMultishotAccept = true;
+	m_listenSocket = INVALID_SOCKET;
+	m_nAccepts = config.nAcceptsInFlight > 0 ? config.nAcceptsInFlight : 1;
+	m_acceptRetry.tv_sec = 0;
+	m_acceptRetry.tv_nsec = c_acceptRetryMs * 1000000LL;
+	m_bBuffersReturned = false;
+	m_nBuffersOut = 0;
+	m_bWoken = false;
+	m_pBufferRing = NULL;
+	m_pBufferMemory = NULL;
+}
+
+
+UringCompletionQueue::~UringCompletionQueue()
+{
+	Close();
+}
+
+bool UringCompletionQueue::Create()
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	// Keep submitting the rest of a batch when one SQE fails inline.
+	params.flags = IORING_SETUP_SUBMIT_ALL;
+
+	int nResult = io_uring_queue_init_params(m_nQueueDepth, &m_ring, &params);
+	if (nResult < 0)
+	{
+		memset(&params, 0, sizeof(params));
+		nResult = io_uring_queue_init_params(m_nQueueDepth, &m_ring, &params);
+	}
+	if (nResult < 0)
+	{
+		LOG_ERROR("io_uring setup failure : %d", nResult);
+		return false;
+	}
+	m_bCreated = true;
+
+	m_pBufferRing = io_uring_setup_buf_ring(&m_ring, m_nBuffers, c_bufferGroup, 0, &nResult);
+	if (m_pBufferRing == NULL)
+	{
+		LOG_ERROR("io_uring buffer ring registration failure : %d", nResult);
+		return false;
+	}
+
+	m_pBufferMemory = new char[(size_t)m_nBuffers * m_nBufferSize];
+	for (unsigned i = 0; i < m_nBuffers; i++)
+	{
+		io_uring_buf_ring_add(m_pBufferRing, m_pBufferMemory + (size_t)i * m_nBufferSize, m_nBufferSize,
+			i, io_uring_buf_ring_mask(m_nBuffers), i);
+	}
+	io_uring_buf_ring_advance(m_pBufferRing, m_nBuffers);
+	return true;
+}
+
+void UringCompletionQueue::Close()
+{
+	if (!m_bCreated)
+	{
+		return;
+	}
+	if (m_pBufferRing)
+	{
+		io_uring_free_buf_ring(&m_ring, m_pBufferRing, m_nBuffers, c_bufferGroup);
+		m_pBufferRing = NULL;
+	}
+	io_uring_queue_exit(&m_ring);
+	delete[] m_pBufferMemory;
+	m_pBufferMemory = NULL;
+	m_bCreated = false;
+}
+
+io_uring_sqe* UringCompletionQueue::GetSqe()
+{
+	io_uring_sqe* pSqe = io_uring_get_sqe(&m_ring);
+	while (pSqe == NULL)
+	{
+		io_uring_submit(&m_ring);
+		pSqe = io_uring_get_sqe(&m_ring);
+	}
+	return pSqe;
+}
+
+void UringCompletionQueue::SubmitIfForeign()
+{
+	if (std::this_thread::get_id() != m_ownerThread)
+	{
+		io_uring_submit(&m_ring);
+	}
+}
+
+bool UringCompletionQueue::PrepareRecv(stSOCKETINFO* pSocketInfo)
+{
+	io_uring_sqe* pSqe = GetSqe();
+	if (m_bMultishot)
+	{
+		io_uring_prep_recv_multishot(pSqe, pSocketInfo->socket, NULL, 0, 0);
+	}
+	else
+	{
+		io_uring_prep_recv(pSqe, pSocketInfo->socket, NULL, m_nBufferSize, 0);
+	}
+	pSqe->flags |= IOSQE_BUFFER_SELECT;
+	pSqe->buf_group = c_bufferGroup;
+	io_uring_sqe_set_data64(pSqe, EncodeUserData(pSocketInfo, IO_RECV, pSocketInfo->nGeneration));
+	return true;
+}
+
+void UringCompletionQueue::PrepareAccept()
+{
+	io_uring_sqe* pSqe = GetSqe();
+	if (m_bMultishotAccept)
+	{
+		io_uring_prep_multishot_accept(pSqe, m_listenSocket, NULL, NULL, SOCK_CLOEXEC);
+	}
+	else
+	{
+		io_uring_prep_accept(pSqe, m_listenSocket, NULL, NULL, SOCK_CLOEXEC);
+	}
+	io_uring_sqe_set_data64(pSqe, EncodeUserData(NULL, IO_ACCEPT, 0));
+}
+
+bool UringCompletionQueue::PrepareSend(stSENDREQUEST* pRequest)
+{
+	io_uring_sqe* pSqe = GetSqe();
+	if (pRequest->bZeroCopy)
+	{
+		io_uring_prep_send_zc(pSqe, pRequest->pSocketInfo->socket, pRequest->pBuffer + pRequest->nOffset,
+			pRequest->nLength - pRequest->nOffset, MSG_NOSIGNAL, 0);
+	}
+	else
+	{
+		io_uring_prep_send(pSqe, pRequest->pSocketInfo->socket, pRequest->pBuffer + pRequest->nOffset,
+			pRequest->nLength - pRequest->nOffset, MSG_NOSIGNAL);
+	}
+	io_uring_sqe_set_data64(pSqe, EncodeUserData(pRequest, IO_SEND, pRequest->nGeneration));
+	return true;
+}
+
+bool UringCompletionQueue::StartAccept(SOCKET listenSocket)
+{
+	std::lock_guard<std::mutex> lock(m_submitLock);
+	m_listenSocket = listenSocket;
+	PrepareAccept();
+	SubmitIfForeign();
+	return true;
+}
+
+bool UringCompletionQueue::StopAccept()
+{
+	std::lock_guard<std::mutex> lock(m_submitLock);
+	if (m_listenSocket == INVALID_SOCKET)
+	{
+		return false;
+	}
+	m_listenSocket = INVALID_SOCKET;
+	return true;
+}
+
+void UringCompletionQueue::Wake()
+{
+	// user_data 0 would be a receive on no socket, so it is free to mean a wake-up.
+	std::lock_guard<std::mutex> lock(m_submitLock);
+	io_uring_sqe* pSqe = GetSqe();
+	io_uring_prep_nop(pSqe);
+	io_uring_sqe_set_data64(pSqe, 0);
+	SubmitIfForeign();
+}
+
+bool UringCompletionQueue::PostRecv(stSOCKETINFO* pSocketInfo)
+{
+	std::lock_guard<std::mutex> lock(m_submitLock);
+	PrepareRecv(pSocketInfo);
+	SubmitIfForeign();
+	return true;
+}
+
+void UringCompletionQueue::StopRecv(stSOCKETINFO* pSocketInfo)
+{
+	std::lock_guard<std::mutex> lock(m_submitLock);
+
+	// A parked receive has no SQE in the kernel to cancel.
+	if (Unpark(pSocketInfo))
+	{
+		Complete(pSocketInfo, IO_RECV, -ECANCELED);
+		return;
+	}
+
+	// The receive ends with -ECANCELED, or normally if it was finishing anyway.
+	io_uring_sqe* pSqe = GetSqe();
+	io_uring_prep_cancel64(pSqe, EncodeUserData(pSocketInfo, IO_RECV, pSocketInfo->nGeneration), 0);
+	io_uring_sqe_set_data64(pSqe, EncodeUserData(pSocketInfo, (IO_OPERATION)c_cancelOperation, pSocketInfo->nGeneration));
+	SubmitIfForeign();
+}
+
+void UringCompletionQueue::TranslateStop(int nResult, stSOCKETINFO* pSocketInfo, unsigned short nGeneration)
+{
+	if (nResult >= 0 || nGeneration != pSocketInfo->nGeneration || pSocketInfo->bClosing)
+	{
+		return;
+	}
+	if (Unpark(pSocketInfo))
+	{
+		// Parked for want of buffers after the cancel went out.
+		Complete(pSocketInfo, IO_RECV, -ECANCELED);
+		return;
+	}
+	// Missed the receive between two of its runs; the server asks again with its next
+	// completion.
+	pSocketInfo->bRecvStopping = false;
+}
+
+bool UringCompletionQueue::Unpark(stSOCKETINFO* pSocketInfo)
+{
+	for (size_t i = 0; i < m_starved.size(); i++)
+	{
+		if (m_starved[i] == pSocketInfo)
+		{
+			m_starved.erase(m_starved.begin() + i);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool UringCompletionQueue::PostSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength)
+{
+	stSENDREQUEST* pRequest = NewSendRequest(pSocketInfo, pBuffer, nLength);
+	// Below the threshold pinning and notifying costs more than the copy it saves.
+	pRequest->bZeroCopy = m_nZeroCopyThreshold > 0 && (unsigned)nLength >= m_nZeroCopyThreshold;
+
+	// Two sends in flight on one stream may interleave, so later ones wait in the chain.
+	if (pSocketInfo->pSendTail)
+	{
+		pSocketInfo->pSendTail->pNext = pRequest;
+		pSocketInfo->pSendTail = pRequest;
+		return true;
+	}
+	pSocketInfo->pSendHead = pRequest;
+	pSocketInfo->pSendTail = pRequest;
+
+	std::lock_guard<std::mutex> lock(m_submitLock);
+	PrepareSend(pRequest);
+	SubmitIfForeign();
+	return true;
+}
+
+void UringCompletionQueue::ReleaseBuffer(int nBufferId)
+{
+	if (nBufferId < 0)
+	{
+		return;
+	}
+	io_uring_buf_ring_add(m_pBufferRing, m_pBufferMemory + (size_t)nBufferId * m_nBufferSize, m_nBufferSize,
+		nBufferId, io_uring_buf_ring_mask(m_nBuffers), 0);
+	io_uring_buf_ring_advance(m_pBufferRing, 1);
+	m_nBuffersOut--;
+	m_bBuffersReturned = true;
+}
+
+void UringCompletionQueue::Complete(stSOCKETINFO* pSocketInfo, IO_OPERATION operation, int nResult, char* pBuffer)
+{
+	stCOMPLETION completion;
+	completion.pSocketInfo = pSocketInfo;
+	completion.operation = operation;
+	completion.nResult = nResult;
+	completion.pBuffer = pBuffer;
+	completion.nBufferId = -1;
+	completion.bMore = false;
+	completion.nGeneration = pSocketInfo->nGeneration;
+	m_completions.push_back(completion);
+}
+
+void UringCompletionQueue::CancelIo(stSOCKETINFO* pSocketInfo)
+{
+	std::lock_guard<std::mutex> lock(m_submitLock);
+
+	// SQEs prepared earlier in the batch may still name the descriptor; the kernel has to
+	// pick up the file before it is closed and the number handed out again.
+	io_uring_submit(&m_ring);
+
+	// A parked receive has no SQE in the kernel to fail.
+	if (Unpark(pSocketInfo))
+	{
+		Complete(pSocketInfo, IO_RECV, -ECANCELED);
+	}
+
+	// Only the head of the send chain is in flight; the rest must not be submitted
+	// once the descriptor is gone, since its number may already be reused.
+	stSENDREQUEST* pHead = pSocketInfo->pSendHead;
+	if (pHead == NULL)
+	{
+		return;
+	}
+	while (pHead->pNext)
+	{
+		stSENDREQUEST* pRequest = pHead->pNext;
+		pHead->pNext = pRequest->pNext;
+		Complete(pSocketInfo, IO_SEND, -ECANCELED, pRequest->pBuffer);
+		DeleteSendRequest(pRequest);
+	}
+	pSocketInfo->pSendTail = pHead;
+}
+
+bool UringCompletionQueue::TranslateCqe(io_uring_cqe* pCqe, stCOMPLETION& completion)
+{
+	uint64_t userData = io_uring_cqe_get_data64(pCqe);
+	if (userData == 0)
+	{
+		m_bWoken = true;
+		return false;
+	}
+	if ((userData & c_operationMask) == c_cancelOperation)
+	{
+		TranslateStop(pCqe->res, (stSOCKETINFO*)(uintptr_t)(userData & c_pointerMask),
+			(unsigned short)(userData >> c_generationShift));
+		return false;
+	}
+	IO_OPERATION operation = (IO_OPERATION)(userData & c_operationMask);
+	void* pObject = (void*)(uintptr_t)(userData & c_pointerMask);
+	completion.nGeneration = (unsigned short)(userData >> c_generationShift);
+
+	if (operation == IO_ACCEPT && m_listenSocket == INVALID_SOCKET)
+	{
+		// Accepting has stopped; the listener is being closed under this accept.
+		if (pObject == NULL && pCqe->res >= 0)
+		{
+			closesocket(pCqe->res);
+		}
+		return false;
+	}
+	if (operation == IO_ACCEPT && pObject != NULL)
+	{
+		// The pause after running out of descriptors is over.
+		std::lock_guard<std::mutex> lock(m_submitLock);
+		PrepareAccept();
+		return false;
+	}
+	if (operation == IO_ACCEPT)
+	{
+		bool bMore = (pCqe->flags & IORING_CQE_F_MORE) != 0;
+
+		if (pCqe->res == -EINVAL && m_bMultishotAccept && !bMore)
+		{
+			// Kernel predates multishot accept; keep a number of one-shot accepts posted.
+			m_bMultishotAccept = false;
+			std::lock_guard<std::mutex> lock(m_submitLock);
+			for (unsigned i = 0; i < m_nAccepts; i++)
+			{
+				PrepareAccept();
+			}
+			return false;
+		}
+		if (!bMore)
+		{
+			if (pCqe->res == -EMFILE || pCqe->res == -ENFILE)
+			{
+				// Re-arming now would only fail again; retry after a pause.
+				std::lock_guard<std::mutex> lock(m_submitLock);
+				io_uring_sqe* pSqe = GetSqe();
+				io_uring_prep_timeout(pSqe, &m_acceptRetry, 0, 0);
+				io_uring_sqe_set_data64(pSqe, EncodeUserData(&m_acceptRetry, IO_ACCEPT, 0));
+			}
+			else
+			{
+				std::lock_guard<std::mutex> lock(m_submitLock);
+				PrepareAccept();
+			}
+		}
+
+		completion.pSocketInfo = NULL;
+		completion.operation = IO_ACCEPT;
+		completion.nResult = pCqe->res;
+		completion.pBuffer = NULL;
+		completion.nBufferId = -1;
+		completion.bMore = false;
+		return true;
+	}
+
+	if (operation == IO_RECV)
+	{
+		stSOCKETINFO* pSocketInfo = (stSOCKETINFO*)pObject;
+		bool bMore = (pCqe->flags & IORING_CQE_F_MORE) != 0;
+
+		if (pCqe->res == -EINVAL && m_bMultishot && !bMore)
+		{
+			// Kernel predates multishot receive; fall back to one-shot receives.
+			m_bMultishot = false;
+			std::lock_guard<std::mutex> lock(m_submitLock);
+			PrepareRecv(pSocketInfo);
+			return false;
+		}
+		if (pCqe->res == -ENOBUFS)
+		{
+			// The ring ran dry; re-arm once a buffer comes back. Buffers may already have
+			// been returned between the kernel running out and this CQE, and then no
+			// further release would wake the receive.
+			if (!bMore)
+			{
+				m_starved.push_back(pSocketInfo);
+				if (m_nBuffersOut < m_nBuffers)
+				{
+					m_bBuffersReturned = true;
+				}
+			}
+			return false;
+		}
+
+		completion.pSocketInfo = pSocketInfo;
+		completion.operation = IO_RECV;
+		completion.nResult = pCqe->res;
+		completion.bMore = bMore;
+		if (pCqe->res > 0 && (pCqe->flags & IORING_CQE_F_BUFFER))
+		{
+			completion.nBufferId = pCqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			completion.pBuffer = m_pBufferMemory + (size_t)completion.nBufferId * m_nBufferSize;
+			m_nBuffersOut++;
+		}
+		else
+		{
+			completion.nBufferId = -1;
+			completion.pBuffer = NULL;
+		}
+		return true;
+	}
+
+	stSENDREQUEST* pRequest = (stSENDREQUEST*)pObject;
+
+	if (pCqe->flags & IORING_CQE_F_NOTIF)
+	{
+		// The kernel has let go of the data of one zero-copy send.
+		pRequest->nNotifications--;
+		return FinishSend(pRequest, completion);
+	}
+	if (pCqe->flags & IORING_CQE_F_MORE)
+	{
+		// A zero-copy send that went out; its notification follows separately.
+		pRequest->nNotifications++;
+	}
+
+	if (pRequest->bZeroCopy && pRequest->nOffset == 0 && (pCqe->res == -EINVAL || pCqe->res == -EOPNOTSUPP))
+	{
+		// Kernel or socket without zero-copy send; copy from now on.
+		m_nZeroCopyThreshold = 0;
+		pRequest->bZeroCopy = false;
+		std::lock_guard<std::mutex> lock(m_submitLock);
+		PrepareSend(pRequest);
+		return false;
+	}
+
+	if (pCqe->res > 0 && pRequest->nOffset + pCqe->res < pRequest->nLength)
+	{
+		// Short send, push the remainder.
+		pRequest->nOffset += pCqe->res;
+		std::lock_guard<std::mutex> lock(m_submitLock);
+		PrepareSend(pRequest);
+		return false;
+	}
+
+	pRequest->nResult = (pCqe->res < 0) ? pCqe->res : pRequest->nOffset + pCqe->res;
+	pRequest->bDone = true;
+	return FinishSend(pRequest, completion);
+}
+
+bool UringCompletionQueue::FinishSend(stSENDREQUEST* pRequest, stCOMPLETION& completion)
+{
+	if (!pRequest->bDone || pRequest->nNotifications > 0)
+	{
+		return false;
+	}
+
+	stSOCKETINFO* pSocketInfo = pRequest->pSocketInfo;
+	completion.pSocketInfo = pSocketInfo;
+	completion.operation = IO_SEND;
+	completion.nResult = pRequest->nResult;
+	completion.pBuffer = pRequest->pBuffer;
+	completion.nBufferId = -1;
+	completion.bMore = false;
+	completion.nGeneration = pRequest->nGeneration;
+
+	// Only now is the kernel done with the buffer, so the caller may recycle it.
+	pSocketInfo->pSendHead = pRequest->pNext;
+	if (pSocketInfo->pSendHead == NULL)
+	{
+		pSocketInfo->pSendTail = NULL;
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_submitLock);
+		PrepareSend(pSocketInfo->pSendHead);
+	}
+	DeleteSendRequest(pRequest);
+	return true;
+}
+
+int UringCompletionQueue::GetCompletions(stCOMPLETION* pCompletions, int nMax, DWORD timeoutMs)
+{
+	io_uring_cqe* cqes[c_maxPeek];
+
+	for (;;)
+	{
+		int nCount = 0;
+		{
+			std::lock_guard<std::mutex> lock(m_submitLock);
+			m_ownerThread = std::this_thread::get_id();
+
+			// Buffers have come back since a receive starved; try those again.
+			if (m_bBuffersReturned)
+			{
+				m_bBuffersReturned = false;
+				m_nextStarved.insert(m_nextStarved.end(), m_starved.begin(), m_starved.end());
+				m_starved.clear();
+			}
+			while (!m_nextStarved.empty())
+			{
+				PrepareRecv(m_nextStarved.back());
+				m_nextStarved.pop_back();
+			}
+
+			// One submission for everything queued while the last batch was handled.
+			io_uring_submit(&m_ring);
+
+			while (nCount < nMax && !m_completions.empty())
+			{
+				pCompletions[nCount++] = m_completions.back();
+				m_completions.pop_back();
+			}
+		}
+
+		// Take everything the kernel has already posted without entering it again.
+		bool bPeeked = false;
+		while (nCount < nMax)
+		{
+			unsigned nPeeked = io_uring_peek_batch_cqe(&m_ring, cqes, (unsigned)std::min(nMax - nCount, c_maxPeek));
+			if (nPeeked == 0)
+			{
+				break;
+			}
+			bPeeked = true;
+			for (unsigned i = 0; i < nPeeked; i++)
+			{
+				if (TranslateCqe(cqes[i], pCompletions[nCount]))
+				{
+					nCount++;
+				}
+			}
+			io_uring_cq_advance(&m_ring, nPeeked);
+		}
+		if (nCount > 0 || m_bWoken)
+		{
+			m_bWoken = false;
+			return nCount;
+		}
+		if (bPeeked)
+		{
+			// Every CQE was consumed internally and may have prepared SQEs; submit those
+			// before blocking.
+			continue;
+		}
+
+		// Nothing ready: block until the next CQE arrives and harvest from the top.
+		io_uring_cqe* pCqe = NULL;
+		int nResult;
+		if (timeoutMs == INFINITE)
+		{
+			nResult = io_uring_wait_cqe(&m_ring, &pCqe);
+		}
+		else
+		{
+			__kernel_timespec timeout;
+			timeout.tv_sec = timeoutMs / 1000;
+			timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+			nResult = io_uring_wait_cqe_timeout(&m_ring, &pCqe, &timeout);
+		}
+		if (nResult != 0 && nResult != -EINTR)
+		{
+			return 0;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+#include "CompletionQueue.h"
+
+#ifdef __linux__
+#include <liburing.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * CompletionQueue on top of io_uring. Each worker owns one ring.
+ *
+ * Receives are multishot and pick their memory from a provided-buffer ring, so a
+ * buffer is only consumed when data actually arrives. SQEs prepared by the owning
+ * worker are batched and submitted once per GetCompletions(); SQEs prepared by any
+ * other thread (the acceptor) are submitted right away.
+ *
+ * Sends go straight out of the caller's buffer, which comes back with the send
+ * completion. With a zero-copy threshold set, larger ones use IORING_OP_SEND_ZC, and
+ * the send only completes after the kernel's notification that it no longer
+ * references the data.
+ *
+ * Each ring accepts on its own listener with a multishot accept, or on older kernels
+ * with a number of one-shot accepts that are re-armed as they complete.
+ */
+class UringCompletionQueue : public CompletionQueue
+{
+public:
+	explicit UringCompletionQueue(const stSERVERCONFIG& config);
+	virtual ~UringCompletionQueue();
+
+	virtual bool Create() override;
+	virtual void Close() override;
+	virtual bool IsShared() const override { return false; }
+
+	virtual bool Associate(stSOCKETINFO* /* pSocketInfo */) override { return true; }
+	virtual bool PostRecv(stSOCKETINFO* pSocketInfo) override;
+	virtual void StopRecv(stSOCKETINFO* pSocketInfo) override;
+	virtual bool PostSend(stSOCKETINFO* pSocketInfo, char* pBuffer, int nLength) override;
+	virtual void ReleaseBuffer(int nBufferId) override;
+	virtual void CancelIo(stSOCKETINFO* pSocketInfo) override;
+	virtual bool StartAccept(SOCKET listenSocket) override;
+	virtual bool StopAccept() override;
+	virtual void Wake() override;
+
+	virtual int GetCompletions(stCOMPLETION* pCompletions, int nMax, DWORD timeoutMs) override;
+
+private:
+	// Get a free SQE, flushing the submission queue if it is full. Caller holds m_submitLock.
+	io_uring_sqe* GetSqe();
+	// Prepare the receive SQE for a socket. Caller holds m_submitLock.
+	bool PrepareRecv(stSOCKETINFO* pSocketInfo);
+	// Prepare an accept SQE on the listener. Caller holds m_submitLock.
+	void PrepareAccept();
+	// Prepare the send SQE for the request at the head of the socket's send chain.
+	bool PrepareSend(stSENDREQUEST* pRequest);
+	// Submit now unless the caller is the owning worker, which submits in batches.
+	void SubmitIfForeign();
+	// Turn a CQE into a completion; returns false when it is consumed internally.
+	bool TranslateCqe(io_uring_cqe* pCqe, stCOMPLETION& completion);
+	// Act on the result of a StopRecv() cancel
+	void TranslateStop(int nResult, stSOCKETINFO* pSocketInfo, unsigned short nGeneration);
+	// Take the socket's receive off the starved list; false if it is not parked
+	bool Unpark(stSOCKETINFO* pSocketInfo);
+	// Surface the send at the head of the chain once it is sent and no longer pinned
+	bool FinishSend(stSENDREQUEST* pRequest, stCOMPLETION& completion);
+	// Queue a completion that never reaches the kernel
+	void Complete(stSOCKETINFO* pSocketInfo, IO_OPERATION operation, int nResult, char* pBuffer = NULL);
+
+	unsigned		m_nQueueDepth;
+	unsigned		m_nBuffers;
+	unsigned		m_nBufferSize;
+	unsigned		m_nZeroCopyThreshold;	// 0 when zero-copy sends are off or unsupported
+	bool			m_bCreated;
+	bool			m_bMultishot;		// Kernel accepts multishot receives
+	bool			m_bMultishotAccept;	// Kernel accepts multishot accepts
+	SOCKET			m_listenSocket;		// This ring's listener, INVALID_SOCKET if none
+	unsigned		m_nAccepts;			// One-shot accepts kept in flight without multishot
+	__kernel_timespec m_acceptRetry;	// Pause before re-arming an accept that ran out of descriptors
+	io_uring		m_ring;
+	io_uring_buf_ring* m_pBufferRing;	// Provided buffers for receives
+	char*			m_pBufferMemory;	// m_nBuffers * m_nBufferSize bytes backing the ring
+	std::mutex		m_submitLock;		// Guards the submission queue
+	std::thread::id	m_ownerThread;		// Worker that harvests this ring
+	std::vector<stSOCKETINFO*> m_starved;	// Receives parked because the buffer ring ran dry
+	std::vector<stSOCKETINFO*> m_nextStarved;	// Parked receives being re-armed
+	bool			m_bBuffersReturned;	// A buffer went back to the ring since the last re-arm
+	unsigned		m_nBuffersOut;		// Buffers handed out with receive completions, not yet released
+	std::vector<stCOMPLETION> m_completions;	// Completions synthesized by CancelIo
+	bool			m_bWoken;			// A Wake() NOP was harvested
+};
+
+#endif
@@ -1,16 +1,196 @@
 ﻿// main.cpp: Define the entry point of the console application
 //
+// Usage: iocp_server [--engine=iocp|uring|epoll] [--threads=N] [--port=N] [--connections=N] [--buffers=N]
+//                    [--buffer-size=BYTES] [--zerocopy=BYTES] [--batch=N] [--backlog=N] [--accepts=N]
+//                    [--drain-timeout=MS] [--max-frame=BYTES] [--handler=echo|blocking-echo]
+//                    [--handler-threads=N] [--stats-file=PATH] [--stats-interval=MS] [--idle-timeout=MS]
+//                    [--read-timeout=MS] [--write-timeout=MS] [--high-water=BYTES] [--low-water=BYTES]
+//                    [--global-high-water=BYTES] [--global-low-water=BYTES] [--memory-budget=BYTES]
+//
+// Ctrl+C (SIGINT/SIGTERM on Linux) shuts the server down gracefully.
 
 #include "stdafx.h"
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <signal.h>
+#endif
 #include "IOCompletionPort.h"
+#include "Log.h"
+
+#ifdef _WIN32
+static IOCompletionPort* s_pServer = NULL;
+
+// Runs on a thread of its own, so it may block in Shutdown()
+static BOOL WINAPI ConsoleCtrlHandler(DWORD /* ctrlType */)
+{
+	s_pServer->Shutdown();
+	return TRUE;
+}
+#endif
 
-int main()
+int main(int argc, char* argv[])
 {
+	stSERVERCONFIG config;
+	bool bBlockingEcho = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--engine=iocp") == 0)
+		{
+			config.engine = ENGINE_IOCP;
+		}
+		else if (strcmp(argv[i], "--engine=uring") == 0)
+		{
+			config.engine = ENGINE_URING;
+		}
+		else if (strcmp(argv[i], "--engine=epoll") == 0)
+		{
+			config.engine = ENGINE_EPOLL;
+		}
+		else if (strncmp(argv[i], "--threads=", 10) == 0)
+		{
+			config.nWorkerThreads = atoi(argv[i] + 10);
+		}
+		else if (strncmp(argv[i], "--port=", 7) == 0)
+		{
+			config.nPort = (unsigned short)atoi(argv[i] + 7);
+		}
+		else if (strncmp(argv[i], "--connections=", 14) == 0)
+		{
+			config.nMaxConnections = (unsigned)atoi(argv[i] + 14);
+		}
+		else if (strncmp(argv[i], "--buffers=", 10) == 0)
+		{
+			config.nRecvBuffers = (unsigned)atoi(argv[i] + 10);
+		}
+		else if (strncmp(argv[i], "--buffer-size=", 14) == 0)
+		{
+			config.nBufferSize = (unsigned)atoi(argv[i] + 14);
+		}
+		else if (strncmp(argv[i], "--zerocopy=", 11) == 0)
+		{
+			config.nZeroCopyThreshold = (unsigned)atoi(argv[i] + 11);
+		}
+		else if (strncmp(argv[i], "--batch=", 8) == 0)
+		{
+			config.nCompletionBatch = (unsigned)atoi(argv[i] + 8);
+		}
+		else if (strncmp(argv[i], "--backlog=", 10) == 0)
+		{
+			config.nListenBacklog = atoi(argv[i] + 10);
+		}
+		else if (strncmp(argv[i], "--accepts=", 10) == 0)
+		{
+			config.nAcceptsInFlight = (unsigned)atoi(argv[i] + 10);
+		}
+		else if (strncmp(argv[i], "--drain-timeout=", 16) == 0)
+		{
+			config.nDrainTimeoutMs = (DWORD)atoi(argv[i] + 16);
+		}
+		else if (strncmp(argv[i], "--max-frame=", 12) == 0)
+		{
+			config.nMaxFrameSize = (unsigned)atoi(argv[i] + 12);
+		}
+		else if (strcmp(argv[i], "--handler=echo") == 0)
+		{
+			bBlockingEcho = false;
+		}
+		else if (strcmp(argv[i], "--handler=blocking-echo") == 0)
+		{
+			bBlockingEcho = true;
+		}
+		else if (strncmp(argv[i], "--handler-threads=", 18) == 0)
+		{
+			config.nHandlerThreads = atoi(argv[i] + 18);
+		}
+		else if (strncmp(argv[i], "--stats-file=", 13) == 0)
+		{
+			config.pStatsFile = argv[i] + 13;
+		}
+		else if (strncmp(argv[i], "--stats-interval=", 17) == 0)
+		{
+			config.nStatsIntervalMs = (DWORD)atoi(argv[i] + 17);
+		}
+		else if (strncmp(argv[i], "--idle-timeout=", 15) == 0)
+		{
+			config.nIdleTimeoutMs = (DWORD)atoi(argv[i] + 15);
+		}
+		else if (strncmp(argv[i], "--read-timeout=", 15) == 0)
+		{
+			config.nReadTimeoutMs = (DWORD)atoi(argv[i] + 15);
+		}
+		else if (strncmp(argv[i], "--write-timeout=", 16) == 0)
+		{
+			config.nWriteTimeoutMs = (DWORD)atoi(argv[i] + 16);
+		}
+		else if (strncmp(argv[i], "--high-water=", 13) == 0)
+		{
+			config.nHighWater = (unsigned)atoi(argv[i] + 13);
+		}
+		else if (strncmp(argv[i], "--low-water=", 12) == 0)
+		{
+			config.nLowWater = (unsigned)atoi(argv[i] + 12);
+		}
+		else if (strncmp(argv[i], "--global-high-water=", 20) == 0)
+		{
+			config.nGlobalHighWater = strtoull(argv[i] + 20, NULL, 10);
+		}
+		else if (strncmp(argv[i], "--global-low-water=", 19) == 0)
+		{
+			config.nGlobalLowWater = strtoull(argv[i] + 19, NULL, 10);
+		}
+		else if (strncmp(argv[i], "--memory-budget=", 16) == 0)
+		{
+			config.nMemoryBudget = strtoull(argv[i] + 16, NULL, 10);
+		}
+		else
+		{
+			printf_s("[ERROR] Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	// Declared first, so it outlives the server
+	EchoFrameHandler blockingEcho(true);
 	IOCompletionPort iocp_server;
-	if (iocp_server.Initialize())
+	if (bBlockingEcho)
+	{
+		iocp_server.SetFrameHandler(&blockingEcho);
+	}
+
+#ifdef _WIN32
+	s_pServer = &iocp_server;
+	SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+#else
+	// Blocked before any server thread exists, so only the signal thread receives them.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	std::thread signalThread([&]()
+	{
+		int nSignal = 0;
+		sigwait(&signals, &nSignal);
+		iocp_server.Shutdown();
+	});
+#endif
+
+	if (iocp_server.Initialize(config))
 	{
 		iocp_server.StartServer();
 	}
-	return 0;
-}
 
+#ifdef _WIN32
+	SetConsoleCtrlHandler(ConsoleCtrlHandler, FALSE);
+#else
+	// StartServer() may have failed without a signal; release the signal thread either way.
+	kill(getpid(), SIGTERM);
+	signalThread.join();
+#endif
+
+	// Log records are written by a background thread; let it catch up before exiting.
+	LogShutdown();
+	return 0;
+}
\ No newline at end of file
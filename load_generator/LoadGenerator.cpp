@@ -0,0 +1,549 @@
+#include "LoadGenerator.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+// Request frames kept back to back, so a send can take many at once
+static const unsigned c_framesBytes = 64 * 1024;
+// Events harvested per epoll_wait()
+static const int c_maxEvents = 256;
+// How long connecting may take before the run goes ahead without the stragglers
+static const int64_t c_connectTimeoutNs = 10 * 1000000000LL;
+
+// CPU seconds, user and system, the process has used; -1 if it cannot be read
+static double ProcessCpu(int nPid)
+{
+	if (nPid == 0)
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", nPid);
+	FILE* pFile = fopen(path, "r");
+	if (pFile == NULL)
+	{
+		return -1;
+	}
+	char text[1024];
+	size_t nLength = fread(text, 1, sizeof(text) - 1, pFile);
+	fclose(pFile);
+	text[nLength] = '\0';
+	// The command name may hold spaces and parentheses; the fields resume after the last ')'
+	const char* pFields = strrchr(text, ')');
+	unsigned long long nUser = 0;
+	unsigned long long nSystem = 0;
+	if (pFields == NULL ||
+		sscanf(pFields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &nUser, &nSystem) != 2)
+	{
+		return -1;
+	}
+	return (double)(nUser + nSystem) / sysconf(_SC_CLK_TCK);
+}
+
+LoadGenerator::LoadGenerator(const stLOADCONFIG& config)
+{
+	m_config = config;
+	m_nReady = 0;
+	m_bStart = false;
+	m_nMeasureStart = 0;
+	m_nEnd = 0;
+	memset(&m_address, 0, sizeof(m_address));
+
+	char header[FRAME_HEADER_MAX];
+	int nHeader = EncodeFrameHeader(header, config.nMessageSize);
+	m_nFrameSize = nHeader + config.nMessageSize;
+	unsigned nFrames = (std::max)(1u, c_framesBytes / m_nFrameSize);
+	m_frames.resize((size_t)nFrames * m_nFrameSize);
+	for (unsigned i = 0; i < nFrames; i++)
+	{
+		char* pFrame = &m_frames[(size_t)i * m_nFrameSize];
+		memcpy(pFrame, header, nHeader);
+		for (unsigned j = 0; j < config.nMessageSize; j++)
+		{
+			pFrame[nHeader + j] = (char)('a' + j % 26);
+		}
+	}
+}
+
+LoadGenerator::~LoadGenerator()
+{
+	for (stWORKER* pWorker : m_workers)
+	{
+		if (pWorker->thread.joinable())
+		{
+			pWorker->thread.join();
+		}
+		delete pWorker;
+	}
+}
+
+bool LoadGenerator::Run(stLOADRESULT& result)
+{
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* pAddress = NULL;
+	if (getaddrinfo(m_config.pHost, NULL, &hints, &pAddress) != 0 || pAddress == NULL)
+	{
+		fprintf(stderr, "[ERROR] Cannot resolve %s\n", m_config.pHost);
+		return false;
+	}
+	memcpy(&m_address, pAddress->ai_addr, sizeof(m_address));
+	m_address.sin_port = htons(m_config.nPort);
+	freeaddrinfo(pAddress);
+
+	unsigned nThreads = m_config.nThreads ? m_config.nThreads : std::thread::hardware_concurrency();
+	nThreads = (std::max)(1u, (std::min)(nThreads, m_config.nConnections));
+
+	for (unsigned i = 0; i < nThreads; i++)
+	{
+		stWORKER* pWorker = new stWORKER();
+		pWorker->nEpoll = -1;
+		pWorker->nTimer = -1;
+		// Connections dealt out round robin, so the threads differ by one at most
+		unsigned nConnections = m_config.nConnections / nThreads + (i < m_config.nConnections % nThreads ? 1 : 0);
+		pWorker->connections.resize(nConnections);
+		pWorker->nNextConnection = 0;
+		pWorker->nNextSend = 0;
+		pWorker->random.seed(m_config.nSeed + i);
+		// The thread's share of the rate, in proportion to its connections
+		pWorker->nInterval = (m_config.mode == LOAD_OPEN && m_config.dRate > 0 && nConnections > 0) ?
+			(std::max)((int64_t)1, (int64_t)(1e9 * m_config.nConnections / (m_config.dRate * nConnections))) : 0;
+		m_workers.push_back(pWorker);
+	}
+	for (stWORKER* pWorker : m_workers)
+	{
+		pWorker->thread = std::thread(&LoadGenerator::WorkerThread, this, pWorker);
+	}
+
+	while (m_nReady.load(std::memory_order_acquire) < nThreads)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	int64_t nNow = StatsNow();
+	m_nMeasureStart = nNow + (int64_t)(m_config.dWarmup * 1e9);
+	m_nEnd = m_nMeasureStart + (int64_t)(m_config.dDuration * 1e9);
+	m_bStart.store(true, std::memory_order_release);
+
+	// CPU over the measured period alone, not connecting or warming up
+	std::this_thread::sleep_for(std::chrono::nanoseconds(m_nMeasureStart - StatsNow()));
+	double dCpu = ProcessCpu(0);
+	double dServerCpu = m_config.nCpuPid ? ProcessCpu(m_config.nCpuPid) : -1;
+	std::this_thread::sleep_for(std::chrono::nanoseconds(m_nEnd - StatsNow()));
+	result.dCpu = ProcessCpu(0) - dCpu;
+	if (dServerCpu >= 0)
+	{
+		double dServerCpuEnd = ProcessCpu(m_config.nCpuPid);
+		result.dServerCpu = (dServerCpuEnd >= 0) ? dServerCpuEnd - dServerCpu : -1;
+	}
+
+	for (stWORKER* pWorker : m_workers)
+	{
+		pWorker->thread.join();
+		const stLOADRESULT& own = pWorker->result;
+		result.nConnected += own.nConnected;
+		result.nRequests += own.nRequests;
+		result.nResponses += own.nResponses;
+		result.nBytesOut += own.nBytesOut;
+		result.nBytesIn += own.nBytesIn;
+		result.nConnectErrors += own.nConnectErrors;
+		result.nErrors += own.nErrors;
+		result.nOutstanding += own.nOutstanding;
+		result.latency.Add(own.latency);
+		result.service.Add(own.service);
+	}
+	result.dElapsed = (m_nEnd - m_nMeasureStart) / 1e9;
+	return result.nConnected > 0;
+}
+
+bool LoadGenerator::Connect(stWORKER* pWorker, stCONNECTION& connection)
+{
+	connection.nSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (connection.nSocket < 0)
+	{
+		return false;
+	}
+	int nNoDelay = 1;
+	setsockopt(connection.nSocket, IPPROTO_TCP, TCP_NODELAY, &nNoDelay, sizeof(nNoDelay));
+	if (connect(connection.nSocket, (sockaddr*)&m_address, sizeof(m_address)) != 0 && errno != EINPROGRESS)
+	{
+		close(connection.nSocket);
+		connection.nSocket = -1;
+		return false;
+	}
+
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = &connection;
+	if (epoll_ctl(pWorker->nEpoll, EPOLL_CTL_ADD, connection.nSocket, &event) != 0)
+	{
+		close(connection.nSocket);
+		connection.nSocket = -1;
+		return false;
+	}
+	return true;
+}
+
+void LoadGenerator::Drop(stWORKER* pWorker, stCONNECTION& connection)
+{
+	if (connection.nSocket < 0)
+	{
+		return;
+	}
+	close(connection.nSocket);
+	connection.nSocket = -1;
+	if (connection.bConnected)
+	{
+		connection.bConnected = false;
+		pWorker->result.nErrors++;
+	}
+	else
+	{
+		pWorker->result.nConnectErrors++;
+	}
+	connection.requests.clear();
+	connection.nWritten = 0;
+	connection.nUnsentBytes = 0;
+}
+
+int64_t LoadGenerator::NextGap(stWORKER* pWorker)
+{
+	if (m_config.arrival == ARRIVAL_POISSON)
+	{
+		return (std::max)((int64_t)1, (int64_t)(pWorker->gaps(pWorker->random) * pWorker->nInterval));
+	}
+	return pWorker->nInterval;
+}
+
+void LoadGenerator::Request(stWORKER* pWorker, stCONNECTION& connection, int64_t nDue)
+{
+	stREQUEST request;
+	request.nDue = nDue;
+	request.nWritten = 0;
+	connection.requests.push_back(request);
+	connection.nUnsentBytes += m_nFrameSize;
+	if (IsMeasuring(nDue))
+	{
+		pWorker->result.nRequests++;
+		pWorker->result.nBytesOut += m_nFrameSize;
+	}
+	if (connection.bWritable && !Flush(connection))
+	{
+		Drop(pWorker, connection);
+	}
+}
+
+bool LoadGenerator::Flush(stCONNECTION& connection)
+{
+	while (connection.nUnsentBytes > 0)
+	{
+		// The stream of requests is m_frames over and over; nFrameOffset is where it is
+		size_t nLength = (size_t)(std::min)(connection.nUnsentBytes, (uint64_t)(m_frames.size() - connection.nFrameOffset));
+		ssize_t nSent = send(connection.nSocket, &m_frames[connection.nFrameOffset], nLength, MSG_NOSIGNAL);
+		if (nSent < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				connection.bWritable = false;
+				return true;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		connection.nUnsentBytes -= nSent;
+		connection.nFrameOffset = (unsigned)((connection.nFrameOffset + nSent) % m_frames.size());
+
+		// The requests whose last byte went out; the unsent ones are all at the back
+		size_t nUnsent = (size_t)((connection.nUnsentBytes + m_nFrameSize - 1) / m_nFrameSize);
+		size_t nWritten = connection.requests.size() - nUnsent;
+		if (connection.nWritten < nWritten)
+		{
+			int64_t nNow = StatsNow();
+			for (; connection.nWritten < nWritten; connection.nWritten++)
+			{
+				connection.requests[connection.nWritten].nWritten = nNow;
+			}
+		}
+	}
+	return true;
+}
+
+bool LoadGenerator::Receive(stWORKER* pWorker, stCONNECTION& connection)
+{
+	static thread_local char s_buffer[c_framesBytes];
+
+	while (1)
+	{
+		ssize_t nReceived = recv(connection.nSocket, s_buffer, sizeof(s_buffer), 0);
+		if (nReceived == 0)
+		{
+			return false;
+		}
+		if (nReceived < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return true;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+
+		int64_t nNow = StatsNow();
+		if (IsMeasuring(nNow))
+		{
+			pWorker->result.nBytesIn += nReceived;
+		}
+		const char* pData = s_buffer;
+		const char* pEnd = s_buffer + nReceived;
+		while (pData < pEnd)
+		{
+			if (connection.nPayloadLeft == 0)
+			{
+				// The header may straddle receives; collect it a byte at a time
+				connection.header[connection.nHeaderLength++] = *pData++;
+				unsigned nPayload = 0;
+				int nHeader = DecodeFrameHeader(connection.header, connection.nHeaderLength, nPayload);
+				if (nHeader < 0)
+				{
+					return false;
+				}
+				if (nHeader == 0)
+				{
+					continue;
+				}
+				connection.nHeaderLength = 0;
+				connection.nPayloadLeft = nPayload;
+			}
+			else
+			{
+				uint64_t nSkip = (std::min)(connection.nPayloadLeft, (uint64_t)(pEnd - pData));
+				pData += nSkip;
+				connection.nPayloadLeft -= nSkip;
+			}
+			if (connection.nPayloadLeft > 0)
+			{
+				continue;
+			}
+
+			// A whole reply, for the oldest request
+			if (connection.nWritten == 0)
+			{
+				return false;
+			}
+			stREQUEST request = connection.requests.front();
+			connection.requests.pop_front();
+			connection.nWritten--;
+			if (IsMeasuring(nNow))
+			{
+				pWorker->result.nResponses++;
+				pWorker->result.latency.Record((uint64_t)(std::max)((int64_t)0, nNow - request.nDue));
+				pWorker->result.service.Record((uint64_t)(std::max)((int64_t)0, nNow - request.nWritten));
+			}
+			if (m_config.mode == LOAD_CLOSED && nNow < m_nEnd && connection.bConnected)
+			{
+				Request(pWorker, connection, nNow);
+				if (!connection.bConnected)
+				{
+					return true;
+				}
+			}
+		}
+	}
+}
+
+void LoadGenerator::WorkerThread(stWORKER* pWorker)
+{
+	stLOADRESULT& result = pWorker->result;
+	pWorker->nEpoll = epoll_create1(EPOLL_CLOEXEC);
+	pWorker->nTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+	if (pWorker->nEpoll < 0 || pWorker->nTimer < 0 ||
+		epoll_ctl(pWorker->nEpoll, EPOLL_CTL_ADD, pWorker->nTimer, &event) != 0)
+	{
+		fprintf(stderr, "[ERROR] epoll or timerfd creation failure : %d\n", errno);
+		m_nReady++;
+		return;
+	}
+
+	// Connect everything first, so that no thread starts loading the server early
+	unsigned nPending = 0;
+	for (stCONNECTION& connection : pWorker->connections)
+	{
+		connection.nSocket = -1;
+		connection.bConnected = false;
+		connection.bWritable = false;
+		connection.nUnsentBytes = 0;
+		connection.nFrameOffset = 0;
+		connection.nHeaderLength = 0;
+		connection.nPayloadLeft = 0;
+		connection.nWritten = 0;
+		if (Connect(pWorker, connection))
+		{
+			nPending++;
+		}
+		else
+		{
+			result.nConnectErrors++;
+		}
+	}
+	epoll_event events[c_maxEvents];
+	int64_t nConnectDeadline = StatsNow() + c_connectTimeoutNs;
+	while (nPending > 0 && StatsNow() < nConnectDeadline)
+	{
+		int nEvents = epoll_wait(pWorker->nEpoll, events, c_maxEvents, 100);
+		for (int i = 0; i < nEvents; i++)
+		{
+			stCONNECTION* pConnection = (stCONNECTION*)events[i].data.ptr;
+			if (pConnection == NULL || pConnection->bConnected || pConnection->nSocket < 0)
+			{
+				continue;
+			}
+			int nError = 0;
+			socklen_t nLength = sizeof(nError);
+			getsockopt(pConnection->nSocket, SOL_SOCKET, SO_ERROR, &nError, &nLength);
+			if (nError == 0 && (events[i].events & EPOLLOUT))
+			{
+				pConnection->bConnected = true;
+				pConnection->bWritable = true;
+				result.nConnected++;
+				nPending--;
+			}
+			else if (nError != 0 || (events[i].events & (EPOLLERR | EPOLLHUP)))
+			{
+				Drop(pWorker, *pConnection);
+				nPending--;
+			}
+		}
+	}
+	for (stCONNECTION& connection : pWorker->connections)
+	{
+		if (!connection.bConnected)
+		{
+			Drop(pWorker, connection);
+		}
+	}
+
+	m_nReady++;
+	while (!m_bStart.load(std::memory_order_acquire))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	int64_t nNow = StatsNow();
+	if (m_config.mode == LOAD_CLOSED)
+	{
+		for (stCONNECTION& connection : pWorker->connections)
+		{
+			for (unsigned i = 0; i < m_config.nConcurrency && connection.bConnected; i++)
+			{
+				Request(pWorker, connection, nNow);
+			}
+		}
+	}
+	pWorker->nNextSend = nNow + NextGap(pWorker);
+
+	while ((nNow = StatsNow()) < m_nEnd && result.nConnected > result.nErrors)
+	{
+		if (pWorker->nInterval > 0)
+		{
+			// Every request that has come due goes out now, each charged from when it was due
+			size_t nConnections = pWorker->connections.size();
+			while (pWorker->nNextSend <= nNow)
+			{
+				stCONNECTION* pConnection = NULL;
+				for (size_t i = 0; i < nConnections && pConnection == NULL; i++)
+				{
+					stCONNECTION& connection = pWorker->connections[pWorker->nNextConnection];
+					pWorker->nNextConnection = (unsigned)((pWorker->nNextConnection + 1) % nConnections);
+					if (connection.bConnected)
+					{
+						pConnection = &connection;
+					}
+				}
+				if (pConnection == NULL)
+				{
+					break;
+				}
+				Request(pWorker, *pConnection, pWorker->nNextSend);
+				pWorker->nNextSend += NextGap(pWorker);
+			}
+		}
+
+		// Wake for the next due request, or for the end of the run
+		int64_t nWake = (pWorker->nInterval > 0) ? (std::min)(pWorker->nNextSend, m_nEnd) : m_nEnd;
+		itimerspec timer;
+		memset(&timer, 0, sizeof(timer));
+		timer.it_value.tv_sec = nWake / 1000000000LL;
+		timer.it_value.tv_nsec = nWake % 1000000000LL;
+		timerfd_settime(pWorker->nTimer, TFD_TIMER_ABSTIME, &timer, NULL);
+
+		int nEvents = epoll_wait(pWorker->nEpoll, events, c_maxEvents, -1);
+		for (int i = 0; i < nEvents; i++)
+		{
+			stCONNECTION* pConnection = (stCONNECTION*)events[i].data.ptr;
+			if (pConnection == NULL)
+			{
+				uint64_t nExpirations;
+				while (read(pWorker->nTimer, &nExpirations, sizeof(nExpirations)) > 0)
+				{
+				}
+				continue;
+			}
+			if (!pConnection->bConnected)
+			{
+				continue;
+			}
+			if (events[i].events & EPOLLOUT)
+			{
+				pConnection->bWritable = true;
+				if (!Flush(*pConnection))
+				{
+					Drop(pWorker, *pConnection);
+					continue;
+				}
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && !Receive(pWorker, *pConnection))
+			{
+				Drop(pWorker, *pConnection);
+			}
+		}
+	}
+
+	for (stCONNECTION& connection : pWorker->connections)
+	{
+		result.nOutstanding += connection.requests.size();
+		if (connection.nSocket >= 0)
+		{
+			close(connection.nSocket);
+			connection.nSocket = -1;
+		}
+	}
+	close(pWorker->nTimer);
+	close(pWorker->nEpoll);
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../iocp_server/iocp_server/Framing.h"
+#include "../iocp_server/iocp_server/Stats.h"
+
+// How requests are paced
+enum LOAD_MODE
+{
+	LOAD_CLOSED,				// A fixed number in flight per connection; each reply sends the next
+	LOAD_OPEN,					// On a fixed-rate timeline, whether or not replies keep up
+};
+
+// Gaps between open loop requests
+enum LOAD_ARRIVAL
+{
+	ARRIVAL_UNIFORM,			// All the same, 1 / rate
+	ARRIVAL_POISSON,			// Exponentially distributed around 1 / rate, as from many independent clients
+};
+
+struct stLOADCONFIG
+{
+	const char*		pHost = "127.0.0.1";
+	unsigned short	nPort = 8000;
+	unsigned		nConnections = 100;
+	unsigned		nThreads = 0;				// 0 = one per CPU, never more than connections
+	unsigned		nMessageSize = 64;			// Payload bytes of a request
+	LOAD_MODE		mode = LOAD_CLOSED;
+	unsigned		nConcurrency = 1;			// Requests in flight per connection, closed loop
+	double			dRate = 0;					// Requests per second over all connections, open loop
+	LOAD_ARRIVAL	arrival = ARRIVAL_UNIFORM;
+	uint64_t		nSeed = 1;					// Of the Poisson arrivals; thread i uses nSeed + i
+	double			dDuration = 10;				// Seconds measured
+	double			dWarmup = 1;				// Seconds run before measuring
+	int				nCpuPid = 0;				// Process whose CPU time is sampled over the measured period
+};
+
+// What a run measured
+struct stLOADRESULT
+{
+	unsigned		nConnected = 0;
+	uint64_t		nRequests = 0;				// Sent while measuring
+	uint64_t		nResponses = 0;				// Received while measuring
+	uint64_t		nBytesOut = 0;
+	uint64_t		nBytesIn = 0;
+	uint64_t		nConnectErrors = 0;
+	uint64_t		nErrors = 0;				// Connections lost during the run
+	uint64_t		nOutstanding = 0;			// Requests without a reply at the end
+	double			dElapsed = 0;				// Seconds actually measured
+	double			dCpu = 0;					// CPU seconds of this process while measuring
+	double			dServerCpu = -1;			// Of the nCpuPid process, -1 if it could not be read
+	Histogram		latency;					// Nanoseconds from when a request was due to its reply
+	Histogram		service;					// Nanoseconds from when a request was written to its reply
+};
+
+/**
+ * Headless load generator for the framed echo of iocp_server and multithread_server:
+ * every request is a frame of nMessageSize bytes, and the server echoes it back in
+ * order, so replies are matched to requests first in, first out.
+ *
+ * Each thread runs an edge-triggered epoll loop over its share of the connections.
+ * In the closed loop a reply releases the next request, so latency is the service time
+ * the server gave; in the open loop requests are due on a timeline of their own and
+ * latency is taken from when a request was due, not from when it could be written, so
+ * a stalled server is charged for every request it held up (no coordinated omission).
+ * The service time, from when the socket took the request's last byte, is kept apart
+ * so the queueing delay is the difference of the two.
+ *
+ * Every thread records into histograms of its own, which are merged at the end.
+ */
+class LoadGenerator
+{
+public:
+	explicit LoadGenerator(const stLOADCONFIG& config);
+	~LoadGenerator();
+
+	// Connect, run the warmup and the measured period, and gather the threads' results
+	bool Run(stLOADRESULT& result);
+
+private:
+	struct stREQUEST
+	{
+		int64_t				nDue;				// When it was meant to go out
+		int64_t				nWritten;			// When its last byte was sent, 0 until then
+	};
+
+	struct stCONNECTION
+	{
+		int					nSocket;
+		bool				bConnected;
+		bool				bWritable;			// No EAGAIN since the last EPOLLOUT
+		uint64_t			nUnsentBytes;		// Of the frames queued
+		unsigned			nFrameOffset;		// Where in m_frames the next byte to send is
+		std::deque<stREQUEST>	requests;		// Those without a reply, oldest first
+		size_t				nWritten;			// Requests at the front the socket has taken whole
+		char				header[FRAME_HEADER_MAX];	// Reply header bytes collected so far
+		unsigned			nHeaderLength;
+		uint64_t			nPayloadLeft;		// Reply payload bytes still to skip
+	};
+
+	// One thread's connections and counts; only its thread touches it until the join
+	struct alignas(64) stWORKER
+	{
+		int							nEpoll;
+		int							nTimer;			// timerfd for the next due request
+		std::vector<stCONNECTION>	connections;
+		unsigned					nNextConnection;	// Round robin for open loop requests
+		int64_t						nNextSend;		// When the next open loop request is due
+		int64_t						nInterval;		// Nanoseconds between them, on average
+		std::mt19937_64				random;			// For Poisson arrivals
+		std::exponential_distribution<double>	gaps;	// Of mean 1, scaled by nInterval
+		std::thread					thread;
+		stLOADRESULT				result;
+	};
+
+	void WorkerThread(stWORKER* pWorker);
+	bool Connect(stWORKER* pWorker, stCONNECTION& connection);
+	// Queue a request with its latency origin, and write what the socket takes
+	void Request(stWORKER* pWorker, stCONNECTION& connection, int64_t nDue);
+	// Time from one open loop request to the next
+	int64_t NextGap(stWORKER* pWorker);
+	bool Flush(stCONNECTION& connection);
+	bool Receive(stWORKER* pWorker, stCONNECTION& connection);
+	void Drop(stWORKER* pWorker, stCONNECTION& connection);
+	bool IsMeasuring(int64_t nNow) const { return nNow >= m_nMeasureStart && nNow < m_nEnd; }
+
+	stLOADCONFIG			m_config;
+	sockaddr_in				m_address;
+	std::vector<char>		m_frames;			// Request frames back to back, sent from as one stream
+	unsigned				m_nFrameSize;
+	std::vector<stWORKER*>	m_workers;
+	std::atomic<unsigned>	m_nReady;			// Threads done connecting
+	std::atomic<bool>		m_bStart;
+	int64_t					m_nMeasureStart;	// StatsNow() times, set before m_bStart
+	int64_t					m_nEnd;
+};
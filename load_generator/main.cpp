@@ -0,0 +1,136 @@
+// main.cpp: Define the entry point of the load generator
+//
+// Usage: load_generator [--host=NAME] [--port=N] [--connections=N] [--threads=N] [--size=BYTES]
+//                       [--concurrency=N | --rate=PER_SECOND] [--arrival=uniform|poisson] [--seed=N]
+//                       [--duration=SECONDS] [--warmup=SECONDS] [--cpu-pid=PID]
+//
+// Drives the framed echo of iocp_server (or multithread_server --protocol=echo) and prints
+// the results as "name value" lines. --concurrency keeps N requests in flight per connection
+// (closed loop, the default with 1); --rate sends on a timeline of its own instead (open loop),
+// evenly spaced or as Poisson arrivals. latency_us is measured from when each request was due,
+// service_us from when it was written. --cpu-pid adds the CPU time the server process used
+// while measuring, per response.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <string>
+
+#include "LoadGenerator.h"
+
+int main(int argc, char* argv[])
+{
+	stLOADCONFIG config;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--host=", 7) == 0)
+		{
+			config.pHost = argv[i] + 7;
+		}
+		else if (strncmp(argv[i], "--port=", 7) == 0)
+		{
+			config.nPort = (unsigned short)atoi(argv[i] + 7);
+		}
+		else if (strncmp(argv[i], "--connections=", 14) == 0)
+		{
+			config.nConnections = (unsigned)atoi(argv[i] + 14);
+		}
+		else if (strncmp(argv[i], "--threads=", 10) == 0)
+		{
+			config.nThreads = (unsigned)atoi(argv[i] + 10);
+		}
+		else if (strncmp(argv[i], "--size=", 7) == 0)
+		{
+			config.nMessageSize = (unsigned)atoi(argv[i] + 7);
+		}
+		else if (strncmp(argv[i], "--concurrency=", 14) == 0)
+		{
+			config.mode = LOAD_CLOSED;
+			config.nConcurrency = (unsigned)atoi(argv[i] + 14);
+		}
+		else if (strncmp(argv[i], "--rate=", 7) == 0)
+		{
+			config.mode = LOAD_OPEN;
+			config.dRate = atof(argv[i] + 7);
+		}
+		else if (strcmp(argv[i], "--arrival=uniform") == 0)
+		{
+			config.arrival = ARRIVAL_UNIFORM;
+		}
+		else if (strcmp(argv[i], "--arrival=poisson") == 0)
+		{
+			config.arrival = ARRIVAL_POISSON;
+		}
+		else if (strncmp(argv[i], "--seed=", 7) == 0)
+		{
+			config.nSeed = strtoull(argv[i] + 7, NULL, 10);
+		}
+		else if (strncmp(argv[i], "--duration=", 11) == 0)
+		{
+			config.dDuration = atof(argv[i] + 11);
+		}
+		else if (strncmp(argv[i], "--warmup=", 9) == 0)
+		{
+			config.dWarmup = atof(argv[i] + 9);
+		}
+		else if (strncmp(argv[i], "--cpu-pid=", 10) == 0)
+		{
+			config.nCpuPid = atoi(argv[i] + 10);
+		}
+		else
+		{
+			fprintf(stderr, "[ERROR] Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (config.nConnections == 0 || config.dDuration <= 0 ||
+		(config.mode == LOAD_CLOSED && config.nConcurrency == 0) || (config.mode == LOAD_OPEN && config.dRate <= 0))
+	{
+		fprintf(stderr, "[ERROR] Connections, duration and the concurrency or rate must be positive\n");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	LoadGenerator generator(config);
+	stLOADRESULT result;
+	if (!generator.Run(result))
+	{
+		fprintf(stderr, "[ERROR] No connection to %s:%u\n", config.pHost, (unsigned)config.nPort);
+		return 1;
+	}
+
+	std::string text;
+	char line[128];
+	snprintf(line, sizeof(line), "mode %s\n", (config.mode == LOAD_CLOSED) ? "closed" :
+		(config.arrival == ARRIVAL_POISSON) ? "open_poisson" : "open_uniform");
+	text += line;
+	snprintf(line, sizeof(line), "connections %u\nconnect_errors %llu\nerrors %llu\n", result.nConnected,
+		(unsigned long long)result.nConnectErrors, (unsigned long long)result.nErrors);
+	text += line;
+	snprintf(line, sizeof(line), "duration_s %.3f\nrequests %llu\nresponses %llu\noutstanding %llu\n", result.dElapsed,
+		(unsigned long long)result.nRequests, (unsigned long long)result.nResponses,
+		(unsigned long long)result.nOutstanding);
+	text += line;
+	snprintf(line, sizeof(line), "bytes_out %llu\nbytes_in %llu\n",
+		(unsigned long long)result.nBytesOut, (unsigned long long)result.nBytesIn);
+	text += line;
+	snprintf(line, sizeof(line), "requests_per_s %.1f\nresponses_per_s %.1f\nmb_in_per_s %.2f\n",
+		result.nRequests / result.dElapsed, result.nResponses / result.dElapsed,
+		result.nBytesIn / result.dElapsed / (1024 * 1024));
+	text += line;
+	snprintf(line, sizeof(line), "client_cpu_s %.3f\n", result.dCpu);
+	text += line;
+	if (result.dServerCpu >= 0)
+	{
+		snprintf(line, sizeof(line), "server_cpu_s %.3f\nserver_cpu_us_per_response %.3f\n", result.dServerCpu,
+			result.nResponses ? result.dServerCpu * 1e6 / result.nResponses : 0.0);
+		text += line;
+	}
+	FormatHistogram(text, "latency_us", result.latency, 1000.0);
+	FormatHistogram(text, "service_us", result.service, 1000.0);
+	fputs(text.c_str(), stdout);
+	return (result.nErrors == 0) ? 0 : 2;
+}
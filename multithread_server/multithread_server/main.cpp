@@ -1,107 +1,468 @@
-
 // It's modified from https://www.codeproject.com/Articles/13382/A-simple-application-using-I-O-Completion-Ports-an?msg=3799614
+//
+// Usage: multithread_server [--mode=pool|thread] [--port=N] [--threads=N] [--queue=N]
+//                           [--protocol=ack|echo] [--max-frame=BYTES] [--stats-file=PATH] [stats-file]
+//
+// Blocking I/O, one connection per thread at a time. --mode=pool (the default) serves the
+// connections with a fixed number of threads fed by a bounded queue of accepted sockets;
+// --mode=thread starts a thread per connection, as the server originally did.
+// --protocol=ack answers every receive with ACK_MESG_RECV; --protocol=echo speaks the
+// framed echo of iocp_server, so the two can be measured with the same clients.
+
+#include "../../iocp_server/iocp_server/Platform.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <conio.h>
 #include <string.h>
-#include <winsock2.h>
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "../../iocp_server/iocp_server/Framing.h"
+#include "../../iocp_server/iocp_server/Log.h"
+#include "../../iocp_server/iocp_server/Stats.h"
 
 #define ACK_MESG_RECV "Message received successfully"
-#pragma comment (lib, "Ws2_32.lib")
+#define SERVER_PORT 8001
+#define RECV_BUFFER_SIZE 4096
+
+//How connections get a thread
+enum SERVER_MODE
+{
+    MODE_POOL,      //A fixed pool takes them from a bounded queue
+    MODE_THREAD,    //A new thread for each
+};
+
+//What the server answers
+enum SERVER_PROTOCOL
+{
+    PROTOCOL_ACK,   //ACK_MESG_RECV for every receive
+    PROTOCOL_ECHO,  //Every frame sent back, see Framing.h
+};
+
+struct stCONFIG
+{
+    SERVER_MODE     mode = MODE_POOL;
+    SERVER_PROTOCOL protocol = PROTOCOL_ACK;
+    unsigned short  nPort = SERVER_PORT;
+    int             nThreads = 0;               //Pool threads, 0 = two per CPU
+    unsigned        nQueueSize = 1024;          //Accepted sockets waiting for a pool thread
+    unsigned        nMaxFrameSize = 1 << 20;    //Payload limit of a frame in echo mode
+    const char*     pStatsFile = NULL;          //Stats are written here once a second when set
+};
 
 //global functions
 void AcceptConnections(SOCKET ListenSocket);
-DWORD WINAPI AcceptHandler(void* Socket);
+void PoolThread();
+void ConnectionThread(SOCKET Socket);
+void ServeConnection(SOCKET Socket, stSTATS& Stats);
+void StatsThread();
+
+static stCONFIG g_Config;
+
+//Accepted sockets for the pool; the acceptor waits while it is full, leaving the rest
+//in the listen backlog
+static std::mutex g_QueueLock;
+static std::condition_variable g_QueueNotEmpty;
+static std::condition_variable g_QueueNotFull;
+static std::deque<SOCKET> g_PendingSockets;
+
+//Threads serving a connection right now
+static std::atomic<int> g_nBusyThreads(0);
+
+//Counters of the threads alive, and the sum of the ones that have finished
+static std::mutex g_StatsLock;
+static std::vector<stSTATS*> g_ThreadStats;
+static stSTATS g_RetiredStats;
+//Counted by the accepting thread alone
+static stSTATS g_AcceptStats;
+
+//Counters of the calling thread, on cache lines of their own; the stats thread sums them
+static stSTATS* RegisterStats()
+{
+    stSTATS* pStats = new stSTATS();
+    std::lock_guard<std::mutex> lock(g_StatsLock);
+    g_ThreadStats.push_back(pStats);
+    return pStats;
+}
 
-//This function will loop on while creating a new thread for each client connection
+//Fold the counters into the retired ones, so the totals never go back
+static void RetireStats(stSTATS* pStats)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_StatsLock);
+        g_RetiredStats.Add(*pStats);
+        for (size_t i = 0; i < g_ThreadStats.size(); i++)
+        {
+            if (g_ThreadStats[i] == pStats)
+            {
+                g_ThreadStats.erase(g_ThreadStats.begin() + i);
+                break;
+            }
+        }
+    }
+    delete pStats;
+}
+
+static int LastSocketError()
+{
+#ifdef _WIN32
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+//Send all of the buffer; false on error
+static bool SendAll(SOCKET Socket, const char* pData, int nLength)
+{
+    while (nLength > 0)
+    {
+#ifdef _WIN32
+        int nBytesSent = send(Socket, pData, nLength, 0);
+#else
+        int nBytesSent = (int)send(Socket, pData, nLength, MSG_NOSIGNAL);
+#endif
+        if (SOCKET_ERROR == nBytesSent)
+        {
+            return false;
+        }
+        pData += nBytesSent;
+        nLength -= nBytesSent;
+    }
+    return true;
+}
+
+//This function will loop on, handing each client connection to a thread
 void AcceptConnections(SOCKET ListenSocket)
 {
     sockaddr_in ClientAddress;
-    int nClientLength = sizeof(ClientAddress);
 
-    //Infinite, no graceful shutdown of server implemented, 
+    //Infinite, no graceful shutdown of server implemented,
     //preferably server should be implemented as a service
     //Events can also be used for graceful shutdown
     while (1)
     {
         //Accept remote connection attempt from the client
+        socklen_t nClientLength = sizeof(ClientAddress);
         SOCKET Socket = accept(ListenSocket, (sockaddr*)&ClientAddress, &nClientLength);
 
         if (INVALID_SOCKET == Socket)
         {
-            printf("\nError occurred while accepting socket: %ld.", WSAGetLastError());
+            int nError = LastSocketError();
+            LOG_ERROR("Error occurred while accepting socket: %ld.", nError);
+            g_AcceptStats.CountError(STAT_ERRORS_ACCEPT, -nError);
+            //Out of descriptors, most likely; give the open connections a moment to close
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
         }
+        g_AcceptStats.Count(STAT_ACCEPTS);
 
-        //Display Client's IP
-
-        DWORD nThreadID;
+        if (MODE_THREAD == g_Config.mode)
+        {
+            //One thread per connection, kept for comparison with the pool. Out of
+            //threads, the connection is dropped rather than the whole server.
+            try
+            {
+                std::thread(ConnectionThread, Socket).detach();
+            }
+            catch (const std::system_error& e)
+            {
+                LOG_ERROR("Error occurred while starting a connection thread: %s.", e.what());
+                g_AcceptStats.CountError(STAT_ERRORS_ACCEPT, -e.code().value());
+                closesocket(Socket);
+            }
+            continue;
+        }
 
-        //Spawn one thread for each client connection, not a wise idea.
-        //One should limit the number of threads or use I/O completion port
-        CreateThread(0, 0, AcceptHandler, (void*)Socket, 0, &nThreadID);
+        std::unique_lock<std::mutex> lock(g_QueueLock);
+        g_QueueNotFull.wait(lock, [] { return g_PendingSockets.size() < g_Config.nQueueSize; });
+        g_PendingSockets.push_back(Socket);
+        lock.unlock();
+        g_QueueNotEmpty.notify_one();
     }
+}
 
+//Pool thread: serves the queued connections one after the other
+void PoolThread()
+{
+    stSTATS* pStats = RegisterStats();
+    while (1)
+    {
+        SOCKET Socket;
+        {
+            std::unique_lock<std::mutex> lock(g_QueueLock);
+            g_QueueNotEmpty.wait(lock, [] { return !g_PendingSockets.empty(); });
+            Socket = g_PendingSockets.front();
+            g_PendingSockets.pop_front();
+        }
+        g_QueueNotFull.notify_one();
+        ServeConnection(Socket, *pStats);
+    }
 }
 
-//Thread procedure one thread will be created for each client.
-DWORD WINAPI AcceptHandler(void* Socket)
+//Thread procedure of --mode=thread, one will be created for each client.
+void ConnectionThread(SOCKET Socket)
 {
-    SOCKET RemoteSocket = (SOCKET)Socket;
+    stSTATS* pStats = RegisterStats();
+    ServeConnection(Socket, *pStats);
+    RetireStats(pStats);
+}
 
+//Answer every receive with the acknowledgement
+static bool ServeAck(SOCKET RemoteSocket, stSTATS& Stats)
+{
     char szBuffer[256];
 
-    //Cleanup and Init with 0 the szBuffer
-    ZeroMemory(szBuffer, 256);
-
-    int nBytesSent;
-    int nBytesRecv;
     while (1)
     {
         //Receive data from a connected or bound socket
-        nBytesRecv = recv(RemoteSocket, szBuffer, 255, 0);
+        int nBytesRecv = recv(RemoteSocket, szBuffer, 255, 0);
 
         if (SOCKET_ERROR == nBytesRecv)
         {
-            closesocket(RemoteSocket);
-            printf("\nError occurred while receiving from socket.");
-            return 1; //error
+            int nError = LastSocketError();
+            LOG_ERROR("Error occurred while receiving from socket: %ld.", nError);
+            Stats.CountError(STAT_ERRORS_RECV, -nError);
+            return false;
         }
-        else
+        else if (0 == nBytesRecv)
         {
-            printf("\nrecv() successful.");
+            //The client closed the connection
+            return true;
         }
+        int64_t nRecvTime = StatsNow();
+        Stats.Count(STAT_BYTES_IN, nBytesRecv);
+        Stats.Count(STAT_MESSAGES_IN);
 
-        //Display the message received on console
-        printf("\nThe following message was received: %s", szBuffer);
+        //Log the message received; the ring keeps a copy, so the buffer is free to reuse
+        szBuffer[nBytesRecv] = '\0';
+        LOG_DEBUG("The following message was received: %s", szBuffer);
 
-        //Send data on a connected socket to the client
-        nBytesSent = send(RemoteSocket, ACK_MESG_RECV, strlen(ACK_MESG_RECV), 0);
+        //Send data on a connected socket to the client; while blocked here the send counts as in flight
+        Stats.Count(STAT_SENDS_POSTED);
+        bool bSent = SendAll(RemoteSocket, ACK_MESG_RECV, (int)strlen(ACK_MESG_RECV));
+        Stats.Count(STAT_SENDS_DONE);
 
-        if (SOCKET_ERROR == nBytesSent)
+        if (!bSent)
         {
-            closesocket(RemoteSocket);
-            printf("\nError occurred while writing to socket.");
-            return 1; //error
+            int nError = LastSocketError();
+            LOG_ERROR("Error occurred while writing to socket: %ld.", nError);
+            Stats.CountError(STAT_ERRORS_SEND, -nError);
+            return false;
         }
-        else
+        Stats.Count(STAT_BYTES_OUT, strlen(ACK_MESG_RECV));
+        Stats.Count(STAT_MESSAGES_OUT);
+        Stats.latency.Record((uint64_t)(StatsNow() - nRecvTime));
+    }
+}
+
+//Send every whole frame back as it is
+static bool ServeEcho(SOCKET RemoteSocket, stSTATS& Stats)
+{
+    //Grows to hold the largest frame seen; whole frames are echoed straight from it
+    std::vector<char> Buffer(RECV_BUFFER_SIZE);
+    size_t nHave = 0;
+
+    while (1)
+    {
+        if (nHave == Buffer.size())
         {
-            printf("\nsend() successful.");
+            Buffer.resize(Buffer.size() * 2);
         }
+        int nBytesRecv = recv(RemoteSocket, Buffer.data() + nHave, (int)(Buffer.size() - nHave), 0);
+
+        if (SOCKET_ERROR == nBytesRecv)
+        {
+            int nError = LastSocketError();
+            LOG_ERROR("Error occurred while receiving from socket: %ld.", nError);
+            Stats.CountError(STAT_ERRORS_RECV, -nError);
+            return false;
+        }
+        else if (0 == nBytesRecv)
+        {
+            //The client closed the connection
+            return true;
+        }
+        int64_t nRecvTime = StatsNow();
+        Stats.Count(STAT_BYTES_IN, nBytesRecv);
+        nHave += nBytesRecv;
+
+        //The frames that are whole go back in one send
+        size_t nWhole = 0;
+        unsigned nFrames = 0;
+        while (1)
+        {
+            unsigned nPayload = 0;
+            int nHeader = DecodeFrameHeader(Buffer.data() + nWhole, (unsigned)(nHave - nWhole), nPayload);
+            if (nHeader < 0 || (nHeader > 0 && nPayload > g_Config.nMaxFrameSize))
+            {
+                LOG_ERROR("Malformed or oversized frame, closing the connection.");
+                Stats.Count(STAT_ERRORS_FRAME);
+                return false;
+            }
+            if (0 == nHeader || nHave - nWhole - nHeader < nPayload)
+            {
+                break;
+            }
+            nWhole += nHeader + nPayload;
+            nFrames++;
+        }
+        if (0 == nFrames)
+        {
+            continue;
+        }
+        Stats.Count(STAT_MESSAGES_IN, nFrames);
+
+        Stats.Count(STAT_SENDS_POSTED);
+        bool bSent = SendAll(RemoteSocket, Buffer.data(), (int)nWhole);
+        Stats.Count(STAT_SENDS_DONE);
+
+        if (!bSent)
+        {
+            int nError = LastSocketError();
+            LOG_ERROR("Error occurred while writing to socket: %ld.", nError);
+            Stats.CountError(STAT_ERRORS_SEND, -nError);
+            return false;
+        }
+        Stats.Count(STAT_BYTES_OUT, nWhole);
+        Stats.Count(STAT_MESSAGES_OUT, nFrames);
+        Stats.latency.Record((uint64_t)(StatsNow() - nRecvTime));
+
+        //Keep the partial frame at the front
+        memmove(Buffer.data(), Buffer.data() + nWhole, nHave - nWhole);
+        nHave -= nWhole;
     }
+}
 
-    return 0; //success
+//Serve one client until it disconnects, then close its socket
+void ServeConnection(SOCKET RemoteSocket, stSTATS& Stats)
+{
+    g_nBusyThreads++;
+    Stats.Count(STAT_OPENED);
+
+    if (PROTOCOL_ECHO == g_Config.protocol)
+    {
+        ServeEcho(RemoteSocket, Stats);
+    }
+    else
+    {
+        ServeAck(RemoteSocket, Stats);
+    }
+
+    closesocket(RemoteSocket);
+    Stats.Count(STAT_CLOSED);
+    g_nBusyThreads--;
+}
+
+//Writes the stats file once a second
+void StatsThread()
+{
+    stSTATS* pTotal = new stSTATS();
+    auto StartTime = std::chrono::steady_clock::now();
+
+    while (1)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        std::string text;
+        char szLine[128];
+        size_t nQueued;
+        pTotal->Reset();
+        {
+            std::lock_guard<std::mutex> lock(g_StatsLock);
+            pTotal->Add(g_RetiredStats);
+            for (stSTATS* pStats : g_ThreadStats)
+            {
+                pTotal->Add(*pStats);
+            }
+        }
+        pTotal->Add(g_AcceptStats);
+        {
+            std::lock_guard<std::mutex> lock(g_QueueLock);
+            nQueued = g_PendingSockets.size();
+        }
+
+        long long nUptimeMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - StartTime).count();
+        snprintf(szLine, sizeof(szLine), "uptime_ms %lld\nthreads %d\nqueued_connections %zu\n",
+            nUptimeMs, g_nBusyThreads.load(), nQueued);
+        text += szLine;
+        FormatStats(text, *pTotal);
+        if (!WriteStatsFile(g_Config.pStatsFile, text))
+        {
+            LOG_ERROR("Stats file %s could not be written", g_Config.pStatsFile);
+        }
+    }
 }
 
 int main(int argc, char* argv[])
 {
-    //Validate the input
-    /*if (argc < 2)
+    for (int i = 1; i < argc; i++)
     {
-        printf("\nUsage: %s port.", argv[0]);
-        goto error;
-    }*/
+        if (strcmp(argv[i], "--mode=pool") == 0)
+        {
+            g_Config.mode = MODE_POOL;
+        }
+        else if (strcmp(argv[i], "--mode=thread") == 0)
+        {
+            g_Config.mode = MODE_THREAD;
+        }
+        else if (strcmp(argv[i], "--protocol=ack") == 0)
+        {
+            g_Config.protocol = PROTOCOL_ACK;
+        }
+        else if (strcmp(argv[i], "--protocol=echo") == 0)
+        {
+            g_Config.protocol = PROTOCOL_ECHO;
+        }
+        else if (strncmp(argv[i], "--port=", 7) == 0)
+        {
+            g_Config.nPort = (unsigned short)atoi(argv[i] + 7);
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            g_Config.nThreads = atoi(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--queue=", 8) == 0)
+        {
+            g_Config.nQueueSize = (unsigned)atoi(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "--max-frame=", 12) == 0)
+        {
+            g_Config.nMaxFrameSize = (unsigned)atoi(argv[i] + 12);
+        }
+        else if (strncmp(argv[i], "--stats-file=", 13) == 0)
+        {
+            g_Config.pStatsFile = argv[i] + 13;
+        }
+        else if (argv[i][0] != '-')
+        {
+            //The stats file used to be the only argument
+            g_Config.pStatsFile = argv[i];
+        }
+        else
+        {
+            printf("\nUnknown option %s", argv[i]);
+            return 1; //error
+        }
+    }
+    if (g_Config.nQueueSize == 0)
+    {
+        g_Config.nQueueSize = 1;
+    }
 
+#ifdef _WIN32
     // Initialize Winsock
     WSADATA wsaData;
 
@@ -118,9 +479,12 @@ int main(int argc, char* argv[])
     {
         printf("\nWSAStartup() successful.");
     }
+#else
+    //A client that disconnects mid-send must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+#endif
 
     SOCKET ListenSocket;
-    int    nPortNo;
 
     struct sockaddr_in ServerAddress;
 
@@ -129,7 +493,7 @@ int main(int argc, char* argv[])
 
     if (INVALID_SOCKET == ListenSocket)
     {
-        printf("\nError occurred while opening socket: %ld.", WSAGetLastError());
+        printf("\nError occurred while opening socket: %d.", LastSocketError());
         goto error;
     }
     else
@@ -137,17 +501,21 @@ int main(int argc, char* argv[])
         printf("\nsocket() successful.");
     }
 
-    //Cleanup and Init with 0 the ServerAddress
-    ZeroMemory((char*)&ServerAddress, sizeof(ServerAddress));
-
-    //Port number will be supplied as a commandline argument
-    nPortNo = atoi("8001");
+#ifndef _WIN32
+    {
+        //Restarting for the next benchmark run should not wait for TIME_WAIT
+        int nReuse = 1;
+        setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&nReuse, sizeof(nReuse));
+    }
+#endif
 
+    //Cleanup and Init with 0 the ServerAddress
+    memset(&ServerAddress, 0, sizeof(ServerAddress));
 
     //Fill up the address structure
     ServerAddress.sin_family = AF_INET;
     ServerAddress.sin_addr.s_addr = INADDR_ANY; //WinSock will supply address
-    ServerAddress.sin_port = htons(nPortNo);    //comes from commandline
+    ServerAddress.sin_port = htons(g_Config.nPort);
 
     //Assign local address and port number
     if (SOCKET_ERROR == bind(ListenSocket, (struct sockaddr*)&ServerAddress, sizeof(ServerAddress)))
@@ -175,18 +543,57 @@ int main(int argc, char* argv[])
         printf("\nlisten() successful.");
     }
 
+    if (MODE_POOL == g_Config.mode)
+    {
+        int nThreads = g_Config.nThreads;
+        if (nThreads <= 0)
+        {
+            unsigned nCpuCount = std::thread::hardware_concurrency();
+            nThreads = 2 * (nCpuCount ? (int)nCpuCount : 1);
+        }
+        try
+        {
+            for (int i = 0; i < nThreads; i++)
+            {
+                std::thread(PoolThread).detach();
+            }
+        }
+        catch (const std::system_error& e)
+        {
+            closesocket(ListenSocket);
+
+            //The threads already started wait on the queue for good, and destroying
+            //its condition variables under them would hang; leave right away.
+            printf("\nError occurred while starting %d pool threads: %s.\n", nThreads, e.what());
+            fflush(stdout);
+            _Exit(1);
+        }
+        printf("\n%d pool threads, queue of %u connections.", nThreads, g_Config.nQueueSize);
+    }
+    fflush(stdout);
+
+    if (g_Config.pStatsFile)
+    {
+        std::thread(StatsThread).detach();
+    }
+
     //This function will take are of multiple clients using threads
     AcceptConnections(ListenSocket);
 
     //Close open sockets
     closesocket(ListenSocket);
 
+#ifdef _WIN32
     //Cleanup Winsock
     WSACleanup();
+#endif
+    LogShutdown();
     return 0; //success
 
 error:
+#ifdef _WIN32
     // Cleanup Winsock
     WSACleanup();
+#endif
     return 1; //error
-}
\ No newline at end of file
+}